@@ -0,0 +1,916 @@
+//######################################################
+//
+// Benchmarks for httpbridge.
+//
+// Usage: benchmark <name> [requests] [in-flight]
+//
+//   transport    Small request throughput over "tcp", "unix" and "shm" transports
+//   body         Large response throughput, with the body copied into the frame (SetBody) vs sent by reference (SetBodyRef)
+//   uring        Syscalls per request and p99 latency of "uring" vs "tcp", at a fixed request rate (needs HTTPBRIDGE_IO_URING)
+//   streams      Stream table operations per second from 1..[in-flight] threads, single lock vs hb::StreamMap
+//   response     Cost of building a Response (construct, AddHeader, SetBody, FinishFlatbuffer), and heap allocations per Response.
+//                Also the cost of a body part frame, from a Response vs from EncodeBodyPartFrame.
+//
+// The transport benchmarks do not need the Go server. Instead, a FakeServer plays the role
+// of the Go server, by listening for the backend, sending it small request frames, and
+// timing the response frames that come back. The backend runs on its own thread, in the
+// same process, and replies to every request with a tiny body.
+//
+//######################################################
+#include "http-bridge.h"
+#include "http-bridge_generated.h"
+#include <stdio.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+
+#ifdef _WIN32
+
+int main(int argc, char** argv)
+{
+	printf("The benchmarks are not supported on Windows\n");
+	return 1;
+}
+
+#else
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/perf_event.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static const char* TCPAddr = "127.0.0.1:8091";
+static const char* UnixAddr = "/tmp/httpbridge-benchmark.sock";
+
+#ifdef __linux__
+// The server side of the "shm" transport. This must match TransportShm in http-bridge.cpp.
+// Unlike the real thing, Send just spins when the ring is full, which is good enough for a benchmark.
+struct ShmPeer
+{
+	struct Ring
+	{
+		std::atomic<uint64_t>*	Tail;
+		std::atomic<uint64_t>*	Head;
+		std::atomic<uint32_t>*	ConsumerWaiting;
+		std::atomic<uint32_t>*	ProducerWaiting;
+		uint8_t*				Data;
+		int						DataReady;
+		int						SpaceReady;
+	};
+	uint8_t*	Mem = nullptr;
+	size_t		MemSize = 0;
+	size_t		RingSize = 0;
+	Ring		Rx;		// Backend -> Server
+	Ring		Tx;		// Server -> Backend
+	int			Fds[5] = {-1, -1, -1, -1, -1};
+
+	~ShmPeer()
+	{
+		if (Mem)
+			munmap(Mem, MemSize);
+		for (int fd : Fds)
+		{
+			if (fd != -1)
+				close(fd);
+		}
+	}
+
+	bool Handshake(int sock)
+	{
+		uint8_t msg[16];
+		char control[CMSG_SPACE(sizeof(Fds))];
+		iovec iov;
+		iov.iov_base = msg;
+		iov.iov_len = sizeof(msg);
+		msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &mh, 0) != sizeof(msg) || CMSG_FIRSTHDR(&mh) == nullptr)
+			return false;
+		memcpy(Fds, CMSG_DATA(CMSG_FIRSTHDR(&mh)), sizeof(Fds));
+		RingSize = hb::Read32LE(msg + 8);
+		size_t controlSize = hb::Read32LE(msg + 12);
+		MemSize = controlSize + 2 * RingSize;
+		Mem = (uint8_t*) mmap(nullptr, MemSize, PROT_READ | PROT_WRITE, MAP_SHARED, Fds[0], 0);
+		if (Mem == MAP_FAILED)
+		{
+			Mem = nullptr;
+			return false;
+		}
+		Rx = MakeRing(0, controlSize, Fds[1], Fds[2]);
+		Tx = MakeRing(1, controlSize, Fds[3], Fds[4]);
+		return send(sock, msg, 4, 0) == 4;
+	}
+
+	Ring MakeRing(int index, size_t controlSize, int dataReady, int spaceReady)
+	{
+		uint8_t* c = Mem + index * 256;
+		Ring r;
+		r.Tail = (std::atomic<uint64_t>*) c;
+		r.Head = (std::atomic<uint64_t>*) (c + 64);
+		r.ConsumerWaiting = (std::atomic<uint32_t>*) (c + 128);
+		r.ProducerWaiting = (std::atomic<uint32_t>*) (c + 132);
+		r.Data = Mem + controlSize + index * RingSize;
+		r.DataReady = dataReady;
+		r.SpaceReady = spaceReady;
+		return r;
+	}
+
+	static void RingDoorbell(int fd)
+	{
+		uint64_t one = 1;
+		if (write(fd, &one, sizeof(one))) {}
+	}
+
+	void Send(const void* buf, size_t len)
+	{
+		const uint8_t* src = (const uint8_t*) buf;
+		uint64_t tail = Tx.Tail->load();
+		size_t sent = 0;
+		while (sent != len)
+		{
+			size_t n = std::min(RingSize - (size_t) (tail - Tx.Head->load()), len - sent);
+			size_t pos = (size_t) tail & (RingSize - 1);
+			size_t first = std::min(n, RingSize - pos);
+			memcpy(Tx.Data + pos, src + sent, first);
+			memcpy(Tx.Data, src + sent + first, n - first);
+			tail += n;
+			sent += n;
+			Tx.Tail->store(tail);
+			if (Tx.ConsumerWaiting->load())
+				RingDoorbell(Tx.DataReady);
+		}
+	}
+
+	// Returns -1 if the backend has gone away
+	ssize_t Recv(void* buf, size_t maxLen, int sock)
+	{
+		uint64_t head = Rx.Head->load();
+		size_t avail = 0;
+		while (true)
+		{
+			avail = (size_t) (Rx.Tail->load() - head);
+			if (avail != 0)
+				break;
+			Rx.ConsumerWaiting->store(1);
+			avail = (size_t) (Rx.Tail->load() - head);
+			if (avail == 0)
+			{
+				pollfd pfd[2] = {{Rx.DataReady, POLLIN, 0}, {sock, POLLIN, 0}};
+				poll(pfd, 2, 1000);
+				if (pfd[1].revents != 0)
+					return -1;
+				uint64_t count;
+				if (read(Rx.DataReady, &count, sizeof(count))) {}
+			}
+			Rx.ConsumerWaiting->store(0);
+		}
+		size_t n = std::min(avail, maxLen);
+		size_t pos = (size_t) head & (RingSize - 1);
+		size_t first = std::min(n, RingSize - pos);
+		memcpy(buf, Rx.Data + pos, first);
+		memcpy((uint8_t*) buf + first, Rx.Data, n - first);
+		Rx.Head->store(head + n);
+		if (Rx.ProducerWaiting->load())
+			RingDoorbell(Rx.SpaceReady);
+		return n;
+	}
+};
+#endif
+
+struct BenchResult
+{
+	size_t		Requests = 0;
+	double		Seconds = 0;
+	double		P50Micro = 0;
+	double		P99Micro = 0;
+	double		BackendSyscalls = -1;	// Total syscalls made by the backend's threads, or -1 if we can't count them
+	double		ContextSwitches = 0;	// Total context switches of the whole process
+};
+
+static double Percentile(std::vector<double>& v, double p)
+{
+	if (v.size() == 0)
+		return 0;
+	size_t n = std::min(v.size() - 1, (size_t) (p * v.size()));
+	std::nth_element(v.begin(), v.begin() + n, v.end());
+	return v[n];
+}
+
+static void PrintResult(const char* name, const BenchResult& r)
+{
+	printf("%-12s %8d requests in %6.3f s  %9.0f req/s  p50 %7.1f us  p99 %7.1f us\n", name, (int) r.Requests, r.Seconds, r.Requests / r.Seconds, r.P50Micro, r.P99Micro);
+}
+
+// Plays the role of the Go server
+class FakeServer
+{
+public:
+	~FakeServer()
+	{
+		Close();
+	}
+
+	bool Listen(const char* network, const char* addr)
+	{
+		IsShm = strcmp(network, "shm") == 0;
+		if (strcmp(network, "unix") == 0 || IsShm)
+		{
+			sockaddr_un sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sun_family = AF_UNIX;
+			strncpy(sa.sun_path, addr, sizeof(sa.sun_path) - 1);
+			unlink(addr);
+			ListenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (ListenSock == -1 || bind(ListenSock, (sockaddr*) &sa, sizeof(sa)) != 0)
+				return false;
+			UnixPath = addr;
+		}
+		else
+		{
+			std::string host(addr, strrchr(addr, ':') - addr);
+			sockaddr_in sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sin_family = AF_INET;
+			sa.sin_port = htons((uint16_t) atoi(strrchr(addr, ':') + 1));
+			inet_pton(AF_INET, host.c_str(), &sa.sin_addr);
+			ListenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			int reuse = 1;
+			setsockopt(ListenSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			if (ListenSock == -1 || bind(ListenSock, (sockaddr*) &sa, sizeof(sa)) != 0)
+				return false;
+		}
+		return listen(ListenSock, 16) == 0;
+	}
+
+	bool Accept()
+	{
+		Sock = accept(ListenSock, nullptr, nullptr);
+		if (Sock == -1)
+			return false;
+#ifdef __linux__
+		if (IsShm)
+			return Shm.Handshake(Sock);
+#endif
+		return true;
+	}
+
+	void Close()
+	{
+		if (Sock != -1)
+			close(Sock);
+		if (ListenSock != -1)
+			close(ListenSock);
+		if (UnixPath != "")
+			unlink(UnixPath.c_str());
+		Sock = -1;
+		ListenSock = -1;
+		UnixPath = "";
+	}
+
+	// Send 'total' requests at a fixed rate, regardless of how quickly the responses come back.
+	// Latency is measured from the time at which a request was scheduled to be sent, so a stall
+	// on either side is not hidden by the sender falling behind.
+	BenchResult RunPaced(size_t total, double requestsPerSecond)
+	{
+		BenchResult res;
+		auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / requestsPerSecond));
+		auto start = Clock::now();
+		std::thread sender([&]() {
+			for (size_t i = 0; i < total; i++)
+			{
+				auto frame = MakeRequestFrame(i + 1);
+				auto due = start + interval * (int64_t) i;
+				// Sleep instead of spinning, so that we don't steal CPU from the backend on small machines.
+				// If we wake up late, the overdue requests go out back to back.
+				std::this_thread::sleep_until(due);
+				SendAll(&frame[0], frame.size());
+			}
+		});
+
+		std::vector<double> latency;
+		latency.reserve(total);
+		ReadResponses(total, [&](uint64_t channel, Clock::time_point now) {
+			auto due = start + interval * (int64_t) (channel - 1);
+			latency.push_back(std::chrono::duration<double, std::micro>(now - due).count());
+		});
+		sender.join();
+
+		res.Requests = latency.size();
+		res.Seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		res.P50Micro = Percentile(latency, 0.5);
+		res.P99Micro = Percentile(latency, 0.99);
+		return res;
+	}
+
+	// Send 'total' requests, keeping 'inFlight' of them outstanding at any time
+	BenchResult Run(size_t total, size_t inFlight)
+	{
+		BenchResult res;
+		std::vector<std::vector<uint8_t>> frames;
+		for (size_t i = 0; i < inFlight; i++)
+			frames.push_back(MakeRequestFrame(i + 1));
+
+		std::vector<Clock::time_point> started(inFlight);
+		std::vector<double> latency;
+		latency.reserve(total);
+
+		auto start = Clock::now();
+		size_t sent = 0;
+		for (size_t i = 0; i < inFlight && sent < total; i++, sent++)
+		{
+			started[i] = Clock::now();
+			SendAll(&frames[i][0], frames[i].size());
+		}
+
+		ReadResponses(total, [&](uint64_t channel, Clock::time_point now) {
+			size_t slot = (size_t) channel - 1;
+			latency.push_back(std::chrono::duration<double, std::micro>(now - started[slot]).count());
+			if (sent < total)
+			{
+				started[slot] = now;
+				SendAll(&frames[slot][0], frames[slot].size());
+				sent++;
+			}
+		});
+
+		res.Requests = latency.size();
+		res.Seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		res.P50Micro = Percentile(latency, 0.5);
+		res.P99Micro = Percentile(latency, 0.99);
+		return res;
+	}
+
+private:
+	int			ListenSock = -1;
+	int			Sock = -1;
+	bool		IsShm = false;
+	std::string	UnixPath;
+#ifdef __linux__
+	ShmPeer		Shm;
+#endif
+
+	// Read response frames until 'total' final frames have arrived, calling onResponse(channel, arrivalTime) for each of them
+	template<typename TFunc>
+	void ReadResponses(size_t total, TFunc onResponse)
+	{
+		std::vector<uint8_t> buf(1024 * 1024);
+		size_t bufPos = 0;
+		size_t bufCount = 0;
+		size_t done = 0;
+		while (done < total)
+		{
+			if (bufPos != 0 && buf.size() - bufCount < 65536)
+			{
+				memmove(&buf[0], &buf[bufPos], bufCount - bufPos);
+				bufCount -= bufPos;
+				bufPos = 0;
+			}
+			ssize_t n = RecvSome(&buf[bufCount], buf.size() - bufCount);
+			if (n <= 0)
+			{
+				printf("FakeServer recv failed\n");
+				break;
+			}
+			bufCount += n;
+			while (bufCount - bufPos >= 8)
+			{
+				uint32_t frameSize = hb::Read32LE(&buf[bufPos + 4]);
+				if (bufCount - bufPos < 8 + frameSize)
+					break;
+				auto frame = httpbridge::GetTxFrame(&buf[bufPos + 8]);
+				bufPos += 8 + frameSize;
+				if (!(frame->flags() & httpbridge::TxFrameFlags_Final))
+					continue;
+				onResponse(frame->channel(), Clock::now());
+				done++;
+			}
+		}
+	}
+
+	ssize_t RecvSome(void* buf, size_t maxLen)
+	{
+#ifdef __linux__
+		if (IsShm)
+			return Shm.Recv(buf, maxLen, Sock);
+#endif
+		return recv(Sock, buf, maxLen, 0);
+	}
+
+	void SendAll(const void* buf, size_t len)
+	{
+#ifdef __linux__
+		if (IsShm)
+			return Shm.Send(buf, len);
+#endif
+		size_t pos = 0;
+		while (pos != len)
+		{
+			ssize_t n = send(Sock, (const char*) buf + pos, len - pos, 0);
+			if (n <= 0)
+				return;
+			pos += n;
+		}
+	}
+
+	// A typical small GET request
+	static std::vector<uint8_t> MakeRequestFrame(uint64_t channel)
+	{
+		using namespace httpbridge;
+		flatbuffers::FlatBufferBuilder fbb;
+		std::vector<flatbuffers::Offset<TxHeaderLine>> lines;
+		auto line = [&](const char* key, const char* val)
+		{
+			auto k = fbb.CreateVector((const uint8_t*) key, strlen(key));
+			auto v = fbb.CreateVector((const uint8_t*) val, strlen(val));
+			lines.push_back(CreateTxHeaderLine(fbb, k, v));
+		};
+		line("GET", "/api/items?id=123&fields=name");
+		line("Host", "localhost");
+		line("User-Agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/60.0.3112.113 Safari/537.36");
+		line("Accept", "application/json");
+		line("Accept-Encoding", "gzip, deflate, br");
+		auto headers = fbb.CreateVector(lines);
+		auto root = CreateTxFrame(fbb, TxFrameType_Header, TxHttpVersion_Http11, TxFrameFlags_Final, channel, 3, headers);
+		FinishTxFrameBuffer(fbb, root);
+
+		std::vector<uint8_t> frame(8 + fbb.GetSize());
+		hb::Write32LE(&frame[0], hb::MagicFrameMarker);
+		hb::Write32LE(&frame[4], (uint32_t) fbb.GetSize());
+		memcpy(&frame[8], fbb.GetBufferPointer(), fbb.GetSize());
+		return frame;
+	}
+};
+
+// What the backend sends back for every request
+struct ReplyConfig
+{
+	size_t		BodySize = 2;
+	bool		BodyRef = false;	// Use SetBodyRef instead of SetBody
+	size_t		Workers = 0;		// If not zero, responses are sent from this many worker threads, instead of the thread that calls Recv
+};
+
+// Counts the syscalls made by the calling thread, and any threads that it creates after Start().
+// This needs the raw_syscalls tracepoint, which is usually only readable by root.
+class SyscallCounter
+{
+public:
+	~SyscallCounter()
+	{
+		if (Fd != -1)
+			close(Fd);
+	}
+
+	bool Start()
+	{
+#ifdef __linux__
+		const char* idFiles[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id", "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+		for (const char* idFile : idFiles)
+		{
+			FILE* f = fopen(idFile, "r");
+			if (f == nullptr)
+				continue;
+			unsigned long long id = 0;
+			bool haveID = fscanf(f, "%llu", &id) == 1;
+			fclose(f);
+			if (!haveID)
+				continue;
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.type = PERF_TYPE_TRACEPOINT;
+			attr.size = sizeof(attr);
+			attr.config = id;
+			attr.inherit = 1;
+			Fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			if (Fd != -1)
+				return true;
+		}
+#endif
+		return false;
+	}
+
+	// Counts from child threads are only included once those threads have exited
+	double Read()
+	{
+		uint64_t count = 0;
+		if (Fd == -1 || read(Fd, &count, sizeof(count)) != sizeof(count))
+			return -1;
+		return (double) count;
+	}
+
+private:
+	int Fd = -1;
+};
+
+// Responses waiting for a worker thread to send them
+struct ResponseQueue
+{
+	std::mutex					Lock;
+	std::condition_variable		CV;
+	std::deque<hb::Response>	Items;
+	bool						Closed = false;
+
+	void Push(hb::Response&& r)
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Items.push_back(std::move(r));
+		CV.notify_one();
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Closed = true;
+		CV.notify_all();
+	}
+
+	void RunWorker()
+	{
+		std::unique_lock<std::mutex> lock(Lock);
+		while (true)
+		{
+			if (Items.size() == 0)
+			{
+				if (Closed)
+					return;
+				CV.wait(lock);
+				continue;
+			}
+			hb::Response r = std::move(Items.front());
+			Items.pop_front();
+			lock.unlock();
+			r.Send();
+			lock.lock();
+		}
+	}
+};
+
+// Connect to the FakeServer and respond to every request, until 'stop' is set
+static void RunBackend(const char* network, const char* addr, std::atomic<bool>* stop, ReplyConfig reply, double* syscalls)
+{
+	std::string body(reply.BodySize, 'x');
+	SyscallCounter counter;
+	bool counting = syscalls != nullptr && counter.Start();
+	hb::Backend backend;
+	if (!backend.Connect(network, addr))
+	{
+		printf("Backend unable to connect to %s %s\n", network, addr);
+		return;
+	}
+	ResponseQueue queue;
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < reply.Workers; i++)
+		workers.push_back(std::thread([&queue]() { queue.RunWorker(); }));
+
+	while (!*stop)
+	{
+		hb::InFrame inframe;
+		if (backend.Recv(inframe) && inframe.Type == hb::FrameType::Data && inframe.IsLast)
+		{
+			hb::Response response(inframe.Request);
+			if (reply.BodyRef)
+				response.SetBodyRef(body.c_str(), body.size());
+			else
+				response.SetBody(body.c_str(), body.size());
+			if (reply.Workers != 0)
+				queue.Push(std::move(response));
+			else
+				response.Send();
+		}
+	}
+
+	queue.Close();
+	for (auto& w : workers)
+		w.join();
+	if (counting)
+		*syscalls = counter.Read();
+}
+
+static BenchResult BenchTransport(const char* network, const char* addr, size_t requests, size_t inFlight, ReplyConfig reply = ReplyConfig())
+{
+	FakeServer server;
+	if (!server.Listen(network, addr))
+	{
+		printf("Unable to listen on %s %s\n", network, addr);
+		return BenchResult();
+	}
+	std::atomic<bool> stop(false);
+	std::thread backend(RunBackend, network, addr, &stop, reply, nullptr);
+	BenchResult res;
+	if (server.Accept())
+		res = server.Run(requests, inFlight);
+	stop = true;
+	server.Close();
+	backend.join();
+	return res;
+}
+
+// Like BenchTransport, but with requests arriving at a fixed rate, and responses sent from worker threads
+static BenchResult BenchTransportPaced(const char* network, const char* addr, size_t requests, double requestsPerSecond, ReplyConfig reply)
+{
+	FakeServer server;
+	if (!server.Listen("tcp", addr))
+	{
+		printf("Unable to listen on %s\n", addr);
+		return BenchResult();
+	}
+	std::atomic<bool> stop(false);
+	double syscalls = -1;
+	rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	std::thread backend(RunBackend, network, addr, &stop, reply, &syscalls);
+	BenchResult res;
+	if (server.Accept())
+		res = server.RunPaced(requests, requestsPerSecond);
+	stop = true;
+	backend.join();
+	server.Close();
+	getrusage(RUSAGE_SELF, &after);
+	res.BackendSyscalls = syscalls;
+	res.ContextSwitches = (double) (after.ru_nvcsw - before.ru_nvcsw + after.ru_nivcsw - before.ru_nivcsw);
+	return res;
+}
+
+static void BenchTransports(size_t requests, size_t inFlight)
+{
+	printf("Small requests, %d in flight\n", (int) inFlight);
+	PrintResult("tcp", BenchTransport("tcp", TCPAddr, requests, inFlight));
+	PrintResult("unix", BenchTransport("unix", UnixAddr, requests, inFlight));
+#ifdef __linux__
+	PrintResult("shm", BenchTransport("shm", UnixAddr, requests, inFlight));
+#endif
+}
+
+static void BenchBody(size_t requests, size_t inFlight)
+{
+	ReplyConfig reply;
+	reply.BodySize = 256 * 1024;
+	printf("%d KB responses, %d in flight\n", (int) (reply.BodySize / 1024), (int) inFlight);
+	reply.BodyRef = false;
+	PrintResult("SetBody", BenchTransport("unix", UnixAddr, requests, inFlight, reply));
+	reply.BodyRef = true;
+	PrintResult("SetBodyRef", BenchTransport("unix", UnixAddr, requests, inFlight, reply));
+}
+
+static void BenchUring(size_t requests, size_t workers)
+{
+	double rate = 50000;
+	ReplyConfig reply;
+	reply.Workers = workers;
+	printf("Small requests at %.0f req/s, responses sent from %d worker threads\n", rate, (int) workers);
+	const char* networks[] = {"tcp", "uring"};
+	for (const char* network : networks)
+	{
+#ifndef HTTPBRIDGE_IO_URING
+		if (strcmp(network, "uring") == 0)
+		{
+			printf("%-12s not available. Build with HTTPBRIDGE_IO_URING.\n", network);
+			continue;
+		}
+#endif
+		BenchResult r = BenchTransportPaced(network, TCPAddr, requests, rate, reply);
+		PrintResult(network, r);
+		if (r.BackendSyscalls >= 0)
+			printf("%-12s %.2f backend syscalls/request, %.3f context switches/request\n", "", r.BackendSyscalls / r.Requests, r.ContextSwitches / r.Requests);
+		else
+			printf("%-12s backend syscalls/request n/a (raw_syscalls tracepoint not readable), %.3f context switches/request\n", "", r.ContextSwitches / r.Requests);
+	}
+}
+
+typedef std::unordered_map<hb::StreamKey, uint64_t> StreamItems;
+
+// The stream table that Backend used before StreamMap: one lock in front of one unordered_map
+struct SingleLockTable
+{
+	std::mutex	Lock;
+	StreamItems	Items;
+
+	std::mutex&		LockFor(const hb::StreamKey&)	{ return Lock; }
+	StreamItems&	ItemsFor(const hb::StreamKey&)	{ return Items; }
+};
+
+struct ShardedTable
+{
+	hb::StreamMap<uint64_t> Map;
+
+	std::mutex&		LockFor(const hb::StreamKey& key)	{ return Map.ShardFor(key).Lock; }
+	StreamItems&	ItemsFor(const hb::StreamKey& key)	{ return Map.ShardFor(key).Items; }
+};
+
+// Each thread plays the part of the Recv thread and of a worker at once. For each of its streams, it adds the stream,
+// looks it up a few times (as Send does, for the header and body frames), and then removes it.
+// Returns millions of operations per second.
+template<typename Table>
+static double BenchStreamTable(size_t nthreads, size_t streamsPerThread)
+{
+	const int lookupsPerStream = 4;
+	Table table;
+	std::atomic<bool> go(false);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nthreads; t++)
+	{
+		threads.push_back(std::thread([&table, &go, t, streamsPerThread]() {
+			while (!go)
+			{
+			}
+			for (size_t i = 0; i < streamsPerThread; i++)
+			{
+				// Odd stream numbers, like a browser would use
+				hb::StreamKey key = {t + 1, i * 2 + 1};
+				{
+					std::lock_guard<std::mutex> lock(table.LockFor(key));
+					table.ItemsFor(key)[key] = 0;
+				}
+				for (int j = 0; j < lookupsPerStream; j++)
+				{
+					std::lock_guard<std::mutex> lock(table.LockFor(key));
+					table.ItemsFor(key).find(key)->second++;
+				}
+				{
+					std::lock_guard<std::mutex> lock(table.LockFor(key));
+					table.ItemsFor(key).erase(key);
+				}
+			}
+		}));
+	}
+	auto start = Clock::now();
+	go = true;
+	for (auto& t : threads)
+		t.join();
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return (double) (nthreads * streamsPerThread * (lookupsPerStream + 2)) / seconds / 1e6;
+}
+
+#ifdef __GLIBC__
+// Count calls to malloc and realloc, which is what operator new, Vector, and flatbuffers all end up in
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+static std::atomic<uint64_t> NumMallocs(0);
+extern "C" void* malloc(size_t size)
+{
+	NumMallocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+extern "C" void* realloc(void* p, size_t size)
+{
+	NumMallocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(p, size);
+}
+#else
+static std::atomic<uint64_t> NumMallocs(0);
+#endif
+
+static void BenchResponseBuild(const char* name, hb::Backend& backend, size_t bodySize, size_t count)
+{
+	std::vector<uint8_t> body(bodySize, 'x');
+	auto build = [&](size_t i) {
+		hb::Response r(&backend, hb::HttpVersion11, 1, i * 2 + 1);
+		r.AddHeader("Content-Type", "application/json");
+		r.AddHeader("Cache-Control", "no-store");
+		if (bodySize != 0)
+			r.SetBody(&body[0], bodySize);
+		void* buf;
+		size_t len;
+		r.FinishFlatbuffer(buf, len, true);
+	};
+	// Warm up, so that we measure the steady state
+	for (size_t i = 0; i < 1000; i++)
+		build(i);
+	uint64_t mallocs = NumMallocs.load();
+	auto start = Clock::now();
+	for (size_t i = 0; i < count; i++)
+		build(i);
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	mallocs = NumMallocs.load() - mallocs;
+	printf("%-16s %8.0f ns/response  %6.2f mallocs/response\n", name, seconds * 1e9 / count, (double) mallocs / count);
+}
+
+// The frame of a 64 KB body part, built the way SendBodyPart used to (a Response with SetBodyRef), and with EncodeBodyPartFrame
+static void BenchBodyPartBuild(const char* name, hb::Backend& backend, bool useEncoder, size_t count)
+{
+	std::vector<uint8_t> body(64 * 1024, 'x');
+	volatile size_t sink = 0;
+	auto build = [&](size_t i) {
+		if (useEncoder)
+		{
+			uint8_t head[hb::BodyPartFrameHeaderSize];
+			hb::EncodeBodyPartFrame(head, hb::HttpVersion11, 1, i * 2 + 1, body.size(), false);
+			sink = sink + head[40];
+			return;
+		}
+		hb::Response r(&backend, hb::HttpVersion11, 1, i * 2 + 1);
+		r.Status = hb::StatusMeta_BodyPart;
+		r.SetBodyRef(&body[0], body.size());
+		void* buf;
+		size_t len;
+		const void* ref;
+		size_t refLen;
+		r.FinishFlatbuffer(buf, len, ref, refLen, false);
+		sink = sink + len;
+	};
+	for (size_t i = 0; i < 1000; i++)
+		build(i);
+	uint64_t mallocs = NumMallocs.load();
+	auto start = Clock::now();
+	for (size_t i = 0; i < count; i++)
+		build(i);
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	mallocs = NumMallocs.load() - mallocs;
+	printf("%-16s %8.1f ns/frame     %6.2f mallocs/frame\n", name, seconds * 1e9 / count, (double) mallocs / count);
+}
+
+static void BenchResponse(size_t count)
+{
+	hb::Backend backend;
+	printf("Building %d responses, each with two headers\n", (int) count);
+	BenchResponseBuild("no body", backend, 0, count);
+	BenchResponseBuild("512 B body", backend, 512, count);
+	BenchResponseBuild("16 KB body", backend, 16 * 1024, count);
+	BenchResponseBuild("200 KB body", backend, 200 * 1024, count / 10);
+	printf("Building %d body part frames\n", (int) count);
+	BenchBodyPartBuild("Response", backend, false, count);
+	BenchBodyPartBuild("encoder", backend, true, count);
+}
+
+static void BenchStreams(size_t streamsPerThread, size_t maxThreads)
+{
+	printf("Stream table, %d streams per thread, million operations per second\n", (int) streamsPerThread);
+	printf("%-8s %12s %12s\n", "threads", "single lock", "StreamMap");
+	for (size_t nthreads = 1; nthreads <= maxThreads; nthreads *= 2)
+	{
+		double single = BenchStreamTable<SingleLockTable>(nthreads, streamsPerThread);
+		double sharded = BenchStreamTable<ShardedTable>(nthreads, streamsPerThread);
+		printf("%-8d %12.2f %12.2f\n", (int) nthreads, single, sharded);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("usage: benchmark <name> [requests] [in-flight]\n");
+		printf("  transport    Small request throughput over tcp, unix and shm transports\n");
+		printf("  body         Large response throughput, SetBody vs SetBodyRef\n");
+		printf("  uring        tcp vs uring at 50k req/s, with responses sent from [in-flight] worker threads\n");
+		printf("  streams      Stream table throughput from 1 up to [in-flight] threads, with [requests] streams per thread\n");
+		printf("  response     Cost of building [requests] Responses, and heap allocations per Response\n");
+		return 1;
+	}
+	std::string name = argv[1];
+	size_t requests = argc > 2 ? (size_t) atoi(argv[2]) : (name == "body" ? 20000 : 200000);
+	size_t inFlight = argc > 3 ? (size_t) atoi(argv[3]) : (name == "uring" ? 4 : (name == "streams" ? std::max(std::thread::hardware_concurrency(), 1u) : 16));
+
+	hb::Startup();
+
+	if (name == "transport")
+	{
+		BenchTransports(requests, inFlight);
+	}
+	else if (name == "body")
+	{
+		BenchBody(requests, inFlight);
+	}
+	else if (name == "uring")
+	{
+		BenchUring(requests, inFlight);
+	}
+	else if (name == "streams")
+	{
+		BenchStreams(requests, inFlight);
+	}
+	else if (name == "response")
+	{
+		BenchResponse(requests);
+	}
+	else
+	{
+		printf("Unknown benchmark '%s'\n", argv[1]);
+		return 1;
+	}
+
+	hb::Shutdown();
+	return 0;
+}
+
+#endif
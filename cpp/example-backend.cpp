@@ -5,13 +5,17 @@ int main(int argc, char** argv)
 {
 	hb::Startup();
 
+	// Usage: example-backend [network address], eg example-backend unix /tmp/httpbridge.sock
+	const char* network = argc > 2 ? argv[1] : "tcp";
+	const char* addr = argc > 2 ? argv[2] : "127.0.0.1:8081";
+
 	hb::Backend backend;
 
 	for (;;)
 	{
 		if (!backend.IsConnected())
 		{
-			if (backend.Connect("tcp", "127.0.0.1:8081"))
+			if (backend.Connect(network, addr))
 			{
 				printf("Connected\n");
 			}
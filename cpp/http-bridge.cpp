@@ -5,18 +5,38 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <new>
+#include <deque>
 
 #ifdef HTTPBRIDGE_PLATFORM_WINDOWS
 #include <Ws2tcpip.h>
+#include <io.h>
 #else
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h> // #TODO Get rid of this at 1.0 if we no longer set sockets to non-blocking
 #endif
 
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#endif
+
+#if defined(HTTPBRIDGE_PLATFORM_LINUX) && defined(HTTPBRIDGE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <condition_variable>
+#endif
+
 #ifdef min
 #undef min
 #endif
@@ -355,6 +375,18 @@ namespace hb
 		return true;
 	}
 
+	// Runtime version of HeaderNameHash, for names that are not null terminated
+	static uint32_t HeaderNameHashLen(const char* name, size_t len)
+	{
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < len; i++)
+		{
+			char c = name[i];
+			h = (h ^ (uint8_t) (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c)) * 16777619u;
+		}
+		return h;
+	}
+
 #ifdef HTTPBRIDGE_PLATFORM_WINDOWS
 	void SleepNano(int64_t nanoseconds)
 	{
@@ -446,6 +478,9 @@ namespace hb
 	// Round up to the next odd number
 	template<typename T> T RoundUpOdd(T v) { return (v & ~1) + 1; }
 
+	// Round up to a multiple of 8
+	template<typename T> T RoundUp8(T v) { return (v + 7) & ~((T) 7); }
+
 	hb::HttpVersion TranslateVersion(httpbridge::TxHttpVersion v)
 	{
 		switch (v)
@@ -475,6 +510,48 @@ namespace hb
 		return TranslateVersion(v);
 	}
 
+	// A body frame is always the same shape, so instead of running it through a FlatBufferBuilder, we write
+	// the bytes that FlatBufferBuilder would produce. The body vector is last, so the body bytes can follow
+	// straight after this, from wherever the caller has them. Offsets below are from the start of the frame:
+	//  0  magic marker, frame size
+	//  8  root offset of the flatbuffer
+	// 12  vtable (18 bytes, plus 2 bytes of padding)
+	// 32  table: vtable offset, body offset, channel, stream, frametype, version, flags, (padding)
+	// 60  body length, followed by the body
+	static const uint8_t BodyPartVTable[20] = {
+		18, 0,	// vtable size
+		28, 0,	// table size
+		24, 0,	// frametype
+		25, 0,	// version
+		26, 0,	// flags
+		8, 0,	// channel
+		16, 0,	// stream
+		0, 0,	// headers (absent)
+		4, 0,	// body
+		0, 0,
+	};
+	static_assert(httpbridge::TxFrame::VT_BODY + 2 == 18, "TxFrame has changed. Update BodyPartVTable.");
+
+	void EncodeBodyPartFrame(uint8_t* buf, HttpVersion version, uint64_t channel, uint64_t stream, size_t bodyLen, bool isFinal)
+	{
+		HTTPBRIDGE_ASSERT(bodyLen <= 1024 * 1024 * 1024);
+		Write32LE(buf, MagicFrameMarker);
+		Write32LE(buf + 4, (uint32_t) (BodyPartFrameHeaderSize - 8 + bodyLen));
+		Write32LE(buf + 8, 24);					// root table, relative to the start of the flatbuffer
+		memcpy(buf + 12, BodyPartVTable, sizeof(BodyPartVTable));
+		Write32LE(buf + 32, 32 - 12);			// distance back to the vtable
+		Write32LE(buf + 36, 60 - 36);			// distance forward to the body vector
+		Write32LE(buf + 40, (uint32_t) channel);
+		Write32LE(buf + 44, (uint32_t) (channel >> 32));
+		Write32LE(buf + 48, (uint32_t) stream);
+		Write32LE(buf + 52, (uint32_t) (stream >> 32));
+		buf[56] = httpbridge::TxFrameType_Body;
+		buf[57] = TranslateVersion(version);
+		buf[58] = isFinal ? httpbridge::TxFrameFlags_Final : 0;
+		buf[59] = 0;
+		Write32LE(buf + 60, (uint32_t) bodyLen);
+	}
+
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -510,6 +587,30 @@ namespace hb
 	{
 	}
 
+	size_t ITransport::PollFds(int*, size_t)
+	{
+		return 0;
+	}
+
+	bool ITransport::CanSendConcurrently() const
+	{
+		return false;
+	}
+
+	SendResult ITransport::SendV(const SendBuf* bufs, size_t nbufs, size_t& sent)
+	{
+		sent = 0;
+		for (size_t i = 0; i < nbufs; i++)
+		{
+			size_t n = 0;
+			auto res = Send(bufs[i].Data, bufs[i].Size, n);
+			sent += n;
+			if (res != SendResult_All)
+				return res;
+		}
+		return SendResult_All;
+	}
+
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -552,8 +653,12 @@ namespace hb
 		virtual bool		Connect(const char* addr) override;
 		virtual SendResult	Send(const void* data, size_t size, size_t& sent) override;
 		virtual RecvResult	Recv(size_t maxSize, void* data, size_t& bytesRead) override;
+#ifndef HTTPBRIDGE_PLATFORM_WINDOWS
+		virtual SendResult	SendV(const SendBuf* bufs, size_t nbufs, size_t& sent) override;
+		virtual size_t		PollFds(int* fds, size_t maxFds) override;
+#endif
 
-	private:
+	protected:
 		void			Close();
 		bool			SetNonBlocking();
 		bool			SetReadTimeout(uint32_t timeoutMilliseconds);
@@ -673,10 +778,15 @@ namespace hb
 	{
 		char* bdata = (char*) data;
 		bytesRead = 0;
+		int flags = 0;
+#ifndef HTTPBRIDGE_PLATFORM_WINDOWS
+		if (NonBlocking)
+			flags = MSG_DONTWAIT;
+#endif
 		while (bytesRead < maxSize)
 		{
 			int try_read = (int) (maxSize - bytesRead < ChunkSize ? maxSize - bytesRead : ChunkSize);
-			int read_now = recv(Socket, bdata + bytesRead, try_read, 0);
+			int read_now = recv(Socket, bdata + bytesRead, try_read, flags);
 			if (read_now == ErrSOCKET_ERROR)
 			{
 				int e = LastError();
@@ -705,6 +815,63 @@ namespace hb
 		return bytesRead == 0 ? RecvResult_NoData : RecvResult_Data;
 	}
 
+#ifndef HTTPBRIDGE_PLATFORM_WINDOWS
+	// Send all the pieces with as few syscalls as possible, so that a response body can go straight
+	// from the caller's buffer into the socket, without first being copied behind the frame header.
+	hb::SendResult TransportTCP::SendV(const SendBuf* bufs, size_t nbufs, size_t& sent)
+	{
+		const size_t maxIov = 16;
+		iovec iov[maxIov];
+		size_t total = 0;
+		for (size_t i = 0; i < nbufs; i++)
+			total += bufs[i].Size;
+
+		sent = 0;
+		while (sent != total)
+		{
+			// Build up the iovecs for everything after 'sent'
+			size_t niov = 0;
+			size_t skip = sent;
+			for (size_t i = 0; i < nbufs && niov < maxIov; i++)
+			{
+				if (skip >= bufs[i].Size)
+				{
+					skip -= bufs[i].Size;
+					continue;
+				}
+				iov[niov].iov_base = (uint8_t*) bufs[i].Data + skip;
+				iov[niov].iov_len = bufs[i].Size - skip;
+				niov++;
+				skip = 0;
+			}
+			msghdr mh;
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = iov;
+			mh.msg_iovlen = niov;
+			ssize_t sent_now = sendmsg(Socket, &mh, 0);
+			if (sent_now == ErrSOCKET_ERROR)
+			{
+				int e = LastError();
+				if (e == EINTR)
+					continue;
+				if (e == ErrWOULDBLOCK || e == ErrSEND_BUFFER_FULL)
+					return SendResult_BufferFull;
+				return SendResult_Closed;
+			}
+			sent += sent_now;
+		}
+		return SendResult_All;
+	}
+
+	size_t TransportTCP::PollFds(int* fds, size_t maxFds)
+	{
+		if (maxFds < 1 || Socket == InvalidSocket)
+			return 0;
+		fds[0] = Socket;
+		return 1;
+	}
+#endif
+
 	int TransportTCP::LastError()
 	{
 #ifdef HTTPBRIDGE_PLATFORM_WINDOWS
@@ -745,189 +912,1333 @@ namespace hb
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	// Cache of header pairs received. The sizes here do not include a null terminator.
-	class HeaderCacheRecv
+#ifndef HTTPBRIDGE_PLATFORM_WINDOWS
+	// Unix domain socket transport, for when the server and the backend are on the same machine.
+	// Once connected, a unix stream socket behaves exactly like a TCP socket, so we reuse all
+	// of TransportTCP's send/recv logic, and only the connection phase is different.
+	class TransportUnix : public TransportTCP
 	{
 	public:
-		void Insert(uint16_t id, int32_t keyLen, const void* key, int32_t valLen, const void* val);
-		void Get(uint16_t id, int32_t& keyLen, const void*& key, int32_t& valLen, const void*& val);		// A non-existent item will yield 0,0,0,0
-
-	private:
-		struct Item
-		{
-			Vector<uint8_t> Key;
-			Vector<uint8_t> Value;
-		};
-		Vector<Item> Items;
+		virtual bool		Connect(const char* addr) override;		// addr is the filesystem path of the socket, eg "/run/hb.sock"
 	};
 
-	void HeaderCacheRecv::Insert(uint16_t id, int32_t keyLen, const void* key, int32_t valLen, const void* val)
+	bool TransportUnix::Connect(const char* addr)
 	{
-		while (Items.Size() <= (int32_t) id)
-			Items.Push(Item());
-		Items[id].Key.Resize(keyLen);
-		Items[id].Value.Resize(valLen);
-		memcpy(&Items[id].Key[0], key, keyLen);
-		memcpy(&Items[id].Value[0], val, valLen);
-	}
+		sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof(sa.sun_path))
+		{
+			Log->Logf("Unix socket path is too long (%s)", addr);
+			return false;
+		}
+		strcpy(sa.sun_path, addr);
 
-	void HeaderCacheRecv::Get(uint16_t id, int32_t& keyLen, const void*& key, int32_t& valLen, const void*& val)
-	{
-		if (id >= Items.Size())
+		Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (Socket == InvalidSocket)
+			return false;
+
+		if (connect(Socket, (const sockaddr*) &sa, sizeof(sa)) != 0)
 		{
-			keyLen = 0;
-			valLen = 0;
-			key = nullptr;
-			val = nullptr;
+			Log->Logf("Unable to connect (unix %s): %d", addr, (int) LastError());
+			Close();
+			return false;
 		}
-		else
+
+		if (!SetReadTimeout(ReadTimeoutMilliseconds))
 		{
-			keyLen = Items[id].Key.Size();
-			valLen = Items[id].Value.Size();
-			key = &Items[id].Key[0];
-			val = &Items[id].Value[0];
+			Log->Log("Unable to set socket read timeout");
+			Close();
+			return false;
 		}
+		return true;
 	}
+#endif
 
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	bool ConstString::StartsWith(const char* s) const
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+	// Shared memory transport, for when the server and the backend are on the same machine.
+	// We connect to the server's unix socket, and then hand it a memfd holding two single-producer,
+	// single-consumer byte rings (one for each direction), as well as four eventfd doorbells.
+	// After that handshake, the unix socket is only used to detect when the other side goes away.
+	// The bytes inside the rings are the same stream that we would send over TCP, so frames are
+	// still delimited by MagicFrameMarker + frame size.
+	// A doorbell is only rung when the other side has announced that it is about to sleep, so
+	// under load, moving a frame costs a memcpy and no syscalls.
+	// The memory layout here must match shm_linux.go
+	class TransportShm : public TransportUnix
 	{
-		if (Data == nullptr)
-			return s == nullptr || !s[0];
-		int i = 0;
-		for (; Data[i] == s[i] && Data[i]; i++) {}
-		return !s[i];
-	}
+	public:
+		static const uint32_t	HandshakeMagic	= 0x48427368; // "HBsh"
+		static const uint32_t	Version			= 1;
+		static const size_t		ControlSize		= 4096;
+		static const size_t		RingSize		= 4 * 1024 * 1024; // Must be a power of 2
 
-	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+		virtual				~TransportShm() override;
+		virtual bool		Connect(const char* addr) override;		// addr is the filesystem path of the server's socket
+		virtual SendResult	Send(const void* data, size_t size, size_t& sent) override;
+		virtual RecvResult	Recv(size_t maxSize, void* data, size_t& bytesRead) override;
+		virtual SendResult	SendV(const SendBuf* bufs, size_t nbufs, size_t& sent) override { return ITransport::SendV(bufs, nbufs, sent); } // Not TransportTCP's sendmsg
+		virtual size_t		PollFds(int* fds, size_t maxFds) override;
 
-	Buffer::Buffer()
+	private:
+		// Head and Tail are running byte counts, which are never wrapped. Each side's variables live in their own cache line.
+		struct RingControl
+		{
+			std::atomic<uint64_t>	Tail;				// Written by the producer
+			uint8_t					Pad0[56];
+			std::atomic<uint64_t>	Head;				// Written by the consumer
+			uint8_t					Pad1[56];
+			std::atomic<uint32_t>	ConsumerWaiting;	// Consumer is going to sleep on DataReady
+			std::atomic<uint32_t>	ProducerWaiting;	// Producer is going to sleep on SpaceReady
+		};
+
+		struct Ring
+		{
+			RingControl*	Control = nullptr;
+			uint8_t*		Data = nullptr;
+			int				DataReady = -1;		// eventfd, rung by producer
+			int				SpaceReady = -1;	// eventfd, rung by consumer
+		};
+
+		enum class WaitResult
+		{
+			Signaled,
+			Timeout,
+			Closed,
+		};
+
+		uint8_t*			Mem = nullptr;
+		int					MemFD = -1;
+		Ring				Tx;		// Backend -> Server
+		Ring				Rx;		// Server -> Backend
+		std::atomic<bool>	PeerClosed{false};
+
+		void				CloseShm();
+		bool				Handshake();
+		WaitResult			WaitForDoorbell(int doorbell, uint32_t timeoutMilliseconds);
+		bool				HasPeerClosed();
+		static void			RingDoorbell(int doorbell);
+		static void			ClearDoorbell(int doorbell);
+	};
+
+	static_assert(sizeof(std::atomic<uint64_t>) == 8 && sizeof(std::atomic<uint32_t>) == 4, "TransportShm layout must match shm_linux.go");
+
+	TransportShm::~TransportShm()
 	{
+		CloseShm();
 	}
 
-	Buffer::~Buffer()
+	void TransportShm::CloseShm()
 	{
-		Free(Data);
+		if (Mem != nullptr)
+			munmap(Mem, ControlSize + 2 * RingSize);
+		Mem = nullptr;
+		int* fds[] = {&MemFD, &Tx.DataReady, &Tx.SpaceReady, &Rx.DataReady, &Rx.SpaceReady};
+		for (int* fd : fds)
+		{
+			if (*fd != -1)
+				::close(*fd);
+			*fd = -1;
+		}
 	}
-	
-	void Buffer::Clear()
+
+	bool TransportShm::Connect(const char* addr)
 	{
-		Free(Data);
-		Data = nullptr;
-		Count = 0;
-		Capacity = 0;
+		PeerClosed = false;
+		if (!TransportUnix::Connect(addr))
+			return false;
+
+		size_t memSize = ControlSize + 2 * RingSize;
+		MemFD = (int) memfd_create("httpbridge", MFD_CLOEXEC);
+		if (MemFD == -1 || ftruncate(MemFD, memSize) != 0)
+		{
+			Log->Logf("Unable to create shared memory: %d", (int) LastError());
+			CloseShm();
+			Close();
+			return false;
+		}
+		Mem = (uint8_t*) mmap(nullptr, memSize, PROT_READ | PROT_WRITE, MAP_SHARED, MemFD, 0);
+		if (Mem == MAP_FAILED)
+		{
+			Mem = nullptr;
+			Log->Logf("Unable to map shared memory: %d", (int) LastError());
+			CloseShm();
+			Close();
+			return false;
+		}
+
+		// ftruncate gives us zeroed pages, which is the initial state of both rings
+		Tx.Control = (RingControl*) Mem;
+		Rx.Control = (RingControl*) (Mem + 256);
+		Tx.Data = Mem + ControlSize;
+		Rx.Data = Mem + ControlSize + RingSize;
+
+		// The eventfds are non-blocking, because we always poll() before reading them
+		int* fds[] = {&Tx.DataReady, &Tx.SpaceReady, &Rx.DataReady, &Rx.SpaceReady};
+		for (int* fd : fds)
+			*fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+		if (Tx.DataReady == -1 || Tx.SpaceReady == -1 || Rx.DataReady == -1 || Rx.SpaceReady == -1 || !Handshake())
+		{
+			Log->Logf("Unable to establish shared memory transport (%s)", addr);
+			CloseShm();
+			Close();
+			return false;
+		}
+		return true;
 	}
 
-	uint8_t* Buffer::Preallocate(size_t n)
-	{
-		while (Count + n > Capacity)
-			GrowCapacityOrPanic();
-		return Data + Count;
+	// Send our memfd and doorbells to the server, and wait for it to acknowledge that it has mapped them
+	bool TransportShm::Handshake()
+	{
+		uint8_t msg[16];
+		Write32LE(msg, HandshakeMagic);
+		Write32LE(msg + 4, Version);
+		Write32LE(msg + 8, (uint32_t) RingSize);
+		Write32LE(msg + 12, (uint32_t) ControlSize);
+
+		int fds[5] = {MemFD, Tx.DataReady, Tx.SpaceReady, Rx.DataReady, Rx.SpaceReady};
+		char control[CMSG_SPACE(sizeof(fds))];
+		memset(control, 0, sizeof(control));
+
+		iovec iov;
+		iov.iov_base = msg;
+		iov.iov_len = sizeof(msg);
+		msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+		if (sendmsg(Socket, &mh, MSG_NOSIGNAL) != (ssize_t) sizeof(msg))
+			return false;
+
+		// Wait a few read timeouts for the server's reply, which is our magic number echoed back
+		uint8_t ack[4];
+		size_t got = 0;
+		for (int attempt = 0; attempt < 10 && got < sizeof(ack); attempt++)
+		{
+			ssize_t n = recv(Socket, ack + got, sizeof(ack) - got, 0);
+			if (n == 0 || (n < 0 && LastError() != EAGAIN && LastError() != EWOULDBLOCK))
+				return false;
+			if (n > 0)
+				got += n;
+		}
+		return got == sizeof(ack) && Read32LE(ack) == HandshakeMagic;
 	}
 
-	void Buffer::EraseFromStart(size_t n)
+	TransportShm::WaitResult TransportShm::WaitForDoorbell(int doorbell, uint32_t timeoutMilliseconds)
 	{
-		memmove(Data, Data + n, Count - n);
-		Count -= n;
+		if (PeerClosed)
+			return WaitResult::Closed;
+
+		pollfd pfd[2];
+		pfd[0].fd = doorbell;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = Socket;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		int n = poll(pfd, 2, (int) timeoutMilliseconds);
+		if (n < 0)
+			return LastError() == EINTR ? WaitResult::Timeout : WaitResult::Closed;
+		if (n == 0)
+			return WaitResult::Timeout;
+
+		if (pfd[1].revents != 0 && HasPeerClosed())
+			return WaitResult::Closed;
+
+		if (pfd[0].revents & POLLIN)
+		{
+			ClearDoorbell(doorbell);
+			return WaitResult::Signaled;
+		}
+		return WaitResult::Timeout;
 	}
 
-	void Buffer::Write(const void* buf, size_t n)
+	// The server never sends anything over the socket after the handshake, so readability means it's gone
+	bool TransportShm::HasPeerClosed()
 	{
-		while (Count + n > Capacity)
-			GrowCapacityOrPanic();
-		memcpy(Data + Count, buf, n);
-		Count += n;
+		char b;
+		ssize_t r = recv(Socket, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (r == 0 || (r < 0 && LastError() != EAGAIN && LastError() != EWOULDBLOCK))
+			PeerClosed = true;
+		return PeerClosed;
 	}
-	
-	bool Buffer::TryWrite(const void* buf, size_t n)
+
+	void TransportShm::RingDoorbell(int doorbell)
 	{
-		while (Count + n > Capacity)
-		{
-			if (!TryGrowCapacity())
-				return false;
-		}
-		memcpy(Data + Count, buf, n);
-		Count += n;
-		return true;
+		uint64_t one = 1;
+		if (write(doorbell, &one, sizeof(one))) {}
 	}
 
-	void Buffer::WriteStr(const char* s)
+	void TransportShm::ClearDoorbell(int doorbell)
 	{
-		Write(s, strlen(s));
+		uint64_t count;
+		if (read(doorbell, &count, sizeof(count))) {}
 	}
 
-	void Buffer::WriteUInt64(uint64_t v)
+	size_t TransportShm::PollFds(int* fds, size_t maxFds)
 	{
-		// 18446744073709551615 (max uint64) is 20 characters, and U64toa insists on adding a null terminator
-		while (Count + 21 > Capacity)
-			GrowCapacityOrPanic();
-		Count += U64toa(v, (char*) (Data + Count), 21);
+		if (maxFds < 2 || Mem == nullptr)
+			return 0;
+		fds[0] = Rx.DataReady;
+		fds[1] = Socket;
+		return 2;
 	}
 
-	void Buffer::GrowCapacityOrPanic()
+	hb::SendResult TransportShm::Send(const void* data, size_t size, size_t& sent)
 	{
-		Capacity = Capacity == 0 ? 64 : Capacity * 2;
-		Data = (uint8_t*) Realloc(Data, Capacity, nullptr);
+		const uint8_t* src = (const uint8_t*) data;
+		RingControl* c = Tx.Control;
+		uint64_t tail = c->Tail.load(std::memory_order_relaxed);
+		sent = 0;
+		while (sent != size)
+		{
+			size_t space = RingSize - (size_t) (tail - c->Head.load());
+			if (space == 0)
+			{
+				// Announce that we're going to sleep, and then check again, so that we can't miss the consumer's doorbell
+				c->ProducerWaiting = 1;
+				space = RingSize - (size_t) (tail - c->Head.load());
+				if (space == 0 && WaitForDoorbell(Tx.SpaceReady, ReadTimeoutMilliseconds) == WaitResult::Closed)
+				{
+					c->ProducerWaiting = 0;
+					return SendResult_Closed;
+				}
+				c->ProducerWaiting = 0;
+				continue;
+			}
+
+			size_t n = std::min(space, size - sent);
+			size_t pos = (size_t) tail & (RingSize - 1);
+			size_t first = std::min(n, RingSize - pos);
+			memcpy(Tx.Data + pos, src + sent, first);
+			memcpy(Tx.Data, src + sent + first, n - first);
+			tail += n;
+			sent += n;
+			c->Tail.store(tail);
+			if (c->ConsumerWaiting.load())
+				RingDoorbell(Tx.DataReady);
+		}
+		return SendResult_All;
 	}
 
-	bool Buffer::TryGrowCapacity()
+	hb::RecvResult TransportShm::Recv(size_t maxSize, void* data, size_t& bytesRead)
 	{
-		auto newCapacity = Capacity == 0 ? 64 : Capacity * 2;
-		auto newData = (uint8_t*) Realloc(Data, newCapacity, nullptr, false);
-		if (newData == nullptr)
+		RingControl* c = Rx.Control;
+		uint64_t head = c->Head.load(std::memory_order_relaxed);
+		bytesRead = 0;
+		size_t avail = (size_t) (c->Tail.load() - head);
+		if (NonBlocking)
 		{
-			return false;
+			// The doorbell is armed only between returning empty handed and finding data again. While it is
+			// armed, DataReady (one of our PollFds) becomes readable as soon as the server sends us something,
+			// but the server also rings it on every write, so we disarm it as soon as there is data to consume.
+			if (avail != 0)
+			{
+				if (c->ConsumerWaiting.load(std::memory_order_relaxed))
+					c->ConsumerWaiting = 0;
+			}
+			else
+			{
+				c->ConsumerWaiting = 1;
+				ClearDoorbell(Rx.DataReady);
+				avail = (size_t) (c->Tail.load() - head);
+				if (avail == 0)
+					return HasPeerClosed() ? RecvResult_Closed : RecvResult_NoData;
+				c->ConsumerWaiting = 0;
+			}
 		}
-		else
+		else if (avail == 0)
 		{
-			Capacity = newCapacity;
-			Data = newData;
-			return true;
+			c->ConsumerWaiting = 1;
+			avail = (size_t) (c->Tail.load() - head);
+			if (avail == 0)
+			{
+				if (WaitForDoorbell(Rx.DataReady, ReadTimeoutMilliseconds) == WaitResult::Closed)
+				{
+					c->ConsumerWaiting = 0;
+					return RecvResult_Closed;
+				}
+				avail = (size_t) (c->Tail.load() - head);
+			}
+			c->ConsumerWaiting = 0;
+			if (avail == 0)
+				return RecvResult_NoData;
 		}
+
+		size_t n = std::min(avail, maxSize);
+		size_t pos = (size_t) head & (RingSize - 1);
+		size_t first = std::min(n, RingSize - pos);
+		memcpy(data, Rx.Data + pos, first);
+		memcpy((uint8_t*) data + first, Rx.Data, n - first);
+		c->Head.store(head + n);
+		if (c->ProducerWaiting.load())
+			RingDoorbell(Rx.SpaceReady);
+		bytesRead = n;
+		return RecvResult_Data;
 	}
+#endif
 
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	InFrame::InFrame()
+#if defined(HTTPBRIDGE_PLATFORM_LINUX) && defined(HTTPBRIDGE_IO_URING)
+	// A minimal io_uring queue, built directly on the syscalls, so that we don't depend on liburing.
+	// A queue must only be used by one thread at a time.
+	class UringQueue
 	{
-		Request = nullptr;
-		BodyBytes = nullptr;
-		Reset();
-	}
+	public:
+		~UringQueue();
+		bool			Init(unsigned entries);
+		io_uring_sqe*	NextSqe();										// Returns a zeroed SQE, or null if the submission queue is full
+		int				Enter(unsigned minComplete);					// Submit all SQEs from NextSqe(), and optionally wait. Returns -errno on failure.
+		bool			PopCqe(io_uring_cqe& cqe);						// Returns false if the completion queue is empty
+		unsigned		DiscardUnsubmitted();							// Take back the SQEs that the kernel has not consumed, and return how many there were
+		int				Fd() const { return RingFd; }
 
-	InFrame::~InFrame()
+	private:
+		int				RingFd = -1;
+		void*			SqRing = nullptr;
+		void*			CqRing = nullptr;
+		size_t			SqRingSize = 0;
+		size_t			CqRingSize = 0;
+		io_uring_sqe*	Sqes = nullptr;
+		size_t			SqesSize = 0;
+		unsigned*		SqHead = nullptr;
+		unsigned*		SqTail = nullptr;
+		unsigned*		SqMask = nullptr;
+		unsigned*		SqArray = nullptr;
+		unsigned		SqEntries = 0;
+		unsigned		SqLocalTail = 0;
+		unsigned		SqUnsubmitted = 0;
+		unsigned*		CqHead = nullptr;
+		unsigned*		CqTail = nullptr;
+		unsigned*		CqMask = nullptr;
+		io_uring_cqe*	Cqes = nullptr;
+	};
+
+	UringQueue::~UringQueue()
 	{
-		Reset();
+		if (Sqes)
+			munmap(Sqes, SqesSize);
+		if (CqRing && CqRing != SqRing)
+			munmap(CqRing, CqRingSize);
+		if (SqRing)
+			munmap(SqRing, SqRingSize);
+		if (RingFd != -1)
+			::close(RingFd);
 	}
 
-	void InFrame::Reset()
+	bool UringQueue::Init(unsigned entries)
 	{
-		if (Request != nullptr)
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		RingFd = (int) syscall(__NR_io_uring_setup, entries, &p);
+		if (RingFd < 0)
 		{
-			// This is often the point at which the last reference to Request* is lost, so 
-			// Request is likely to be destroyed by this next line.
-			Request = nullptr;
+			RingFd = -1;
+			return false;
 		}
 
-		if (BodyBytes)
+		SqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		CqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			SqRingSize = CqRingSize = std::max(SqRingSize, CqRingSize);
+
+		SqRing = mmap(nullptr, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+		if (SqRing == MAP_FAILED)
 		{
-			HTTPBRIDGE_ASSERT(BodyBytesLen != 0);
-			Free(BodyBytes);
+			SqRing = nullptr;
+			return false;
+		}
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			CqRing = SqRing;
+		}
+		else
+		{
+			CqRing = mmap(nullptr, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+			if (CqRing == MAP_FAILED)
+			{
+				CqRing = nullptr;
+				return false;
+			}
+		}
+		SqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		Sqes = (io_uring_sqe*) mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQES);
+		if (Sqes == MAP_FAILED)
+		{
+			Sqes = nullptr;
+			return false;
 		}
 
-		Type = FrameType::Data;
-		IsHeader = false;
-		IsLast = false;
-
-		BodyBytes = nullptr;
-		BodyBytesLen = 0;
+		uint8_t* sq = (uint8_t*) SqRing;
+		uint8_t* cq = (uint8_t*) CqRing;
+		SqHead = (unsigned*) (sq + p.sq_off.head);
+		SqTail = (unsigned*) (sq + p.sq_off.tail);
+		SqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+		SqArray = (unsigned*) (sq + p.sq_off.array);
+		SqEntries = p.sq_entries;
+		SqLocalTail = *SqTail;
+		CqHead = (unsigned*) (cq + p.cq_off.head);
+		CqTail = (unsigned*) (cq + p.cq_off.tail);
+		CqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+		Cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+		return true;
+	}
+
+	io_uring_sqe* UringQueue::NextSqe()
+	{
+		unsigned head = __atomic_load_n(SqHead, __ATOMIC_ACQUIRE);
+		if (SqLocalTail - head >= SqEntries)
+			return nullptr;
+		unsigned idx = SqLocalTail & *SqMask;
+		io_uring_sqe* sqe = &Sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		SqArray[idx] = idx;
+		SqLocalTail++;
+		SqUnsubmitted++;
+		return sqe;
+	}
+
+	int UringQueue::Enter(unsigned minComplete)
+	{
+		__atomic_store_n(SqTail, SqLocalTail, __ATOMIC_RELEASE);
+		unsigned flags = minComplete != 0 ? IORING_ENTER_GETEVENTS : 0;
+		int r = (int) syscall(__NR_io_uring_enter, RingFd, SqUnsubmitted, minComplete, flags, nullptr, 0);
+		if (r < 0)
+			return -errno;
+		SqUnsubmitted -= std::min((unsigned) r, SqUnsubmitted);
+		return r;
+	}
+
+	unsigned UringQueue::DiscardUnsubmitted()
+	{
+		// Without SQPOLL, the kernel only reads the submission queue inside io_uring_enter, so the entries past SqHead are still ours
+		unsigned head = __atomic_load_n(SqHead, __ATOMIC_ACQUIRE);
+		unsigned n = SqLocalTail - head;
+		SqLocalTail = head;
+		SqUnsubmitted = 0;
+		__atomic_store_n(SqTail, SqLocalTail, __ATOMIC_RELEASE);
+		return n;
+	}
+
+	bool UringQueue::PopCqe(io_uring_cqe& cqe)
+	{
+		unsigned head = *CqHead;
+		if (head == __atomic_load_n(CqTail, __ATOMIC_ACQUIRE))
+			return false;
+		cqe = Cqes[head & *CqMask];
+		__atomic_store_n(CqHead, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// io_uring transport, over TCP (addr is "host:port") or a unix socket (addr is "/path/to/socket").
+	// There is always a receive posted, into one of two chunk buffers, so that the kernel can be filling
+	// one chunk while Backend consumes the other.
+	// Sends do not need TransportLock. Instead, concurrent senders join a queue, and whichever thread finds
+	// no send in flight becomes the leader, and submits everything that is queued as one chain of linked
+	// SENDMSG operations, with a single io_uring_enter. Linking keeps the frames in queue order, and
+	// MSG_WAITALL keeps each frame contiguous on the wire.
+	class TransportUring : public TransportUnix
+	{
+	public:
+		static const size_t		RecvChunkSize = 65536;
+		static const unsigned	MaxSendBatch = 64;
+
+		virtual				~TransportUring() override;
+		virtual bool		Connect(const char* addr) override;
+		virtual SendResult	Send(const void* data, size_t size, size_t& sent) override;
+		virtual SendResult	SendV(const SendBuf* bufs, size_t nbufs, size_t& sent) override;
+		virtual RecvResult	Recv(size_t maxSize, void* data, size_t& bytesRead) override;
+		virtual size_t		PollFds(int* fds, size_t maxFds) override;
+		virtual bool		CanSendConcurrently() const override { return true; }
+
+	private:
+		struct PendingSend
+		{
+			const SendBuf*	Bufs;
+			size_t			NBufs;
+			size_t			Total;
+			int				Result;
+			bool			Done;
+		};
+
+		UringQueue					RecvQueue;				// Only touched by the thread calling Recv()
+		std::vector<uint8_t>		RecvChunks[2];
+		int							RecvReady = -1;			// Chunk that holds data which has not been returned by Recv() yet
+		size_t						RecvPos = 0;
+		size_t						RecvLen = 0;
+		int							RecvPosted = -1;		// Chunk that the kernel is receiving into
+		bool						RecvClosed = false;
+
+		UringQueue					SendQueue;				// Only touched by the current send leader
+		bool						SendBroken = false;		// io_uring_enter failed on SendQueue, so we don't send anymore. Only touched by the send leader.
+		std::mutex					SendLock;				// Guards everything below
+		std::condition_variable		SendCV;
+		std::vector<PendingSend*>	SendWaiting;
+		bool						SendLeaderActive = false;
+
+		static const uint64_t	CancelUserData = 2;		// user_data of our IORING_OP_ASYNC_CANCEL. Receives use the chunk index.
+
+		bool	PostRecv(int chunk);
+		void	CancelRecv();
+		void	SubmitSends(PendingSend** batch, size_t n);
+	};
+
+	TransportUring::~TransportUring()
+	{
+		CancelRecv();
+		Close();
+	}
+
+	bool TransportUring::Connect(const char* addr)
+	{
+		bool ok = addr[0] == '/' ? TransportUnix::Connect(addr) : TransportTCP::Connect(addr);
+		if (!ok)
+			return false;
+		if (!RecvQueue.Init(4) || !SendQueue.Init(MaxSendBatch))
+		{
+			Log->Logf("Unable to create io_uring: %d", (int) errno);
+			Close();
+			return false;
+		}
+		RecvChunks[0].resize(RecvChunkSize);
+		RecvChunks[1].resize(RecvChunkSize);
+		if (!PostRecv(0))
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	bool TransportUring::PostRecv(int chunk)
+	{
+		io_uring_sqe* sqe = RecvQueue.NextSqe();
+		if (sqe == nullptr)
+			return false;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = Socket;
+		sqe->addr = (uint64_t) (uintptr_t) &RecvChunks[chunk][0];
+		sqe->len = (uint32_t) RecvChunkSize;
+		sqe->user_data = chunk;
+		int r;
+		while ((r = RecvQueue.Enter(0)) == -EINTR) {}
+		if (r < 0)
+			return false;
+		RecvPosted = chunk;
+		return true;
+	}
+
+	// The kernel writes into RecvChunks[RecvPosted] until the posted receive completes. Closing the ring does cancel it,
+	// but only asynchronously, which could be after the chunks have been freed. So before the chunks go away, we shut the
+	// socket down, cancel the receive (in case the socket has already been closed), and wait for its completion.
+	void TransportUring::CancelRecv()
+	{
+		if (RecvPosted == -1 || RecvQueue.Fd() == -1)
+			return;
+		if (Socket != InvalidSocket)
+			shutdown(Socket, SHUT_RDWR);
+		io_uring_sqe* sqe = RecvQueue.NextSqe();
+		if (sqe != nullptr)
+		{
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t) RecvPosted;
+			sqe->user_data = CancelUserData;
+		}
+		while (true)
+		{
+			io_uring_cqe cqe;
+			while (RecvQueue.PopCqe(cqe))
+			{
+				if (cqe.user_data == (uint64_t) RecvPosted)
+					RecvPosted = -1;
+			}
+			if (RecvPosted == -1)
+				return;
+			int r = RecvQueue.Enter(1);
+			if (r < 0 && r != -EINTR)
+			{
+				Log->Logf("Unable to cancel io_uring receive: %d", -r);
+				return;
+			}
+		}
+	}
+
+	hb::RecvResult TransportUring::Recv(size_t maxSize, void* data, size_t& bytesRead)
+	{
+		bytesRead = 0;
+		if (RecvReady == -1)
+		{
+			if (RecvClosed)
+				return RecvResult_Closed;
+			io_uring_cqe cqe;
+			if (!RecvQueue.PopCqe(cqe))
+			{
+				if (NonBlocking)
+					return RecvResult_NoData;
+				pollfd pfd = {RecvQueue.Fd(), POLLIN, 0};
+				poll(&pfd, 1, ReadTimeoutMilliseconds);
+				if (!RecvQueue.PopCqe(cqe))
+					return RecvResult_NoData;
+			}
+			int chunk = (int) cqe.user_data;
+			RecvPosted = -1;
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+			{
+				if (!PostRecv(chunk))
+					RecvClosed = true;
+				return RecvClosed ? RecvResult_Closed : RecvResult_NoData;
+			}
+			if (cqe.res <= 0)
+			{
+				RecvClosed = true;
+				return RecvResult_Closed;
+			}
+			RecvReady = chunk;
+			RecvPos = 0;
+			RecvLen = (size_t) cqe.res;
+			// Get the kernel busy with the other chunk, while the caller consumes this one
+			if (!PostRecv(1 - chunk))
+				RecvClosed = true;
+		}
+
+		size_t n = std::min(maxSize, RecvLen - RecvPos);
+		memcpy(data, &RecvChunks[RecvReady][RecvPos], n);
+		RecvPos += n;
+		bytesRead = n;
+		if (RecvPos == RecvLen)
+			RecvReady = -1;
+		return RecvResult_Data;
+	}
+
+	size_t TransportUring::PollFds(int* fds, size_t maxFds)
+	{
+		// An io_uring fd is readable when its completion queue is not empty
+		if (maxFds < 1 || RecvQueue.Fd() == -1)
+			return 0;
+		fds[0] = RecvQueue.Fd();
+		return 1;
+	}
+
+	hb::SendResult TransportUring::Send(const void* data, size_t size, size_t& sent)
+	{
+		SendBuf buf = {data, size};
+		return SendV(&buf, 1, sent);
+	}
+
+	hb::SendResult TransportUring::SendV(const SendBuf* bufs, size_t nbufs, size_t& sent)
+	{
+		PendingSend me;
+		me.Bufs = bufs;
+		me.NBufs = nbufs;
+		me.Total = 0;
+		me.Result = 0;
+		me.Done = false;
+		for (size_t i = 0; i < nbufs; i++)
+			me.Total += bufs[i].Size;
+
+		std::unique_lock<std::mutex> lock(SendLock);
+		SendWaiting.push_back(&me);
+		while (!me.Done)
+		{
+			if (SendLeaderActive)
+			{
+				SendCV.wait(lock);
+				continue;
+			}
+			// Become the leader, and send everything that is waiting, up to MaxSendBatch
+			SendLeaderActive = true;
+			PendingSend* batch[MaxSendBatch];
+			size_t n = std::min(SendWaiting.size(), (size_t) MaxSendBatch);
+			std::copy(SendWaiting.begin(), SendWaiting.begin() + n, batch);
+			SendWaiting.erase(SendWaiting.begin(), SendWaiting.begin() + n);
+			lock.unlock();
+			SubmitSends(batch, n);
+			lock.lock();
+			for (size_t i = 0; i < n; i++)
+				batch[i]->Done = true;
+			// Hand leadership over to one of the waiters, if there are any
+			SendLeaderActive = false;
+			SendCV.notify_all();
+		}
+
+		sent = me.Result > 0 ? (size_t) me.Result : 0;
+		return sent == me.Total ? SendResult_All : SendResult_Closed;
+	}
+
+	void TransportUring::SubmitSends(PendingSend** batch, size_t n)
+	{
+		// Every PendingSend keeps its Result of zero, which fails it
+		if (SendBroken)
+			return;
+
+		msghdr msgs[MaxSendBatch];
+		std::vector<iovec> iovs;
+		size_t niov = 0;
+		for (size_t i = 0; i < n; i++)
+			niov += batch[i]->NBufs;
+		iovs.resize(niov);
+
+		niov = 0;
+		size_t nsqe = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			PendingSend* ps = batch[i];
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_iov = &iovs[niov];
+			msgs[i].msg_iovlen = ps->NBufs;
+			for (size_t j = 0; j < ps->NBufs; j++, niov++)
+			{
+				iovs[niov].iov_base = (void*) ps->Bufs[j].Data;
+				iovs[niov].iov_len = ps->Bufs[j].Size;
+			}
+			io_uring_sqe* sqe = SendQueue.NextSqe();
+			HTTPBRIDGE_ASSERT(sqe != nullptr);
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = Socket;
+			sqe->addr = (uint64_t) (uintptr_t) &msgs[i];
+			sqe->len = 1;
+			sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+			sqe->flags = i + 1 < n ? IOSQE_IO_LINK : 0;
+			sqe->user_data = i;
+			nsqe++;
+		}
+
+		// Submit the whole chain, and wait for all of it, with one syscall.
+		// We must not return while the kernel holds any part of the chain, because it points into msgs, iovs, and the
+		// callers' buffers. If io_uring_enter fails, then we shut the socket down, so that whatever the kernel did take
+		// completes right away, and we take back whatever it didn't.
+		size_t done = 0;
+		size_t expected = nsqe;
+		int r = SendQueue.Enter((unsigned) nsqe);
+		while (true)
+		{
+			if (r < 0 && r != -EINTR && !SendBroken)
+			{
+				Log->Logf("io_uring send failed: %d", -r);
+				SendBroken = true;
+				shutdown(Socket, SHUT_RDWR);
+				expected -= SendQueue.DiscardUnsubmitted();
+			}
+			io_uring_cqe cqe;
+			while (SendQueue.PopCqe(cqe))
+			{
+				batch[cqe.user_data]->Result = cqe.res;
+				done++;
+			}
+			if (done == expected)
+				return;
+			if (SendBroken)
+			{
+				// The ring fd is readable while its completion queue is not empty, and that doesn't need io_uring_enter
+				pollfd pfd = {SendQueue.Fd(), POLLIN, 0};
+				poll(&pfd, 1, 100);
+			}
+			else
+			{
+				r = SendQueue.Enter((unsigned) (expected - done));
+			}
+		}
+	}
+#endif
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	// A block of bytes received from the server. Frames are decoded in place, straight out of the chunk, and
+	// nothing inside a chunk is ever moved. When the frame at Head does not fit into the space that remains,
+	// Backend::MakeRecvRoom starts a new chunk that is large enough for the whole frame, and copies across
+	// the part of the frame that has already arrived.
+	// Frames are not necessarily aligned inside a chunk, which is fine for the platforms that we support.
+	// A chunk is reference counted. The connection holds one reference, and every InFrame or BodyView that
+	// points into the chunk holds another. A chunk is also used for a private copy of a frame's body.
+	class RecvChunk
+	{
+	public:
+		static const size_t DefaultSize = 64 * 1024;
+		static const size_t MinRecv = 4096;		// Don't bother calling Recv() with less space than this
+
+		std::atomic<uint32_t>	Refs;
+		size_t					Capacity;
+		size_t					Head;			// Start of the first frame that has not been decoded yet
+		size_t					Tail;			// End of the received bytes
+
+		static RecvChunk*	Create(size_t capacity, Logger* log);	// Returns null if out of memory. The new chunk has one reference.
+		void				AddRef()	{ Refs++; }
+		void				Release();
+
+		uint8_t*		Data()				{ return (uint8_t*) (this + 1); }
+		const uint8_t*	Data() const		{ return (const uint8_t*) (this + 1); }
+		size_t			Available() const	{ return Tail - Head; }
+	};
+
+	RecvChunk* RecvChunk::Create(size_t capacity, Logger* log)
+	{
+		RecvChunk* c = (RecvChunk*) Alloc(sizeof(RecvChunk) + capacity, log, false);
+		if (c == nullptr)
+			return nullptr;
+		new (&c->Refs) std::atomic<uint32_t>(1);
+		c->Capacity = capacity;
+		c->Head = 0;
+		c->Tail = 0;
+		return c;
+	}
+
+	void RecvChunk::Release()
+	{
+		if (--Refs == 0)
+			Free(this);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	// A header that the server has told us to cache. Entries are immutable, and are shared by the cache and
+	// every Request that uses them, so a repeated header costs one reference count, instead of a copy.
+	// The key and value follow the struct, each with a null terminator.
+	class HeaderCacheEntry
+	{
+	public:
+		std::atomic<uint32_t>	Refs;
+		int32_t					KeyLen;
+		int32_t					ValLen;
+
+		const char*	Key() const		{ return (const char*) (this + 1); }
+		const char*	Value() const	{ return Key() + KeyLen + 1; }
+
+		static HeaderCacheEntry* Create(int32_t keyLen, const void* key, int32_t valLen, const void* val, Logger* log)
+		{
+			void* mem = Alloc(sizeof(HeaderCacheEntry) + keyLen + valLen + 2, log, false);
+			if (mem == nullptr)
+				return nullptr;
+			auto e = new (mem) HeaderCacheEntry();
+			e->Refs = 1;
+			e->KeyLen = keyLen;
+			e->ValLen = valLen;
+			char* data = (char*) (e + 1);
+			memcpy(data, key, keyLen);
+			data[keyLen] = 0;
+			memcpy(data + keyLen + 1, val, valLen);
+			data[keyLen + 1 + valLen] = 0;
+			return e;
+		}
+
+		void AddRef()
+		{
+			Refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void Release()
+		{
+			if (Refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				this->~HeaderCacheEntry();
+				Free(this);
+			}
+		}
+	};
+
+	// Only touched by the thread that calls Recv. Requests hold their own references to the entries.
+	class HeaderCacheRecv
+	{
+	public:
+		~HeaderCacheRecv();
+		bool				Insert(uint16_t id, int32_t keyLen, const void* key, int32_t valLen, const void* val, Logger* log);	// Returns false if out of memory
+		HeaderCacheEntry*	Get(uint16_t id);		// Returns null for a non-existent item
+
+	private:
+		Vector<HeaderCacheEntry*> Items;
+	};
+
+	HeaderCacheRecv::~HeaderCacheRecv()
+	{
+		for (int32_t i = 0; i < Items.Size(); i++)
+		{
+			if (Items[i] != nullptr)
+				Items[i]->Release();
+		}
+	}
+
+	bool HeaderCacheRecv::Insert(uint16_t id, int32_t keyLen, const void* key, int32_t valLen, const void* val, Logger* log)
+	{
+		auto e = HeaderCacheEntry::Create(keyLen, key, valLen, val, log);
+		if (e == nullptr)
+			return false;
+		while (Items.Size() <= (int32_t) id)
+			Items.Push(nullptr);
+		if (Items[id] != nullptr)
+			Items[id]->Release();
+		Items[id] = e;
+		return true;
+	}
+
+	HeaderCacheEntry* HeaderCacheRecv::Get(uint16_t id)
+	{
+		if (id >= Items.Size())
+			return nullptr;
+		return Items[id];
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	// Response headers that we send to the server by id. This is shared by every thread that sends responses,
+	// and by every connection. It is an open addressed hash table of immutable entries, which are inserted
+	// with a compare-and-swap, and never removed, so the id of an entry (its slot number + 1) means the same
+	// thing for the life of the Backend. Each connection remembers which ids it has already defined.
+	// A pair only gets an entry the second time that we see it, so that values which differ from one response
+	// to the next (such as Content-Length) don't fill up the table.
+	class HeaderCacheSend
+	{
+	public:
+		static const uint32_t NumSlots = 1024;
+		static const uint32_t MaxEntries = 768;		// Keep the probe sequences short
+		static const uint32_t MaxProbe = 8;
+		static const uint32_t MaxPairLen = 1024;	// Longer pairs are always sent inline
+		static const uint32_t NumSeen = 4096;
+
+		HeaderCacheSend();
+		~HeaderCacheSend();
+		uint16_t	Lookup(int32_t keyLen, const char* key, int32_t valLen, const char* val, Logger* log);	// Returns the id of the pair, or 0 if the pair must be sent inline
+
+	private:
+		struct Entry
+		{
+			uint32_t	Hash;
+			int32_t		KeyLen;
+			int32_t		ValLen;
+			const char*	Key() const		{ return (const char*) (this + 1); }
+			const char*	Value() const	{ return Key() + KeyLen; }
+		};
+		std::atomic<Entry*>		Slots[NumSlots];
+		std::atomic<uint32_t>	Seen[NumSeen];		// Hashes of pairs that we've seen once. Collisions merely delay an insertion.
+		std::atomic<uint32_t>	Count;
+
+		static uint32_t PairHash(int32_t keyLen, const char* key, int32_t valLen, const char* val);
+	};
+
+	HeaderCacheSend::HeaderCacheSend()
+	{
+		for (auto& s : Slots)
+			s.store(nullptr);
+		for (auto& s : Seen)
+			s.store(0);
+		Count.store(0);
+	}
+
+	HeaderCacheSend::~HeaderCacheSend()
+	{
+		for (auto& s : Slots)
+			Free(s.load());
+	}
+
+	uint32_t HeaderCacheSend::PairHash(int32_t keyLen, const char* key, int32_t valLen, const char* val)
+	{
+		uint32_t h = 2166136261u;
+		for (int32_t i = 0; i < keyLen; i++)
+			h = (h ^ (uint8_t) key[i]) * 16777619u;
+		h = (h ^ ':') * 16777619u;
+		for (int32_t i = 0; i < valLen; i++)
+			h = (h ^ (uint8_t) val[i]) * 16777619u;
+		return h;
+	}
+
+	uint16_t HeaderCacheSend::Lookup(int32_t keyLen, const char* key, int32_t valLen, const char* val, Logger* log)
+	{
+		if (keyLen == 0 || (uint32_t) (keyLen + valLen) > MaxPairLen)
+			return 0;
+
+		uint32_t h = PairHash(keyLen, key, valLen, val);
+		uint32_t slot = h & (NumSlots - 1);
+		for (uint32_t probe = 0; probe < MaxProbe; probe++, slot = (slot + 1) & (NumSlots - 1))
+		{
+			Entry* e = Slots[slot].load(std::memory_order_acquire);
+			if (e == nullptr)
+			{
+				auto& seen = Seen[h & (NumSeen - 1)];
+				if (seen.load(std::memory_order_relaxed) != h)
+				{
+					seen.store(h, std::memory_order_relaxed);
+					return 0;
+				}
+				if (Count.load(std::memory_order_relaxed) >= MaxEntries)
+					return 0;
+				Entry* ne = (Entry*) Alloc(sizeof(Entry) + keyLen + valLen, log, false);
+				if (ne == nullptr)
+					return 0;
+				ne->Hash = h;
+				ne->KeyLen = keyLen;
+				ne->ValLen = valLen;
+				memcpy((char*) ne->Key(), key, keyLen);
+				memcpy((char*) ne->Value(), val, valLen);
+				if (Slots[slot].compare_exchange_strong(e, ne, std::memory_order_acq_rel))
+				{
+					Count++;
+					return (uint16_t) (slot + 1);
+				}
+				// Another thread filled the slot first, possibly with this same pair
+				Free(ne);
+			}
+			if (e->Hash == h && e->KeyLen == keyLen && e->ValLen == valLen && memcmp(e->Key(), key, keyLen) == 0 && memcmp(e->Value(), val, valLen) == 0)
+				return (uint16_t) (slot + 1);
+		}
+		return 0;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	bool ConstString::StartsWith(const char* s) const
+	{
+		if (Data == nullptr)
+			return s == nullptr || !s[0];
+		int i = 0;
+		for (; Data[i] == s[i] && Data[i]; i++) {}
+		return !s[i];
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	Buffer::Buffer()
+	{
+	}
+
+	Buffer::~Buffer()
+	{
+		Free(Data);
+	}
+	
+	void Buffer::Clear()
+	{
+		Free(Data);
+		Data = nullptr;
+		Count = 0;
+		Capacity = 0;
+	}
+
+	uint8_t* Buffer::Preallocate(size_t n)
+	{
+		while (Count + n > Capacity)
+			GrowCapacityOrPanic();
+		return Data + Count;
+	}
+
+	void Buffer::EraseFromStart(size_t n)
+	{
+		memmove(Data, Data + n, Count - n);
+		Count -= n;
+	}
+
+	void Buffer::Write(const void* buf, size_t n)
+	{
+		while (Count + n > Capacity)
+			GrowCapacityOrPanic();
+		memcpy(Data + Count, buf, n);
+		Count += n;
+	}
+	
+	bool Buffer::TryWrite(const void* buf, size_t n)
+	{
+		while (Count + n > Capacity)
+		{
+			if (!TryGrowCapacity())
+				return false;
+		}
+		memcpy(Data + Count, buf, n);
+		Count += n;
+		return true;
+	}
+
+	void Buffer::WriteStr(const char* s)
+	{
+		Write(s, strlen(s));
+	}
+
+	void Buffer::WriteUInt64(uint64_t v)
+	{
+		// 18446744073709551615 (max uint64) is 20 characters, and U64toa insists on adding a null terminator
+		while (Count + 21 > Capacity)
+			GrowCapacityOrPanic();
+		Count += U64toa(v, (char*) (Data + Count), 21);
+	}
+
+	void Buffer::GrowCapacityOrPanic()
+	{
+		Capacity = Capacity == 0 ? 64 : Capacity * 2;
+		Data = (uint8_t*) Realloc(Data, Capacity, nullptr);
+	}
+
+	bool Buffer::TryGrowCapacity()
+	{
+		auto newCapacity = Capacity == 0 ? 64 : Capacity * 2;
+		auto newData = (uint8_t*) Realloc(Data, newCapacity, nullptr, false);
+		if (newData == nullptr)
+		{
+			return false;
+		}
+		else
+		{
+			Capacity = newCapacity;
+			Data = newData;
+			return true;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	BodyView::BodyView()
+	{
+	}
+
+	BodyView::BodyView(const BodyView& b)
+	{
+		*this = b;
+	}
+
+	BodyView::BodyView(BodyView&& b)
+	{
+		*this = std::move(b);
+	}
+
+	BodyView::~BodyView()
+	{
+		if (Chunk != nullptr)
+			Chunk->Release();
+	}
+
+	BodyView& BodyView::operator=(const BodyView& b)
+	{
+		if (b.Chunk != nullptr)
+			b.Chunk->AddRef();
+		if (Chunk != nullptr)
+			Chunk->Release();
+		Chunk = b.Chunk;
+		Bytes = b.Bytes;
+		Len = b.Len;
+		return *this;
+	}
+
+	BodyView& BodyView::operator=(BodyView&& b)
+	{
+		if (this != &b)
+		{
+			if (Chunk != nullptr)
+				Chunk->Release();
+			Chunk = b.Chunk;
+			Bytes = b.Bytes;
+			Len = b.Len;
+			b.Chunk = nullptr;
+			b.Bytes = nullptr;
+			b.Len = 0;
+		}
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	InFrame::InFrame()
+	{
+		Request = nullptr;
+		BodyBytes = nullptr;
+		Reset();
+	}
+
+	InFrame::InFrame(InFrame&& b)
+	{
+		BodyBytes = nullptr;
+		Reset();
+		*this = std::move(b);
+	}
+
+	InFrame::~InFrame()
+	{
+		Reset();
+	}
+
+	InFrame& InFrame::operator=(InFrame&& b)
+	{
+		if (this != &b)
+		{
+			Reset();
+			Request = std::move(b.Request);
+			Type = b.Type;
+			IsHeader = b.IsHeader;
+			IsLast = b.IsLast;
+			BodyBytes = b.BodyBytes;
+			BodyBytesLen = b.BodyBytesLen;
+			BodyChunk = b.BodyChunk;
+			b.BodyChunk = nullptr;
+			b.BodyBytes = nullptr;
+			b.BodyBytesLen = 0;
+			b.Reset();
+		}
+		return *this;
+	}
+
+	void InFrame::Reset()
+	{
+		if (Request != nullptr)
+		{
+			// This is often the point at which the last reference to Request* is lost, so 
+			// Request is likely to be destroyed by this next line.
+			Request = nullptr;
+		}
+
+		ReleaseBody();
+
+		Type = FrameType::Data;
+		IsHeader = false;
+		IsLast = false;
+	}
+
+	BodyView InFrame::Body() const
+	{
+		BodyView v;
+		if (BodyChunk != nullptr)
+		{
+			BodyChunk->AddRef();
+			v.Chunk = BodyChunk;
+			v.Bytes = BodyBytes;
+			v.Len = BodyBytesLen;
+		}
+		return v;
+	}
+
+	void InFrame::ReleaseBody()
+	{
+		if (BodyChunk != nullptr)
+		{
+			HTTPBRIDGE_ASSERT(BodyBytesLen != 0);
+			BodyChunk->Release();
+		}
+		BodyChunk = nullptr;
+		BodyBytes = nullptr;
+		BodyBytesLen = 0;
 	}
 
 	bool InFrame::ResendWhenBodyIsDone()
@@ -939,17 +2250,296 @@ namespace hb
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+	struct Dispatcher::Worker
+	{
+		std::mutex				Lock;			// Guards Queue and Sleeping
+		std::condition_variable	Wake;
+		std::deque<InFrame>		Queue;
+		bool					Sleeping = false;
+		std::thread				Thread;
+	};
+
+	Dispatcher::Dispatcher()
+	{
+		Stopping = false;
+	}
+
+	Dispatcher::~Dispatcher()
+	{
+		Stop();
+	}
+
+	void Dispatcher::Start(uint32_t workers, DispatchHandler handler, void* context)
+	{
+		HTTPBRIDGE_ASSERT(Workers.size() == 0);
+		if (workers == 0)
+			workers = std::max(std::thread::hardware_concurrency(), 1u);
+		Handler = handler;
+		Context = context;
+		Stopping = false;
+		for (uint32_t i = 0; i < workers; i++)
+			Workers.push_back(new Worker());
+		for (auto w : Workers)
+			w->Thread = std::thread(WorkerThread, this, w);
+	}
+
+	void Dispatcher::Stop()
+	{
+		if (Workers.size() == 0)
+			return;
+		Stopping = true;
+		for (auto w : Workers)
+		{
+			std::lock_guard<std::mutex> lock(w->Lock);
+			w->Wake.notify_one();
+		}
+		for (auto w : Workers)
+			w->Thread.join();
+		for (auto w : Workers)
+			delete w;
+		Workers.clear();
+	}
+
+	void Dispatcher::Dispatch(InFrame& frame)
+	{
+		HTTPBRIDGE_ASSERT(Workers.size() != 0);
+		size_t home = 0;
+		if (frame.Request != nullptr)
+		{
+			StreamKey key = { frame.Request->Channel, frame.Request->Stream };
+			home = std::hash<StreamKey>()(key) % Workers.size();
+		}
+		Worker* w = Workers[home];
+		bool stealable = IsStealable(frame);
+		bool homeIsBusy;
+		{
+			std::lock_guard<std::mutex> lock(w->Lock);
+			w->Queue.push_back(std::move(frame));
+			homeIsBusy = !w->Sleeping;
+			if (w->Sleeping)
+				w->Wake.notify_one();
+		}
+		// Rather than wait for the home worker to get to it, let an idle worker pick it up
+		if (stealable && homeIsBusy)
+			WakeIdleWorker(w);
+	}
+
+	bool Dispatcher::IsStealable(const InFrame& frame)
+	{
+		return frame.Type == FrameType::Data && frame.IsHeader && frame.IsLast;
+	}
+
+	void Dispatcher::WakeIdleWorker(Worker* except)
+	{
+		for (auto w : Workers)
+		{
+			if (w == except)
+				continue;
+			std::lock_guard<std::mutex> lock(w->Lock);
+			if (w->Sleeping)
+			{
+				w->Wake.notify_one();
+				return;
+			}
+		}
+	}
+
+	bool Dispatcher::PopOwn(Worker* w, InFrame& frame)
+	{
+		std::lock_guard<std::mutex> lock(w->Lock);
+		if (w->Queue.size() == 0)
+			return false;
+		frame = std::move(w->Queue.front());
+		w->Queue.pop_front();
+		return true;
+	}
+
+	bool Dispatcher::Steal(Worker* w, InFrame& frame)
+	{
+		// Start at our neighbour, so that thieves don't all pile onto the first worker
+		size_t self = std::find(Workers.begin(), Workers.end(), w) - Workers.begin();
+		for (size_t i = 1; i < Workers.size(); i++)
+		{
+			Worker* victim = Workers[(self + i) % Workers.size()];
+			std::lock_guard<std::mutex> lock(victim->Lock);
+			for (size_t j = victim->Queue.size(); j != 0; j--)
+			{
+				if (IsStealable(victim->Queue[j - 1]))
+				{
+					frame = std::move(victim->Queue[j - 1]);
+					victim->Queue.erase(victim->Queue.begin() + (j - 1));
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void Dispatcher::WorkerThread(Dispatcher* d, Worker* w)
+	{
+		InFrame frame;
+		while (true)
+		{
+			if (d->PopOwn(w, frame) || d->Steal(w, frame))
+			{
+				d->Handler(d->Context, frame);
+				frame.Reset();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(w->Lock);
+			if (w->Queue.size() != 0)
+				continue;
+			// Only exit once our queue is drained, so that Stop() doesn't drop any frames
+			if (d->Stopping)
+				break;
+			w->Sleeping = true;
+			w->Wake.wait(lock);
+			w->Sleeping = false;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	// A received Request lives in a single slab, which holds the shared_ptr control block and the Request object,
+	// followed by the header block, followed by space for the decoded URI. The slab is returned to RequestSlabPool when
+	// the last RequestPtr goes away. That can happen on any thread, and after the Backend is gone, so the pool is global.
+	// Slabs are recycled in a few size classes. Bigger slabs are simply allocated and freed.
+	class RequestSlabPool
+	{
+	public:
+		static const size_t	MinClassSize = 1024;
+		static const int	NumClasses = 4;				// 1, 2, 4, and 8 KB
+		static const size_t	MaxFreePerClass = 256;		// Beyond this, freed slabs go back to the heap
+
+		static void* Alloc(size_t size, Logger* log)
+		{
+			int c = ClassOf(size);
+			if (c != -1)
+			{
+				std::lock_guard<std::mutex> lock(Classes[c].Lock);
+				if (Classes[c].Free.size() != 0)
+				{
+					void* slab = Classes[c].Free.back();
+					Classes[c].Free.pop_back();
+					return slab;
+				}
+			}
+			return hb::Alloc(c == -1 ? size : MinClassSize << c, log, false);
+		}
+
+		static void Free(void* slab, size_t size)
+		{
+			int c = ClassOf(size);
+			if (c != -1)
+			{
+				std::lock_guard<std::mutex> lock(Classes[c].Lock);
+				if (Classes[c].Free.size() < MaxFreePerClass)
+				{
+					Classes[c].Free.push_back(slab);
+					return;
+				}
+			}
+			hb::Free(slab);
+		}
+
+	private:
+		struct SizeClass
+		{
+			std::mutex			Lock;
+			std::vector<void*>	Free;
+
+			~SizeClass()
+			{
+				for (void* slab : Free)
+					hb::Free(slab);
+			}
+		};
+		static SizeClass Classes[NumClasses];
+
+		static int ClassOf(size_t size)
+		{
+			for (int c = 0; c < NumClasses; c++)
+			{
+				if (size <= MinClassSize << c)
+					return c;
+			}
+			return -1;
+		}
+	};
+
+	RequestSlabPool::SizeClass RequestSlabPool::Classes[RequestSlabPool::NumClasses];
+
+	// Room at the start of a slab for the control block that std::allocate_shared puts in front of the Request
+	static const size_t RequestSlabHeaderSize = RoundUp8(sizeof(Request) + 128);
+
+	// Hands std::allocate_shared a slab that we've already allocated, so that running out of memory is
+	// reported as FrameStatus::OutOfMemory instead of an exception.
+	template<typename T>
+	class RequestSlabAllocator
+	{
+	public:
+		typedef T value_type;
+		template<typename U> struct rebind { typedef RequestSlabAllocator<U> other; };
+
+		void*	Slab;
+		size_t	SlabSize;
+
+		RequestSlabAllocator(void* slab, size_t slabSize) : Slab(slab), SlabSize(slabSize) {}
+		template<typename U> RequestSlabAllocator(const RequestSlabAllocator<U>& b) : Slab(b.Slab), SlabSize(b.SlabSize) {}
+
+		T* allocate(size_t n)
+		{
+			HTTPBRIDGE_ASSERT(n * sizeof(T) <= RequestSlabHeaderSize);
+			return (T*) Slab;
+		}
+
+		void deallocate(T* p, size_t)
+		{
+			RequestSlabPool::Free(p, SlabSize);
+		}
+
+		template<typename U> bool operator==(const RequestSlabAllocator<U>& b) const { return Slab == b.Slab; }
+		template<typename U> bool operator!=(const RequestSlabAllocator<U>& b) const { return Slab != b.Slab; }
+	};
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 	Backend::Backend()
 	{
 		MaxWaitingBufferTotal.store(1024 * 1024 * 1024);
 		MaxAutoBufferSize.store(16 * 1024 * 1024);
 		InitialBufferSize.store(4096);
 		BufferedRequestsTotalBytes.store(0);
+		HeldBytesTotal.store(0);
+		WakeupPending.store(false);
+		SendOpen.store(false);
+		SendPins.store(0);
+		static_assert(hb::HeaderCacheSend::NumSlots == MaxSendHeaderIDs, "HeaderCacheSend ids must fit in Connection::HeadersDefined");
+		HeaderCacheSend = new hb::HeaderCacheSend();
+
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		EpollFd = epoll_create1(EPOLL_CLOEXEC);
+		WakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		if (EpollFd == -1 || WakeupFd == -1 || epoll_ctl(EpollFd, EPOLL_CTL_ADD, WakeupFd, &ev) != 0)
+			HTTPBRIDGE_PANIC("Unable to create epoll set for Backend");
+#endif
 	}
 
 	Backend::~Backend()
 	{
 		Close();
+		delete HeaderCacheSend;
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		::close(EpollFd);
+		::close(WakeupFd);
+#endif
 	}
 
 	Logger* Backend::AnyLog()
@@ -957,78 +2547,287 @@ namespace hb
 		return Log ? Log : &NullLog;
 	}
 
-	bool Backend::Connect(const char* network, const char* addr)
+	static ITransport* CreateTransport(const char* network)
+	{
+		if (strcmp(network, "tcp") == 0)
+			return new TransportTCP();
+#ifndef HTTPBRIDGE_PLATFORM_WINDOWS
+		else if (strcmp(network, "unix") == 0)
+			return new TransportUnix();
+#endif
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		else if (strcmp(network, "shm") == 0)
+			return new TransportShm();
+#endif
+#if defined(HTTPBRIDGE_PLATFORM_LINUX) && defined(HTTPBRIDGE_IO_URING)
+		else if (strcmp(network, "uring") == 0)
+			return new TransportUring();
+#endif
+		return nullptr;
+	}
+
+	bool Backend::Connect(const char* network, const char* addr)
+	{
+		Close();
+
+		uint32_t nconn = Connections == 0 ? 1 : Connections;
+		if (nconn > 1 && EpollFd == -1)
+		{
+			// Without epoll, a blocking Recv() on one connection would stall all of the others
+			AnyLog()->Logf("Multiple connections are not supported on this platform. Using one connection.");
+			nconn = 1;
+		}
+
+		for (uint32_t i = 0; i < nconn; i++)
+		{
+			ITransport* tx = CreateTransport(network);
+			if (tx == nullptr)
+				return false;
+			if (!AddConnection(tx, addr))
+			{
+				delete tx;
+				Close();
+				return false;
+			}
+		}
+
+		if (nconn > 1 && !SendHello())
+		{
+			Close();
+			return false;
+		}
+
+		ThreadId = std::this_thread::get_id();
+		RecvNext = 0;
+		SendOpen = true;
+		return true;
+	}
+
+	bool Backend::IsConnected()
+	{
+		return Conns.size() != 0;
+	}
+
+	void Backend::Close()
+	{
+		// Turn away new senders, and wait for the ones that are busy with Conns to finish, before we tear the connections down
+		SendOpen = false;
+		for (Connection* con : Conns)
+			NotifyQueueRoom(*con);
+		while (SendPins != 0)
+			std::this_thread::yield();
+
+		// Nothing more can be sent on these streams, so release anybody who is waiting for them to be resumed
+		for (size_t i = 0; i < StreamToRequestMap::NumShards; i++)
+		{
+			auto& shard = CurrentRequests.ShardAt(i);
+			std::lock_guard<std::mutex> lock(shard.Lock);
+			for (auto& it : shard.Items)
+			{
+				it.second.Request->SetState(StreamState::Aborted);
+				HeldBytesTotal -= it.second.HeldBytes;
+				FreeFrameList(it.second.Held);
+			}
+			shard.Items.clear();
+		}
+		NotifyStreamStateChanged();
+
+		if (BufferedRequestsTotalBytes.load() != 0)
+			AnyLog()->Logf("BufferedRequestsTotalBytes is %llu, instead of zero", (uint64_t) BufferedRequestsTotalBytes.load());
+
+		for (Connection* con : Conns)
+		{
+			con->WriterLock.lock();
+			con->WriterStop = true;
+			con->WriterLock.unlock();
+			if (con->Writer.joinable())
+			{
+				con->WriterCV.notify_one();
+				con->Writer.join();
+			}
+			// The writer drains the queue before it stops, but a frame could still have been pushed after it looked for the last time
+			FailQueuedFrames(con->SendQueue.exchange(nullptr));
+			WatchTransportFds(*con, false);
+			if (con->Recv != nullptr)
+				con->Recv->Release();
+			delete con->Transport;
+			delete con->HeaderCacheRecv;
+			delete con;
+		}
+		Conns.clear();
+	}
+
+	bool Backend::AddConnection(ITransport* transport, const char* addr)
+	{
+		transport->Log = Log != nullptr ? Log : &NullLog;
+		// When we have an epoll set, we do our own waiting inside Recv(), so the transport never needs to block
+		transport->NonBlocking = NonBlocking || EpollFd != -1;
+		if (!transport->Connect(addr))
+			return false;
+		Connection* con = new Connection();
+		con->Transport = transport;
+		con->HeaderCacheRecv = new hb::HeaderCacheRecv();
+		Conns.push_back(con);
+		WatchTransportFds(*con, true);
+		if (AsyncSend)
+			con->Writer = std::thread(&Backend::WriterThread, this, con);
+		return true;
+	}
+
+	// Tell the server which of its connections belong together
+	bool Backend::SendHello()
+	{
+		std::random_device rd;
+		char token[40];
+		snprintf(token, sizeof(token), "%08x%08x%08x%08x", rd(), rd(), rd(), rd());
+		char count[20];
+		snprintf(count, sizeof(count), "%u", (unsigned) Conns.size());
+
+		for (size_t i = 0; i < Conns.size(); i++)
+		{
+			char index[20];
+			snprintf(index, sizeof(index), "%u", (unsigned) i);
+			const char* pairs[3][2] = {
+				{"Backend", token},
+				{"Connections", count},
+				{"Connection", index},
+			};
+			flatbuffers::FlatBufferBuilder fbb;
+			std::vector<flatbuffers::Offset<httpbridge::TxHeaderLine>> lines;
+			for (auto& p : pairs)
+			{
+				auto key = fbb.CreateVector((const uint8_t*) p[0], strlen(p[0]));
+				auto val = fbb.CreateVector((const uint8_t*) p[1], strlen(p[1]));
+				lines.push_back(httpbridge::CreateTxHeaderLine(fbb, key, val));
+			}
+			auto root = httpbridge::CreateTxFrame(fbb, httpbridge::TxFrameType_Hello, httpbridge::TxHttpVersion_Http10, 0, 0, 0, fbb.CreateVector(lines));
+			httpbridge::FinishTxFrameBuffer(fbb, root);
+			uint8_t head[8];
+			Write32LE(head, MagicFrameMarker);
+			Write32LE(head + 4, fbb.GetSize());
+			SendBuf parts[2] = {{head, 8}, {fbb.GetBufferPointer(), fbb.GetSize()}};
+			if (SendFrame(*Conns[i], parts, 2) != SendResult_All)
+				return false;
+		}
+		return true;
+	}
+
+	void Backend::WatchTransportFds(Connection& con, bool watch)
+	{
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		// We must remove the fds explicitly, because an epoll registration lives as long as the underlying file,
+		// and the shm transport's eventfds are shared with the server process.
+		int fds[4];
+		size_t nfds = con.Transport->PollFds(fds, 4);
+		for (size_t i = 0; i < nfds; i++)
+		{
+			epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.u64 = 1;
+			if (epoll_ctl(EpollFd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fds[i], &ev) != 0)
+				AnyLog()->Logf("epoll_ctl failed: %d", (int) errno);
+		}
+#endif
+	}
+
+	int Backend::PollFd()
+	{
+		return EpollFd;
+	}
+
+	bool Backend::Wait(uint32_t timeoutMilliseconds)
 	{
-		ITransport* tx = nullptr;
-		if (strcmp(network, "tcp") == 0)
-			tx = new TransportTCP();
-		else
-			return false;
-
-		if (!Connect(tx, addr))
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		if (WakeupPending)
 		{
-			delete tx;
+			ConsumeWakeup();
 			return false;
 		}
+		epoll_event events[4];
+		int n = epoll_wait(EpollFd, events, 4, (int) timeoutMilliseconds);
+		bool haveData = false;
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.u64 == 0)
+			{
+				ConsumeWakeup();
+				return false;
+			}
+			haveData = true;
+		}
+		return haveData;
+#else
+		// We can't wait on the transport, so the caller must fall back to a blocking Recv()
 		return true;
+#endif
 	}
 
-	bool Backend::IsConnected()
+	void Backend::Wakeup()
 	{
-		return Transport != nullptr;
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		if (!WakeupPending.exchange(true))
+		{
+			uint64_t one = 1;
+			if (write(WakeupFd, &one, sizeof(one))) {}
+		}
+#endif
 	}
 
-	void Backend::Close()
+	void Backend::ConsumeWakeup()
 	{
-		CurrentRequestLock.lock();
-		CurrentRequests.clear();
-		CurrentRequestLock.unlock();
-
-		if (BufferedRequestsTotalBytes.load() != 0)
-			AnyLog()->Logf("BufferedRequestsTotalBytes is %llu, instead of zero", (uint64_t) BufferedRequestsTotalBytes.load());
+#ifdef HTTPBRIDGE_PLATFORM_LINUX
+		WakeupPending = false;
+		uint64_t count;
+		if (read(WakeupFd, &count, sizeof(count))) {}
+#endif
+	}
 
-		delete Transport;
-		Transport = nullptr;
-		delete HeaderCacheRecv;
-		HeaderCacheRecv = nullptr;
-		RecvBuf.Clear();
+	bool Backend::HaveCompleteFrame(const Connection& con)
+	{
+		const RecvChunk* c = con.Recv;
+		return c != nullptr && c->Available() >= 8 && c->Available() >= 8 + (size_t) Read32LE(c->Data() + c->Head + 4);
 	}
 
-	bool Backend::Connect(ITransport* transport, const char* addr)
+	// The caller must hold a ConnPin. Returns null if we are not connected.
+	Backend::Connection* Backend::ConnectionFor(const StreamKey& key)
 	{
-		Close();
-		transport->Log = Log != nullptr ? Log : &NullLog;
-		if (transport->Connect(addr))
-		{
-			ThreadId = std::this_thread::get_id();
-			Transport = transport;
-			HeaderCacheRecv = new hb::HeaderCacheRecv();
-			return true;
-		}
-		return false;
+		// All of the frames of a stream must use the same connection, otherwise they could arrive out of order
+		if (Conns.size() == 0)
+			return nullptr;
+		if (Conns.size() == 1)
+			return Conns[0];
+		return Conns[std::hash<StreamKey>()(key) % Conns.size()];
 	}
 
-	SendResult Backend::Send(Response& response)
+	// Account for the body bytes of a frame that we're about to send, and finish the stream if this is its last frame.
+	// 'header' is null for a body part frame. If 'hold' comes back true, then the frame must go to HoldFrame(), which
+	// finishes the stream when the frame is finally sent.
+	SendResult Backend::ConsumeResponseBody(const StreamKey& key, Response* header, size_t bodyBytes, bool isFinalChunk, bool& isLast, bool& hold)
 	{
-		CurrentRequestLock.lock();
-		RequestState* rs = GetRequest(response.Channel, response.Stream);
+		auto& shard = CurrentRequests.ShardFor(key);
+		shard.Lock.lock();
+		RequestState* rs = shard.Find(key);
 		if (!rs)
 		{
 			// The stream has been closed. A typical thing that causes this is an aborted stream.
-			CurrentRequestLock.unlock();
+			shard.Lock.unlock();
 			return SendResult_Closed;
 		}
-		bool isResponseHeader = response.Status != StatusMeta_BodyPart;
 
-		if (!isResponseHeader)
-			HTTPBRIDGE_ASSERT(response.HeaderCount() == 0);
+		// Once a frame is held, every later frame of the stream must queue up behind it
+		hold = HoldWhilePaused && (rs->Held != nullptr || rs->IsFlushing || rs->Request->State() == StreamState::Paused);
+		if (hold && HeldBytesTotal + bodyBytes > MaxHeldBytesTotal)
+		{
+			shard.Lock.unlock();
+			return SendResult_BufferFull;
+		}
 
 		// The first response must contain a response header
-		HTTPBRIDGE_ASSERT(isResponseHeader == !rs->IsResponseHeaderSent);
+		HTTPBRIDGE_ASSERT((header != nullptr) == !rs->IsResponseHeaderSent);
 
-		if (isResponseHeader)
+		if (header != nullptr)
 		{
-			const char* contentLen = response.HeaderByName("Content-Length");
+			const char* contentLen = header->HeaderByName("Content-Length");
 			if (contentLen != nullptr)
 			{
 				// If you set Content-Length, then that is the expected length of the response, unless it's -1, in which case it's chunked.
@@ -1037,43 +2836,480 @@ namespace hb
 			else
 			{
 				// If you don't set Content-Length, then whatever bytes are inside your response, is the expected length of the response.
-				rs->ResponseBodyRemaining = response.BodyBytes();
-				if (response.BodyBytes() != 0)
-					response.AddHeader_ContentLength(response.BodyBytes());
+				rs->ResponseBodyRemaining = bodyBytes;
+				if (bodyBytes != 0)
+					header->AddHeader_ContentLength(bodyBytes);
 			}
 			rs->IsResponseHeaderSent = true;
+			// Tell the server that we honour its window, so that it sends us WindowUpdate instead of Pause and Resume
+			if (rs->HasCredits)
+				header->Window = rs->Request->_ResponseWindow;
 		}
-		HTTPBRIDGE_ASSERT(rs->ResponseBodyRemaining >= response.BodyBytes()); // You have sent more data than Content-Length
-		rs->ResponseBodyRemaining -= response.BodyBytes();
-		CurrentRequestLock.unlock();
+		HTTPBRIDGE_ASSERT(rs->ResponseBodyRemaining >= bodyBytes); // You have sent more data than Content-Length
+		rs->ResponseBodyRemaining -= bodyBytes;
+		isLast = rs->ResponseBodyRemaining == 0 || isFinalChunk;
+
+		// A held frame pays for itself when it is flushed
+		if (rs->HasCredits && !hold)
+		{
+			rs->Credits -= (int64_t) bodyBytes;
+			if (rs->Credits <= 0 && !isLast)
+				rs->Request->SetState(StreamState::Paused);
+		}
+		shard.Lock.unlock();
+
+		if (isLast && !hold)
+			RequestFinished(key);
+		return SendResult_All;
+	}
+
+	// Put a frame onto the stream's Held queue. If the stream has been resumed in the meantime, and nobody is flushing
+	// the queue, then we flush it ourselves.
+	SendResult Backend::HoldFrame(const StreamKey& key, const SendBuf* parts, size_t nparts, OwnedBody* body, size_t bodyBytes, bool isLast)
+	{
+		QueuedFrame* frame = NewQueuedFrame(key.Channel, key.Stream, parts, nparts, body);
+		frame->Next = nullptr;
+		frame->BodyBytes = bodyBytes;
+		size_t bytes = frame->Size + frame->Body.Size;
 
-		bool isLast = rs->ResponseBodyRemaining == 0 || response.IsFinalChunkedFrame;
+		auto& shard = CurrentRequests.ShardFor(key);
+		shard.Lock.lock();
+		RequestState* rs = shard.Find(key);
+		if (!rs)
+		{
+			shard.Lock.unlock();
+			FreeQueuedFrame(frame);
+			return SendResult_Closed;
+		}
+		if (rs->HeldTail != nullptr)
+			rs->HeldTail->Next = frame;
+		else
+			rs->Held = frame;
+		rs->HeldTail = frame;
+		rs->HeldBytes += bytes;
+		HeldBytesTotal += bytes;
 		if (isLast)
+			rs->FinishAfterFlush = true;
+		size_t heldBytes = rs->HeldBytes;
+		bool highWater = !rs->IsAboveHighWater && heldBytes > HeldHighWaterBytes;
+		if (highWater)
+			rs->IsAboveHighWater = true;
+		bool flush = !rs->IsFlushing && rs->Request->State() == StreamState::Active;
+		if (flush)
+			rs->IsFlushing = true;
+		shard.Lock.unlock();
+
+		if (highWater && HeldHighWater != nullptr)
+			HeldHighWater(this, key.Channel, key.Stream, heldBytes);
+		return flush ? FlushHeldFrames(key) : SendResult_All;
+	}
+
+	// Send the stream's Held frames, including any that are added while we're busy. The caller must have set IsFlushing.
+	// We stop if the stream is paused again, and leave the rest for the next Resume. A stream that uses credits only
+	// sends as many frames as its credits pay for, and is then paused until the next WindowUpdate.
+	SendResult Backend::FlushHeldFrames(const StreamKey& key)
+	{
+		auto& shard = CurrentRequests.ShardFor(key);
+		ConnPin pin(this);
+		Connection* conp = pin.Open ? ConnectionFor(key) : nullptr;
+		if (conp == nullptr)
+		{
+			// Close() releases the Held frames
+			shard.Lock.lock();
+			if (RequestState* rs = shard.Find(key))
+				rs->IsFlushing = false;
+			shard.Lock.unlock();
+			return SendResult_Closed;
+		}
+		Connection& con = *conp;
+		while (true)
+		{
+			shard.Lock.lock();
+			RequestState* rs = shard.Find(key);
+			if (!rs)
+			{
+				// Aborted. RequestFinished() has released the frames that were still held.
+				shard.Lock.unlock();
+				return SendResult_Closed;
+			}
+			bool outOfCredits = rs->HasCredits && rs->Credits <= 0;
+			if (rs->Held == nullptr || rs->Request->State() != StreamState::Active || outOfCredits)
+			{
+				rs->IsFlushing = false;
+				if (outOfCredits && rs->Held != nullptr)
+					rs->Request->SetState(StreamState::Paused);
+				if (rs->Held == nullptr)
+				{
+					rs->IsAboveHighWater = false;
+					// The stream's last frame has gone out. We can't use RequestFinished here, because we hold the lock.
+					if (rs->FinishAfterFlush)
+						shard.Items.erase(key);
+				}
+				shard.Lock.unlock();
+				return SendResult_All;
+			}
+			QueuedFrame* list = rs->Held;
+			if (rs->HasCredits)
+			{
+				QueuedFrame* last = nullptr;
+				size_t bytes = 0;
+				for (QueuedFrame* f = rs->Held; f != nullptr && rs->Credits > 0; f = f->Next)
+				{
+					rs->Credits -= (int64_t) f->BodyBytes;
+					bytes += f->Size + f->Body.Size;
+					last = f;
+				}
+				rs->Held = last->Next;
+				last->Next = nullptr;
+				if (rs->Held == nullptr)
+					rs->HeldTail = nullptr;
+				HeldBytesTotal -= bytes;
+				rs->HeldBytes -= bytes;
+				if (rs->Credits <= 0 && (rs->Held != nullptr || !rs->FinishAfterFlush))
+					rs->Request->SetState(StreamState::Paused);
+			}
+			else
+			{
+				HeldBytesTotal -= rs->HeldBytes;
+				rs->Held = nullptr;
+				rs->HeldTail = nullptr;
+				rs->HeldBytes = 0;
+			}
+			shard.Lock.unlock();
+
+			while (list != nullptr)
+			{
+				QueuedFrame* frame = list;
+				list = list->Next;
+				SendResult res;
+				if (AsyncSend)
+				{
+					// The frame is already a copy, so it can go straight onto the writer's queue
+					res = PushQueuedFrame(con, frame);
+				}
+				else
+				{
+					SendBuf frameParts[2] = {{frame->Data(), frame->Size}, {frame->Body.Data, frame->Body.Size}};
+					res = SendFrame(con, frameParts, 2);
+					FreeQueuedFrame(frame);
+				}
+				if (res == SendResult_Closed)
+				{
+					FreeFrameList(list);
+					shard.Lock.lock();
+					if (RequestState* rs = shard.Find(key))
+						rs->IsFlushing = false;
+					shard.Lock.unlock();
+					return SendResult_Closed;
+				}
+			}
+		}
+	}
+
+	// Called by Recv() when a stream is resumed
+	void Backend::ResumeHeldFrames(const StreamKey& key)
+	{
+		auto& shard = CurrentRequests.ShardFor(key);
+		shard.Lock.lock();
+		RequestState* rs = shard.Find(key);
+		bool flush = rs != nullptr && rs->Held != nullptr && !rs->IsFlushing;
+		if (flush)
+			rs->IsFlushing = true;
+		shard.Lock.unlock();
+		if (flush)
+			FlushHeldFrames(key);
+	}
+
+	void Backend::FreeFrameList(QueuedFrame* list)
+	{
+		while (list != nullptr)
 		{
-			RequestFinished(MakeStreamKey(rs->Request));
-			rs = nullptr;
+			QueuedFrame* next = list->Next;
+			FreeQueuedFrame(list);
+			list = next;
 		}
+	}
 
-		size_t offset = 0;
-		size_t len = 0;
+	SendResult Backend::Send(Response& response)
+	{
+		bool isResponseHeader = response.Status != StatusMeta_BodyPart;
+
+		if (!isResponseHeader)
+			HTTPBRIDGE_ASSERT(response.HeaderCount() == 0);
+
+		StreamKey key = MakeStreamKey(response.Channel, response.Stream);
+		ConnPin pin(this);
+		Connection* conp = pin.Open ? ConnectionFor(key) : nullptr;
+		if (conp == nullptr)
+			return SendResult_Closed;
+		Connection& con = *conp;
+
+		bool isLast, hold;
+		SendResult res = ConsumeResponseBody(key, isResponseHeader ? &response : nullptr, response.BodyBytes(), response.IsFinalChunkedFrame, isLast, hold);
+		if (res != SendResult_All)
+			return res;
+
+		SendBuf parts[2];
 		void* buf = nullptr;
-		response.FinishFlatbuffer(buf, len, isLast);
-		TransportLock.lock();
-		while (offset != len)
+		// A held frame may be sent after frames that are built later, so it must not define any header ids
+		response.FinishFlatbuffer(buf, parts[0].Size, parts[1].Data, parts[1].Size, isLast, hold ? nullptr : HeaderCacheSend, con.HeadersDefined);
+		parts[0].Data = buf;
+
+		// A queue can take over an owned body, instead of copying it
+		bool handOver = response.Owned.Deleter != nullptr && parts[1].Size != 0 && parts[1].Data == response.Owned.Data;
+		if (hold)
+			return handOver ? HoldFrame(key, parts, 1, &response.Owned, response.BodyBytes(), isLast) : HoldFrame(key, parts, 2, nullptr, response.BodyBytes(), isLast);
+
+		if (AsyncSend && handOver)
+			res = QueueFrame(con, response.Channel, response.Stream, parts, 1, &response.Owned);
+		else
+			res = AsyncSend ? QueueFrame(con, response.Channel, response.Stream, parts, 2) : SendFrame(con, parts, 2);
+
+		// The frame now has its place on the connection, so any frame that is sent after this one may refer to the headers that it defined
+		if (res != SendResult_Closed)
+		{
+			for (int32_t i = 0; i < response.DefinedHeaderIDs.Size(); i++)
+			{
+				uint32_t bit = response.DefinedHeaderIDs[i] - 1;
+				con.HeadersDefined[bit >> 6].fetch_or((uint64_t) 1 << (bit & 63), std::memory_order_release);
+			}
+		}
+		return res;
+	}
+
+	// Send all of 'parts', resuming after partial sends. 'parts' is modified along the way.
+	static SendResult SendAll(ITransport* transport, SendBuf* parts, size_t nparts)
+	{
+		while (nparts != 0)
 		{
 			size_t sent = 0;
-			auto res = Transport->Send((uint8_t*) buf + offset, len - offset, sent);
-			offset += sent;
+			auto res = transport->SendV(parts, nparts, sent);
 			if (res == SendResult_Closed)
-			{
-				TransportLock.unlock();
 				return res;
+			// Skip over whatever was sent
+			for (; nparts != 0 && sent >= parts->Size; parts++, nparts--)
+				sent -= parts->Size;
+			if (nparts != 0)
+			{
+				parts->Data = (const uint8_t*) parts->Data + sent;
+				parts->Size -= sent;
 			}
 		}
-		TransportLock.unlock();
 		return SendResult_All;
 	}
 
+	// Send the concatenation of 'parts', which is one whole frame
+	SendResult Backend::SendFrame(Connection& con, const SendBuf* parts, size_t nparts)
+	{
+		HTTPBRIDGE_ASSERT(nparts <= 2);
+		SendBuf remain[2];
+		std::copy(parts, parts + nparts, remain);
+
+		// A transport that can send concurrently does its own ordering, so that senders don't queue up on SendLock
+		std::unique_lock<std::mutex> lock(con.SendLock, std::defer_lock);
+		if (!con.Transport->CanSendConcurrently())
+			lock.lock();
+		return SendAll(con.Transport, remain, nparts);
+	}
+
+	// Copy the frame onto the connection's queue, for WriterThread to send.
+	// If 'body' is not null, then it follows 'parts' on the wire, and the queue takes it over instead of copying it.
+	SendResult Backend::QueueFrame(Connection& con, uint64_t channel, uint64_t stream, const SendBuf* parts, size_t nparts, OwnedBody* body)
+	{
+		if (con.SendFailed || con.WriterStop)
+			return SendResult_Closed;
+		return PushQueuedFrame(con, NewQueuedFrame(channel, stream, parts, nparts, body));
+	}
+
+	// Copy 'parts' into a new QueuedFrame, and take over 'body', if it is not null
+	Backend::QueuedFrame* Backend::NewQueuedFrame(uint64_t channel, uint64_t stream, const SendBuf* parts, size_t nparts, OwnedBody* body)
+	{
+		size_t size = 0;
+		for (size_t i = 0; i < nparts; i++)
+			size += parts[i].Size;
+		QueuedFrame* frame = (QueuedFrame*) Alloc(sizeof(QueuedFrame) + size, AnyLog(), true);
+		frame->Channel = channel;
+		frame->Stream = stream;
+		frame->Size = size;
+		frame->Body = {};
+		if (body != nullptr)
+		{
+			frame->Body = *body;
+			*body = {};
+		}
+		uint8_t* out = frame->Data();
+		for (size_t i = 0; i < nparts; i++)
+		{
+			memcpy(out, parts[i].Data, parts[i].Size);
+			out += parts[i].Size;
+		}
+		return frame;
+	}
+
+	// Hand the frame over to the connection's writer. If the writer has failed or been stopped, then the frame is freed,
+	// and we return SendResult_Closed.
+	SendResult Backend::PushQueuedFrame(Connection& con, QueuedFrame* frame)
+	{
+		if (con.QueuedBytes >= MaxQueuedBytes)
+			WaitForQueueRoom(con);
+
+		if (con.SendFailed || con.WriterStop)
+		{
+			FreeQueuedFrame(frame);
+			return SendResult_Closed;
+		}
+
+		size_t total = frame->Size + frame->Body.Size;
+
+		// Count the bytes before the frame becomes visible, so that the writer can never subtract more than has been added
+		size_t queued = con.QueuedBytes += total;
+		QueuedFrame* head = con.SendQueue.load(std::memory_order_relaxed);
+		do
+			frame->Next = head;
+		while (!con.SendQueue.compare_exchange_weak(head, frame));
+
+		// While the writer is busy, it will find this frame on its next pass, so we only need to wake it up when it's going to sleep,
+		// or when it is holding back a write, and we have just crossed CoalesceBytes.
+		bool crossed = queued >= CoalesceBytes && queued - total < CoalesceBytes;
+		if ((head == nullptr || crossed) && con.WriterSleeping)
+		{
+			std::lock_guard<std::mutex> lock(con.WriterLock);
+			con.WriterCV.notify_one();
+		}
+		return SendResult_All;
+	}
+
+	// Wait until the writer has taken the queue below MaxQueuedBytes, or has failed, or until Close() turns senders away
+	void Backend::WaitForQueueRoom(Connection& con)
+	{
+		std::unique_lock<std::mutex> lock(con.WriterLock);
+		// Announce ourselves before looking at QueuedBytes again, so that the writer can't take the queue without waking us
+		con.RoomWaiters++;
+		while (con.QueuedBytes >= MaxQueuedBytes && !con.SendFailed && !con.WriterStop && SendOpen)
+			con.RoomCV.wait(lock);
+		con.RoomWaiters--;
+	}
+
+	void Backend::NotifyQueueRoom(Connection& con)
+	{
+		if (con.RoomWaiters == 0)
+			return;
+		std::lock_guard<std::mutex> lock(con.WriterLock);
+		con.RoomCV.notify_all();
+	}
+
+	// Send the frames that QueueFrame() puts onto con->SendQueue, until Close() stops us
+	void Backend::WriterThread(Connection* con)
+	{
+		const size_t maxBatch = 64;
+		SendBuf bufs[maxBatch];
+		auto lastWrite = std::chrono::steady_clock::now() - std::chrono::microseconds(CoalesceMicroseconds);
+		while (true)
+		{
+			// If we wrote recently, then more frames are probably on their way, so give them a chance to join this write
+			if (CoalesceMicroseconds != 0 && con->QueuedBytes < CoalesceBytes && con->SendQueue.load() != nullptr)
+			{
+				auto deadline = lastWrite + std::chrono::microseconds(CoalesceMicroseconds);
+				if (std::chrono::steady_clock::now() < deadline)
+				{
+					std::unique_lock<std::mutex> lock(con->WriterLock);
+					con->WriterSleeping = true;
+					while (!con->WriterStop && con->QueuedBytes < CoalesceBytes)
+					{
+						if (con->WriterCV.wait_until(lock, deadline) == std::cv_status::timeout)
+							break;
+					}
+					con->WriterSleeping = false;
+				}
+			}
+
+			QueuedFrame* list = con->SendQueue.exchange(nullptr);
+			if (list == nullptr)
+			{
+				// Announce that we're going to sleep before checking the queue again, so that QueueFrame() can't miss us
+				std::unique_lock<std::mutex> lock(con->WriterLock);
+				con->WriterSleeping = true;
+				while (!con->WriterStop && con->SendQueue.load() == nullptr)
+					con->WriterCV.wait(lock);
+				con->WriterSleeping = false;
+				// Drain the queue before stopping
+				if (con->WriterStop && con->SendQueue.load() == nullptr)
+					return;
+				continue;
+			}
+
+			// The queue is newest first, so reverse it
+			QueuedFrame* fifo = nullptr;
+			size_t taken = 0;
+			while (list != nullptr)
+			{
+				QueuedFrame* next = list->Next;
+				taken += list->Size + list->Body.Size;
+				list->Next = fifo;
+				fifo = list;
+				list = next;
+			}
+			con->QueuedBytes -= taken;
+			NotifyQueueRoom(*con);
+
+			while (fifo != nullptr)
+			{
+				if (con->SendFailed)
+				{
+					FailQueuedFrames(fifo);
+					break;
+				}
+				// Coalesce as many frames as we can into a single write
+				size_t n = 0;
+				QueuedFrame* end = fifo;
+				for (; end != nullptr && n + 2 <= maxBatch; end = end->Next)
+				{
+					bufs[n++] = {end->Data(), end->Size};
+					if (end->Body.Size != 0)
+						bufs[n++] = {end->Body.Data, end->Body.Size};
+				}
+				std::unique_lock<std::mutex> lock(con->SendLock, std::defer_lock);
+				if (!con->Transport->CanSendConcurrently())
+					lock.lock();
+				SendResult res = SendAll(con->Transport, bufs, n);
+				lock.unlock();
+				lastWrite = std::chrono::steady_clock::now();
+				if (res != SendResult_All)
+				{
+					AnyLog()->Logf("Async send failed. Dropping all queued frames.");
+					con->SendFailed = true;
+					NotifyQueueRoom(*con);
+					FailQueuedFrames(fifo);
+					break;
+				}
+				while (fifo != end)
+				{
+					QueuedFrame* next = fifo->Next;
+					FreeQueuedFrame(fifo);
+					fifo = next;
+				}
+			}
+		}
+	}
+
+	void Backend::FailQueuedFrames(QueuedFrame* list)
+	{
+		while (list != nullptr)
+		{
+			QueuedFrame* next = list->Next;
+			if (AsyncSendError != nullptr)
+				AsyncSendError(this, list->Channel, list->Stream);
+			FreeQueuedFrame(list);
+			list = next;
+		}
+	}
+
+	void Backend::FreeQueuedFrame(QueuedFrame* frame)
+	{
+		frame->Body.Release();
+		Free(frame);
+	}
+
 	SendResult Backend::Send(ConstRequestPtr request, StatusCode status)
 	{
 		Response response(request, status);
@@ -1082,11 +3318,110 @@ namespace hb
 
 	SendResult Backend::SendBodyPart(ConstRequestPtr request, const void* body, size_t len, bool isFinal)
 	{
-		Response response(request, Status200_OK);
-		response.SetBody(body, len);
-		response.Status = StatusMeta_BodyPart;
-		response.IsFinalChunkedFrame = isFinal;
-		return Send(response);
+		// The frame is sent (or copied onto the AsyncSend queue) before we return, so there's no need to copy the body
+		StreamKey key = MakeStreamKey(request);
+		ConnPin pin(this);
+		Connection* con = pin.Open ? ConnectionFor(key) : nullptr;
+		if (con == nullptr)
+			return SendResult_Closed;
+
+		bool isLast, hold;
+		SendResult res = ConsumeResponseBody(key, nullptr, len, isFinal, isLast, hold);
+		if (res != SendResult_All)
+			return res;
+
+		uint8_t head[BodyPartFrameHeaderSize];
+		EncodeBodyPartFrame(head, request->Version, request->Channel, request->Stream, len, isLast);
+		SendBuf parts[2] = {{head, BodyPartFrameHeaderSize}, {body, len}};
+		if (hold)
+			return HoldFrame(key, parts, 2, nullptr, len, isLast);
+		return AsyncSend ? QueueFrame(*con, request->Channel, request->Stream, parts, 2) : SendFrame(*con, parts, 2);
+	}
+
+	SendResult Backend::SendFile(Response& header, int fd, uint64_t offset, uint64_t length)
+	{
+		HTTPBRIDGE_ASSERT(header.Request != nullptr && header.Status != StatusMeta_BodyPart);
+		HTTPBRIDGE_ASSERT(header.BodyBytes() == 0 && !header.HasHeader("Content-Length"));
+
+		ConstRequestPtr request = header.Request;
+		header.AddHeader_ContentLength(length);
+		SendResult res = Send(header);
+
+#ifdef HTTPBRIDGE_PLATFORM_WINDOWS
+		// No mmap here, so we read the file in chunks
+		uint8_t* chunk = length != 0 ? (uint8_t*) Alloc(SendFileChunkSize, AnyLog(), true) : nullptr;
+		if (_lseeki64(fd, (int64_t) offset, SEEK_SET) == -1)
+			res = SendResult_Closed;
+		for (uint64_t pos = 0; pos != length && res == SendResult_All; )
+		{
+			if (!WaitWhilePaused(*request))
+			{
+				res = SendResult_Closed;
+				break;
+			}
+			size_t n = (size_t) std::min((uint64_t) SendFileChunkSize, length - pos);
+			if (_read(fd, chunk, (unsigned) n) != (int) n)
+			{
+				AnyLog()->Logf("SendFile: read failed");
+				res = SendResult_Closed;
+				break;
+			}
+			pos += n;
+			res = SendBodyPart(request, chunk, n, pos == length);
+		}
+		Free(chunk);
+#else
+		// Map a window of the file at a time, so that a huge file doesn't need a huge piece of address space.
+		// The body parts point straight into the mapping, so the file's bytes are only copied by the kernel.
+		uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+		for (uint64_t pos = 0; pos != length && res == SendResult_All; )
+		{
+			uint64_t mapStart = (offset + pos) & ~(page - 1);
+			size_t mapLen = (size_t) std::min((uint64_t) SendFileMapSize, offset + length - mapStart);
+			void* map = mmap(nullptr, mapLen, PROT_READ, MAP_SHARED, fd, (off_t) mapStart);
+			if (map == MAP_FAILED)
+			{
+				AnyLog()->Logf("SendFile: mmap failed: %d", (int) errno);
+				res = SendResult_Closed;
+				break;
+			}
+#ifdef MADV_SEQUENTIAL
+			madvise(map, mapLen, MADV_SEQUENTIAL);
+#endif
+			uint64_t mapEnd = mapStart + mapLen;
+			while (offset + pos != mapEnd && res == SendResult_All)
+			{
+				if (!WaitWhilePaused(*request))
+				{
+					res = SendResult_Closed;
+					break;
+				}
+				size_t n = (size_t) std::min((uint64_t) SendFileChunkSize, mapEnd - (offset + pos));
+				const uint8_t* part = (const uint8_t*) map + (offset + pos - mapStart);
+				pos += n;
+				res = SendBodyPart(request, part, n, pos == length);
+			}
+			munmap(map, mapLen);
+		}
+#endif
+		return res;
+	}
+
+	// Returns false if the stream has been aborted
+	bool Backend::WaitWhilePaused(const Request& request)
+	{
+		std::unique_lock<std::mutex> lock(StreamStateLock);
+		while (request.State() == StreamState::Paused)
+			StreamStateChanged.wait(lock);
+		return request.State() != StreamState::Aborted;
+	}
+
+	void Backend::NotifyStreamStateChanged()
+	{
+		// Taking the lock guarantees that a waiter is either asleep, or has not yet looked at the state
+		StreamStateLock.lock();
+		StreamStateLock.unlock();
+		StreamStateChanged.notify_all();
 	}
 
 	bool Backend::Recv(InFrame& frame)
@@ -1102,15 +3437,78 @@ namespace hb
 		if (std::this_thread::get_id() != ThreadId)
 			LogAndPanic("Recv() called from a different thread than the one that called Connect()");
 
-		InternalRecvResponse res = RecvInternal(frame);
+		if (WakeupPending)
+			ConsumeWakeup();
+
+		// Keep going until we have a frame for the user, or every transport runs dry. Returning false while there is
+		// still data buffered up would leave a NonBlocking user waiting on a PollFd() that never becomes readable.
+		for (Connection* con : Conns)
+			con->Idle = false;
+		bool waited = false;
+		while (true)
+		{
+			bool anyBusy = false;
+			// Visit the connections round-robin, so that a busy connection can't starve the others
+			for (size_t i = 0; i < Conns.size(); i++)
+			{
+				Connection& con = *Conns[RecvNext++ % Conns.size()];
+				if (con.Idle && !HaveCompleteFrame(con))
+					continue;
+				anyBusy = true;
+				if (RecvOne(con, frame))
+					return true;
+				if (!IsConnected())
+					return false;
+				frame.Reset();
+			}
+			if (anyBusy)
+				continue;
+			if (NonBlocking || EpollFd == -1 || waited)
+				return false;
+			// Wait for data ourselves, instead of inside the transport, so that Wakeup() can interrupt us
+			if (!Wait(RecvTimeoutMilliseconds))
+				return false;
+			waited = true;
+			for (Connection* con : Conns)
+				con->Idle = false;
+		}
+	}
+
+	size_t Backend::RecvMany(InFrame* frames, size_t maxFrames)
+	{
+		if (maxFrames == 0 || !Recv(frames[0]))
+			return 0;
+
+		// Now decode every frame that is already sitting in the receive buffers, without reading any more
+		size_t n = 1;
+		bool found = true;
+		while (n < maxFrames && found)
+		{
+			found = false;
+			for (size_t i = 0; i < Conns.size() && n < maxFrames; i++)
+			{
+				if (!HaveCompleteFrame(*Conns[i]))
+					continue;
+				found = true;
+				frames[n].Reset();
+				if (RecvOne(*Conns[i], frames[n]))
+					n++;
+			}
+		}
+		for (size_t i = n; i < maxFrames; i++)
+			frames[i].Reset();
+		return n;
+	}
+
+	bool Backend::RecvOne(Connection& con, InFrame& frame)
+	{
+		InternalRecvResponse res = RecvInternal(con, frame);
 		if (res.Result == InternalRecvResult::BadFrame)
 		{
 			// Something went wrong inside httpbridge, such as out of memory, or URI too long.
 			// Send a response to the server immediately, and do not inform the httpbridge user.
 			StreamKey streamKey = MakeStreamKey(frame.Request);
-			CurrentRequestLock.lock();
-			CurrentRequests[streamKey] = {frame.Request, ResponseBodyUninitialized, false};
-			CurrentRequestLock.unlock();
+			AddRequest(streamKey, frame.Request);
 			SendResponse(streamKey.Channel, streamKey.Stream, res.Status);
 			return false;
 		}
@@ -1122,17 +3520,21 @@ namespace hb
 
 		if (frame.IsHeader)
 		{
-			CurrentRequestLock.lock();
-			CurrentRequests[streamKey] = {frame.Request, ResponseBodyUninitialized, false};
-			CurrentRequestLock.unlock();
+			AddRequest(streamKey, frame.Request);
 
 			if (frame.IsLast && frame.Request->ContentLength != -1 && frame.Request->ContentLength != 0)
 			{
+				// The request gets a copy of its own, because it usually outlives the receive chunk
+				if (!frame.Request->BodyBuffer.TryWrite(frame.BodyBytes, frame.BodyBytesLen))
+				{
+					AnyLog()->Log("Alloc for request buffer failed");
+					SendResponse(frame.Request, Status503_Service_Unavailable);
+					frame.Reset();
+					return false;
+				}
 				frame.Request->IsBuffered = true;
-				frame.Request->BodyBuffer.Data = frame.BodyBytes;
-				frame.Request->BodyBuffer.Capacity = frame.BodyBytesLen;
-				frame.Request->BodyBuffer.Count = frame.BodyBytesLen;
-				BufferedRequestsTotalBytes += frame.BodyBytesLen;
+				BufferedRequestsTotalBytes += frame.Request->BodyBuffer.Capacity;
+				frame.ReleaseBody();
 				return true;
 			}
 
@@ -1182,9 +3584,7 @@ namespace hb
 		memcpy(request->BodyBuffer.Data, frame.BodyBytes, frame.BodyBytesLen);
 		request->BodyBuffer.Count = frame.BodyBytesLen;
 		request->BodyBuffer.Capacity = initialSize;
-		Free(frame.BodyBytes);
-		frame.BodyBytes = nullptr;
-		frame.BodyBytesLen = 0;
+		frame.ReleaseBody();
 
 		BufferedRequestsTotalBytes += (size_t) request->BodyBuffer.Capacity;
 
@@ -1192,19 +3592,38 @@ namespace hb
 		return true;
 	}
 
+	void Backend::AddRequest(const StreamKey& key, RequestPtr request)
+	{
+		auto& shard = CurrentRequests.ShardFor(key);
+		std::lock_guard<std::mutex> lock(shard.Lock);
+		RequestState& rs = shard.Items[key];
+		HeldBytesTotal -= rs.HeldBytes;
+		FreeFrameList(rs.Held);
+		rs = RequestState();
+		rs.Request = request;
+		rs.ResponseBodyRemaining = ResponseBodyUninitialized;
+		rs.IsResponseHeaderSent = false;
+		rs.HasCredits = UseStreamWindow && request->_ResponseWindow != 0;
+		rs.Credits = request->_ResponseWindow;
+	}
+
 	void Backend::RequestFinished(const StreamKey& key)
 	{
-		CurrentRequestLock.lock();
-		auto cr = CurrentRequests.find(key);
-		HTTPBRIDGE_ASSERT(cr != CurrentRequests.end());
+		auto& shard = CurrentRequests.ShardFor(key);
+		shard.Lock.lock();
+		auto cr = shard.Items.find(key);
+		HTTPBRIDGE_ASSERT(cr != shard.Items.end());
 		
 		// Initially, I would call UnregisterBufferedBytes here, but that introduces a race condition
 		// inside ResendWhenBodyIsDone, if the frame is aborted during the execution of ResendWhenBodyIsDone.
 		// So instead, Request's destructor now calls UnregisterBufferedBytes.
 
 		cr->second.Request = nullptr; // ensure that smart_ptr reference is decremented now
-		CurrentRequests.erase(key);
-		CurrentRequestLock.unlock();
+		QueuedFrame* held = cr->second.Held;
+		HeldBytesTotal -= cr->second.HeldBytes;
+		shard.Items.erase(cr);
+		shard.Lock.unlock();
+		FreeFrameList(held);
 	}
 
 	void Backend::UnregisterBufferedBytes(size_t bytes)
@@ -1233,84 +3652,121 @@ namespace hb
 		}
 	}
 
-	// TODO: Experiment with reading exactly one frame, and the next frame's first 8 bytes, at a time.
-	// First read 8 bytes for the magic marker and frame length, and thereafter read only
-	// exactly as much as is necessary for that single frame, and the following frame's length.
-	// Then we don't need to do a memmove, and things become simpler.
-	// See if that really produces faster results for average workloads.
-	Backend::InternalRecvResponse Backend::RecvInternal(InFrame& inframe)
+	// Make sure that con.Recv has room for the rest of the frame at its Head, or for MinRecv bytes if we don't know the frame's size yet.
+	// Returns false if the frame is invalid, or we're out of memory.
+	bool Backend::MakeRecvRoom(Connection& con)
 	{
-		if (Transport == nullptr)
-			return {InternalRecvResult::Closed, Status000_NULL};
-
-		const size_t maxRecv = 65536;
-		const size_t maxBufSize = 1024*1024;
-		const size_t maxFrameSize = 100*1024*1024;
-		RecvBuf.Preallocate(maxRecv);
+		RecvChunk* c = con.Recv;
+		size_t avail = c != nullptr ? c->Available() : 0;
+		size_t need = RecvChunk::MinRecv;
+		if (avail >= 8)
+		{
+			uint32_t magic = Read32LE(c->Data() + c->Head);
+			uint32_t frameSize = Read32LE(c->Data() + c->Head + 4);
+			if (magic != MagicFrameMarker || frameSize > MaxRecvFrameSize)
+			{
+				AnyLog()->Logf("Received invalid frame. First 2 dwords: %x %x\n", magic, frameSize);
+				return false;
+			}
+			need = max(need, 8 + (size_t) frameSize);
+		}
 
-		if (RecvBuf.Count >= maxBufSize)
+		if (c != nullptr && avail == 0 && c->Capacity == RecvChunk::DefaultSize && c->Refs == 1)
 		{
-			AnyLog()->Logf("Server is trying to send us a frame larger than %d bytes. Closing connection.", (int) maxBufSize);
-			Close();
-			return {InternalRecvResult::Closed, Status000_NULL};
+			// Everything has been decoded, and nobody is looking at the chunk, so we can start again at the beginning
+			c->Head = 0;
+			c->Tail = 0;
+			return true;
 		}
+		if (c != nullptr && avail != 0 && c->Capacity - c->Head >= need)
+			return true;
+
+		// Start a new chunk. If the previous one was enlarged for a big frame, then this is where we shrink back.
+		// If InFrames still refer to the previous chunk, then it lives on until they let go of it.
+		RecvChunk* next = RecvChunk::Create(max(need, RecvChunk::DefaultSize), AnyLog());
+		if (next == nullptr)
+			return false;
+		if (avail != 0)
+			memcpy(next->Data(), c->Data() + c->Head, avail);
+		next->Tail = avail;
+		if (c != nullptr)
+			c->Release();
+		con.Recv = next;
+		return true;
+	}
 
-		// If we don't have at least one frame ready, then read more
-		if (RecvBuf.Count < 8 || RecvBuf.Count < 8 + Read32LE(RecvBuf.Data + 4))
+	Backend::InternalRecvResponse Backend::RecvInternal(Connection& con, InFrame& inframe)
+	{
+		// If we don't have at least one frame ready, then read more. We only read once every frame that has
+		// already arrived has been decoded.
+		if (!HaveCompleteFrame(con))
 		{
+			if (!MakeRecvRoom(con))
+			{
+				Close();
+				return {InternalRecvResult::Closed, Status000_NULL};
+			}
+			RecvChunk* c = con.Recv;
 			size_t read = 0;
-			auto result = Transport->Recv(maxRecv, RecvBuf.Data + RecvBuf.Count, read);
+			auto result = con.Transport->Recv(c->Capacity - c->Tail, c->Data() + c->Tail, read);
+			con.Idle = result == RecvResult_NoData;
 			if (result == RecvResult_Closed)
 			{
 				AnyLog()->Logf("Server closed connection");
 				Close();
 				return {(InternalRecvResult) result, Status000_NULL};
 			}
-			RecvBuf.Count += read;
+			c->Tail += read;
 		}
 
 		// Process frame
-		if (RecvBuf.Count >= 8)
+		RecvChunk* c = con.Recv;
+		if (c->Available() >= 8)
 		{
-			uint32_t magic = Read32LE(RecvBuf.Data);
-			uint32_t frameSize = Read32LE(RecvBuf.Data + 4);
-			if (magic != MagicFrameMarker || frameSize > maxFrameSize)
+			uint8_t* start = c->Data() + c->Head;
+			uint32_t magic = Read32LE(start);
+			uint32_t frameSize = Read32LE(start + 4);
+			if (magic != MagicFrameMarker || frameSize > MaxRecvFrameSize)
 			{
 				AnyLog()->Logf("Received invalid frame. First 2 dwords: %x %x\n", magic, frameSize);
 				Close();
 				return {InternalRecvResult::Closed, Status000_NULL};
 			}
-			if (RecvBuf.Count >= frameSize + 8)
+			if (c->Available() >= frameSize + 8)
 			{
 				// We have a frame to process.
-				const httpbridge::TxFrame* txframe = httpbridge::GetTxFrame((uint8_t*) RecvBuf.Data + 8);
+				const httpbridge::TxFrame* txframe = httpbridge::GetTxFrame(start + 8);
 				FrameStatus headStatus = FrameStatus::OK;
 				FrameStatus bodyStatus = FrameStatus::OK;
 				if (txframe->frametype() == httpbridge::TxFrameType_Header)
 				{
-					headStatus = UnpackHeader(txframe, inframe);
+					headStatus = UnpackHeader(con, txframe, inframe);
 					inframe.IsHeader = true;
 					inframe.IsLast = !!(txframe->flags() & httpbridge::TxFrameFlags_Final);
-					bodyStatus = UnpackBody(txframe, inframe);
-					if (headStatus == FrameStatus::OK && !inframe.Request->ParseURI())
+					bodyStatus = UnpackBody(con, txframe, inframe);
+					if (headStatus == FrameStatus::OK && !inframe.Request->IsURIValid())
 						headStatus = FrameStatus::URITooLong;
 				}
 				else if (txframe->frametype() == httpbridge::TxFrameType_Body)
 				{
-					bodyStatus = UnpackBody(txframe, inframe);
+					bodyStatus = UnpackBody(con, txframe, inframe);
 					inframe.IsLast = !!(txframe->flags() & httpbridge::TxFrameFlags_Final);
 				}
 				else if (IsControlFrame(txframe->frametype()))
 				{
 					bodyStatus = UnpackControlFrame(txframe, inframe);
 				}
+				else if (txframe->frametype() == httpbridge::TxFrameType_WindowUpdate)
+				{
+					bodyStatus = UnpackWindowUpdate(txframe, inframe);
+				}
 				else
 				{
 					AnyLog()->Logf("Unrecognized frame type %d. Closing connection.", (int) txframe->frametype());
 					Close();
 					return {InternalRecvResult::Closed, Status000_NULL};
 				}
-				RecvBuf.EraseFromStart(8 + frameSize);
+				c->Head += 8 + frameSize;
 				if (headStatus != FrameStatus::OK || bodyStatus != FrameStatus::OK)
 				{
 					if (headStatus == FrameStatus::URITooLong)
@@ -1334,6 +3790,11 @@ namespace hb
 						inframe.Reset();
 						return {InternalRecvResult::NoData, Status000_NULL};
 					}
+					else if (bodyStatus == FrameStatus::Consumed)
+					{
+						inframe.Reset();
+						return {InternalRecvResult::NoData, Status000_NULL};
+					}
 					else
 					{
 						HTTPBRIDGE_PANIC("Unexpected invalid frame state");
@@ -1346,71 +3807,89 @@ namespace hb
 		return {InternalRecvResult::NoData, Status000_NULL};
 	}
 
-	Backend::FrameStatus Backend::UnpackHeader(const httpbridge::TxFrame* txframe, InFrame& inframe)
+	Backend::FrameStatus Backend::UnpackHeader(Connection& con, const httpbridge::TxFrame* txframe, InFrame& inframe)
 	{
 		auto headers = txframe->headers();
-		size_t headerBlockSize = TotalHeaderBlockSize(txframe);
-		uint8_t* hblock = (uint8_t*) Alloc(headerBlockSize, Log, false);
-		if (hblock == nullptr)
+		size_t uriLen = 0;
+		size_t headerBlockSize = TotalHeaderBlockSize(con, txframe, uriLen);
+		// The decoded URI (see DecodeURI) is no bigger than this for any sensible URI. If it doesn't fit, DecodeURI allocates it separately.
+		size_t uriSpace = RoundUp8(3 * uriLen + 8);
+		size_t slabSize = RequestSlabHeaderSize + RoundUp8(headerBlockSize) + uriSpace;
+		uint8_t* slab = (uint8_t*) RequestSlabPool::Alloc(slabSize, Log);
+		if (slab == nullptr)
 			return FrameStatus::OutOfMemory;
+		uint8_t* hblock = slab + RequestSlabHeaderSize;
 
-		auto lines = (Request::HeaderLine*) hblock;								// header lines
-		int32_t hpos = (headers->size() + 1) * sizeof(Request::HeaderLine);		// offset into hblock
+		// The block is HeaderLine[], followed by the cache entry (or null) of each line, followed by the headers that weren't cached.
+		// A cached line takes no space, and its KeyStart is where the next line begins, so that the value length of the line before it comes out right.
+		auto lines = (Request::HeaderLine*) hblock;
+		auto entries = (HeaderCacheEntry**) (hblock + (headers->size() + 1) * sizeof(Request::HeaderLine));
+		int32_t hpos = (headers->size() + 1) * (sizeof(Request::HeaderLine) + sizeof(HeaderCacheEntry*));		// offset into hblock
 
+		bool outOfMemory = false;
 		for (uint32_t i = 0; i < headers->size(); i++)
 		{
 			const httpbridge::TxHeaderLine* line = headers->Get(i);
-			int32_t keyLen, valueLen;
-			const void *key, *value;
+			HeaderCacheEntry* entry = nullptr;
 			if (line->id() != 0)
 			{
-				if (line->key()->size() != 0)
-					HeaderCacheRecv->Insert(line->id(), line->key()->size(), line->key()->Data(), line->value()->size(), line->value()->Data());
-				HeaderCacheRecv->Get(line->id(), keyLen, key, valueLen, value);
+				if (line->key()->size() != 0 && !con.HeaderCacheRecv->Insert(line->id(), line->key()->size(), line->key()->Data(), line->value()->size(), line->value()->Data(), Log))
+					outOfMemory = true;
+				entry = con.HeaderCacheRecv->Get(line->id());
 			}
-			else
+			entries[i] = entry;
+			lines[i].KeyStart = hpos;
+			if (entry != nullptr)
 			{
-				keyLen = line->key()->size();
-				key = line->key()->Data();
-				valueLen = line->value()->size();
-				value = line->value()->Data();
+				entry->AddRef();
+				lines[i].KeyLen = entry->KeyLen;
+				continue;
 			}
 
-			memcpy(hblock + hpos, key, keyLen);
+			// A cache miss yields an empty header, as it always has
+			int32_t keyLen = line->id() != 0 ? 0 : line->key()->size();
+			int32_t valueLen = line->id() != 0 ? 0 : line->value()->size();
+			memcpy(hblock + hpos, line->key()->Data(), keyLen);
 			hblock[hpos + keyLen] = 0;
-			lines[i].KeyStart = hpos;
 			lines[i].KeyLen = keyLen;
 			hpos += keyLen + 1;
-			memcpy(hblock + hpos, value, valueLen);
+			memcpy(hblock + hpos, line->value()->Data(), valueLen);
 			hblock[hpos + valueLen] = 0;
 			hpos += valueLen + 1;
 		}
+		entries[headers->size()] = nullptr;
 		// add terminal HeaderLine
 		lines[headers->size()].KeyStart = hpos;
 		lines[headers->size()].KeyLen = 0;
 
-		inframe.Request.reset(new hb::Request());
+		inframe.Request = std::allocate_shared<hb::Request>(RequestSlabAllocator<hb::Request>(slab, slabSize));
+		inframe.Request->_HeaderBlockInSlab = true;
+		inframe.Request->_HeaderEntries = entries;
+		inframe.Request->_URISpace = (char*) hblock + RoundUp8(headerBlockSize);
+		inframe.Request->_URISpaceLen = uriSpace;
 		inframe.Request->Initialize(this, TranslateVersion(txframe->version()), txframe->channel(), txframe->stream(), headers->size(), hblock);
-		return FrameStatus::OK;
+		inframe.Request->_ResponseWindow = txframe->window();
+		return outOfMemory ? FrameStatus::OutOfMemory : FrameStatus::OK;
 	}
 
-	Backend::FrameStatus Backend::UnpackBody(const httpbridge::TxFrame* txframe, InFrame& inframe)
+	Backend::FrameStatus Backend::UnpackBody(Connection& con, const httpbridge::TxFrame* txframe, InFrame& inframe)
 	{
 		if (inframe.Request == nullptr)
 		{
-			CurrentRequestLock.lock();
-			auto cr = CurrentRequests.find(MakeStreamKey(txframe));
-			if (cr == CurrentRequests.end())
+			auto& shard = CurrentRequests.ShardFor(MakeStreamKey(txframe));
+			shard.Lock.lock();
+			RequestState* rs = shard.Find(MakeStreamKey(txframe));
+			if (rs == nullptr)
 			{
 				flatbuffers::uoffset_t bodySize = 0;
 				if (txframe->body())
 					bodySize = txframe->body()->size();
 				AnyLog()->Logf("Received body bytes for unknown stream [%llu:%llu] (%d body bytes)", txframe->channel(), txframe->stream(), (int) bodySize);
-				CurrentRequestLock.unlock();
+				shard.Lock.unlock();
 				return FrameStatus::StreamNotFound;
 			}
-			inframe.Request = cr->second.Request;
-			CurrentRequestLock.unlock();
+			inframe.Request = rs->Request;
+			shard.Lock.unlock();
 		}
 
 		// Empty body frames are a waste, but not an error. Likely to be the final frame.
@@ -1446,12 +3925,26 @@ namespace hb
 		else
 		{
 			// non-buffered
-			inframe.BodyBytesLen = txframe->body()->size();
-			if (inframe.BodyBytesLen != 0)
+			size_t len = txframe->body()->size();
+			if (len == 0)
+				return FrameStatus::OK;
+			if (CopyFrameBodies)
+			{
+				// A private copy, which the application is free to modify
+				inframe.BodyChunk = RecvChunk::Create(len, Log);
+				if (inframe.BodyChunk == nullptr)
+					return FrameStatus::OutOfMemory;
+				memcpy(inframe.BodyChunk->Data(), txframe->body()->Data(), len);
+				inframe.BodyBytes = inframe.BodyChunk->Data();
+			}
+			else
 			{
-				inframe.BodyBytes = (uint8_t*) Alloc(inframe.BodyBytesLen, Log);
-				memcpy(inframe.BodyBytes, txframe->body()->Data(), inframe.BodyBytesLen);
+				// Point straight into the receive chunk, and keep it alive for as long as the frame needs it
+				con.Recv->AddRef();
+				inframe.BodyChunk = con.Recv;
+				inframe.BodyBytes = (uint8_t*) txframe->body()->Data();
 			}
+			inframe.BodyBytesLen = len;
 			return FrameStatus::OK;
 		}
 	}
@@ -1461,16 +3954,17 @@ namespace hb
 		inframe.Type = FBTypeToFrameType(txframe->frametype());
 		if (inframe.Request == nullptr)
 		{
-			CurrentRequestLock.lock();
-			auto cr = CurrentRequests.find(MakeStreamKey(txframe));
-			if (cr == CurrentRequests.end())
+			auto& shard = CurrentRequests.ShardFor(MakeStreamKey(txframe));
+			shard.Lock.lock();
+			RequestState* rs = shard.Find(MakeStreamKey(txframe));
+			if (rs == nullptr)
 			{
 				AnyLog()->Logf("Received control frame '%s' for unknown stream [%llu:%llu]", httpbridge::EnumNameTxFrameType(txframe->frametype()), txframe->channel(), txframe->stream());
-				CurrentRequestLock.unlock();
+				shard.Lock.unlock();
 				return FrameStatus::StreamNotFound;
 			}
-			inframe.Request = cr->second.Request;
-			CurrentRequestLock.unlock();
+			inframe.Request = rs->Request;
+			shard.Lock.unlock();
 			switch (inframe.Type)
 			{
 			case FrameType::Abort:
@@ -1486,31 +3980,70 @@ namespace hb
 			default:
 				HTTPBRIDGE_PANIC("Unexpected control frame type");
 			}
+			NotifyStreamStateChanged();
+			if (inframe.Type == FrameType::Resume && HoldWhilePaused)
+				ResumeHeldFrames(MakeStreamKey(txframe));
+		}
+		return FrameStatus::OK;
+	}
+
+	// Add the credits that the server has granted. If they bring a paused stream back to life, then the frame is
+	// given to the caller as a Resume frame. Otherwise, nobody needs to hear about it.
+	Backend::FrameStatus Backend::UnpackWindowUpdate(const httpbridge::TxFrame* txframe, InFrame& inframe)
+	{
+		StreamKey key = MakeStreamKey(txframe);
+		auto& shard = CurrentRequests.ShardFor(key);
+		shard.Lock.lock();
+		RequestState* rs = shard.Find(key);
+		if (rs == nullptr)
+		{
+			// The response has finished, so this is just the server catching up
+			shard.Lock.unlock();
+			return FrameStatus::Consumed;
+		}
+		rs->Credits += txframe->window();
+		bool resume = rs->HasCredits && rs->Credits > 0 && rs->Request->State() == StreamState::Paused;
+		if (resume)
+		{
+			rs->Request->SetState(StreamState::Active);
+			inframe.Request = rs->Request;
+			inframe.Type = FrameType::Resume;
 		}
+		shard.Lock.unlock();
+		if (!resume)
+			return FrameStatus::Consumed;
+
+		NotifyStreamStateChanged();
+		if (HoldWhilePaused)
+			ResumeHeldFrames(key);
 		return FrameStatus::OK;
 	}
 
-	size_t Backend::TotalHeaderBlockSize(const httpbridge::TxFrame* frame)
+	// uriLen is the length of the first header's value, which is the URI.
+	// This only looks at the lengths of the lines. Lines that come from the header cache take no space in the block.
+	size_t Backend::TotalHeaderBlockSize(Connection& con, const httpbridge::TxFrame* frame, size_t& uriLen)
 	{
 		// the +1 is for the terminal HeaderLine
-		size_t total = sizeof(Request::HeaderLine) * (frame->headers()->size() + 1);
+		size_t total = (sizeof(Request::HeaderLine) + sizeof(HeaderCacheEntry*)) * (frame->headers()->size() + 1);
 
 		for (uint32_t i = 0; i < frame->headers()->size(); i++)
 		{
 			const httpbridge::TxHeaderLine* line = frame->headers()->Get(i);
-			if (line->key()->size() != 0)
+			if (line->id() == 0)
 			{
 				total += line->key()->size() + line->value()->size();
+				if (i == 0)
+					uriLen = line->value()->size();
 			}
-			else
+			else if (i == 0)
 			{
-				int keyLen = 0;
-				int valLen = 0;
-				const void *key = nullptr, *val = nullptr;
-				HeaderCacheRecv->Get(line->id(), keyLen, key, valLen, val);
-				total += keyLen + valLen;
+				HeaderCacheEntry* entry = con.HeaderCacheRecv->Get(line->id());
+				if (line->key()->size() != 0)
+					uriLen = line->value()->size();
+				else if (entry != nullptr)
+					uriLen = entry->ValLen;
 			}
-			// +2 for the null terminators
+			// +2 for the null terminators. Cached lines don't need them, but a cache miss becomes an empty header in the block.
 			total += 2;
 		}
 		return total;
@@ -1538,21 +4071,6 @@ namespace hb
 		Send(response);
 	}
 
-	Backend::RequestState* Backend::GetRequest(uint64_t channel, uint64_t stream)
-	{
-		auto iter = CurrentRequests.find(MakeStreamKey(channel, stream));
-		if (iter == CurrentRequests.end())
-			return nullptr;
-		return &iter->second;
-	}
-
-	Backend::RequestState* Backend::GetRequestOrDie(uint64_t channel, uint64_t stream)
-	{
-		auto iter = CurrentRequests.find(MakeStreamKey(channel, stream));
-		HTTPBRIDGE_ASSERT(iter != CurrentRequests.end());
-		return &iter->second;
-	}
-
 	StreamKey Backend::MakeStreamKey(uint64_t channel, uint64_t stream)
 	{
 		return StreamKey{ channel, stream };
@@ -1736,8 +4254,19 @@ namespace hb
 		if (Backend && IsBuffered)
 			Backend->UnregisterBufferedBytes(BodyBuffer.Capacity);
 
-		hb::Free(_CachedURI);
-		hb::Free((void*) _HeaderBlock);
+		if (_HeaderEntries != nullptr)
+		{
+			for (int32_t i = 0; i < _HeaderCount; i++)
+			{
+				if (_HeaderEntries[i] != nullptr)
+					_HeaderEntries[i]->Release();
+			}
+		}
+
+		if (_CachedURI != _URISpace)
+			hb::Free(_CachedURI);
+		if (!_HeaderBlockInSlab)
+			hb::Free((void*) _HeaderBlock);
 	}
 
 	void Request::Initialize(hb::Backend* backend, HttpVersion version, uint64_t channel, uint64_t stream, int32_t headerCount, const void* headerBlock)
@@ -1748,7 +4277,8 @@ namespace hb
 		Stream = stream;
 		_HeaderCount = headerCount;
 		_HeaderBlock = (const uint8_t*) headerBlock;
-		const char* contentLength = HeaderByName(Header_Content_Length);
+		BuildHeaderIndex();
+		const char* contentLength = HeaderByName(HeaderKey_Content_Length);
 		if (contentLength != nullptr)
 			ContentLength = (uint64_t) atoi64(contentLength);
 	}
@@ -1783,7 +4313,6 @@ namespace hb
 
 		auto r = std::make_shared<Request>();
 		r->Initialize(nullptr, HttpVersion11, 0, 0, (int32_t) lines.size() - 1, hb);
-		r->ParseURI();
 		r->IsBuffered = true;
 		if (body.size() != 0)
 			r->BodyBuffer.Write(body.c_str(), body.size());
@@ -1808,28 +4337,59 @@ namespace hb
 		}
 	}
 
+	void Request::LineKey(int32_t line, const char*& key, int32_t& keyLen) const
+	{
+		if (_HeaderEntries != nullptr && _HeaderEntries[line] != nullptr)
+		{
+			key = _HeaderEntries[line]->Key();
+			keyLen = _HeaderEntries[line]->KeyLen;
+			return;
+		}
+		auto lines = (const HeaderLine*) _HeaderBlock;
+		key = (const char*) (_HeaderBlock + lines[line].KeyStart);
+		keyLen = lines[line].KeyLen;
+	}
+
+	void Request::LineValue(int32_t line, const char*& val, int32_t& valLen) const
+	{
+		if (_HeaderEntries != nullptr && _HeaderEntries[line] != nullptr)
+		{
+			val = _HeaderEntries[line]->Value();
+			valLen = _HeaderEntries[line]->ValLen;
+			return;
+		}
+		auto lines = (const HeaderLine*) _HeaderBlock;
+		uint32_t start = lines[line].KeyStart + lines[line].KeyLen + 1;
+		val = (const char*) (_HeaderBlock + start);
+		valLen = lines[line + 1].KeyStart - 1 - start;
+	}
+
 	ConstString Request::Method() const
 	{
 		// actually the 'key' of header[0]
-		auto lines = (const HeaderLine*) _HeaderBlock;
-		return (const char*) (_HeaderBlock + lines[0].KeyStart);
+		const char* key;
+		int32_t keyLen;
+		LineKey(0, key, keyLen);
+		return key;
 	}
 
 	ConstString Request::URI() const
 	{
-		// actually the 'value' of header[0]
+		// actually the 'value' of header[0]. Don't use LineValue, because the header block of a hand-built Request might not have a terminal line.
+		if (_HeaderEntries != nullptr && _HeaderEntries[0] != nullptr)
+			return _HeaderEntries[0]->Value();
 		auto lines = (const HeaderLine*) _HeaderBlock;
 		return (const char*) (_HeaderBlock + lines[0].KeyStart + lines[0].KeyLen + 1);
 	}
 
 	ConstString Request::Path() const
 	{
-		return _CachedURI + 2;
+		return DecodedURI() + 2;
 	}
 
 	ConstString Request::Query(const char* key) const
 	{
-		const char* p = _CachedURI;
+		const char* p = DecodedURI();
 		uint16_t len = *((uint16_t*) p);
 		p += 2 + RoundUpOdd(len) + 1; // skip path
 		for (len = *((uint16_t*) p); len != EndOfQueryMarker; )
@@ -1869,7 +4429,8 @@ namespace hb
 
 	int32_t Request::NextQuery(int32_t iterator, const char*& key, const char*& value) const
 	{
-		const char* p = _CachedURI + iterator;
+		const char* uri = DecodedURI();
+		const char* p = uri + iterator;
 		uint16_t len = *((uint16_t*) p);
 		if (iterator == 0)
 		{
@@ -1890,31 +4451,110 @@ namespace hb
 		value = p + 2;
 		p += 2 + RoundUpOdd(len) + 1;
 
-		return (int32_t) (p - _CachedURI);
+		return (int32_t) (p - uri);
 	}
 
-	bool Request::HeaderByName(const char* name, size_t& len, const void*& buf, int nth) const
+	void Request::BuildHeaderIndex()
+	{
+		memset(_WellKnownHeaders, 0, sizeof(_WellKnownHeaders));
+		memset(_HeaderIndex, 0, sizeof(_HeaderIndex));
+		int32_t end = std::min(HeaderCount(), (int32_t) MaxIndexedHeaders) + NumPseudoHeaderLines;
+		for (int32_t i = NumPseudoHeaderLines; i < end; i++)
+		{
+			const char* key;
+			int32_t keyLen;
+			LineKey(i, key, keyLen);
+			uint32_t hash = HeaderNameHashLen(key, keyLen);
+			int slot = WellKnownHeaderSlot(hash);
+			if (slot != -1 && _WellKnownHeaders[slot] == 0)
+				_WellKnownHeaders[slot] = (uint16_t) i;
+
+			// Only the first header of each name goes into the index
+			for (uint32_t pos = hash; ; pos++)
+			{
+				uint32_t& entry = _HeaderIndex[pos & (HeaderIndexSize - 1)];
+				if (entry == 0)
+				{
+					entry = (hash & 0xffff0000) | (uint32_t) i;
+					break;
+				}
+				const char* otherKey;
+				int32_t otherKeyLen;
+				LineKey(entry & 0xffff, otherKey, otherKeyLen);
+				if ((entry >> 16) == (hash >> 16) && otherKeyLen == keyLen && EqNoCase(key, otherKey, keyLen))
+					break;
+			}
+		}
+	}
+
+	bool Request::IsHeaderLineNamed(int32_t line, const HeaderKey& name) const
+	{
+		const char* key;
+		int32_t keyLen;
+		LineKey(line, key, keyLen);
+		return (uint32_t) keyLen == name.Len && EqNoCase(key, name.Name, name.Len);
+	}
+
+	// Returns the line of the first header called 'name', or 0 if there is no such header
+	int32_t Request::FindHeaderLine(const HeaderKey& name) const
+	{
+		if (name.Slot != -1)
+		{
+			int32_t line = _WellKnownHeaders[name.Slot];
+			if (line != 0 && IsHeaderLineNamed(line, name))
+				return line;
+		}
+
+		for (uint32_t pos = name.Hash; ; pos++)
+		{
+			uint32_t entry = _HeaderIndex[pos & (HeaderIndexSize - 1)];
+			if (entry == 0)
+				break;
+			if ((entry >> 16) == (name.Hash >> 16) && IsHeaderLineNamed(entry & 0xffff, name))
+				return entry & 0xffff;
+		}
+
+		// Headers beyond MaxIndexedHeaders are not in the index
+		int32_t count = HeaderCount() + NumPseudoHeaderLines;
+		for (int32_t i = MaxIndexedHeaders + NumPseudoHeaderLines; i < count; i++)
+		{
+			if (IsHeaderLineNamed(i, name))
+				return i;
+		}
+		return 0;
+	}
+
+	bool Request::HeaderByName(const HeaderKey& name, size_t& len, const void*& buf, int nth) const
 	{
-		auto nameLen = strlen(name);
+		int32_t first = FindHeaderLine(name);
+		if (first == 0)
+			return false;
+
 		auto count = HeaderCount() + NumPseudoHeaderLines;
-		auto lines = (const HeaderLine*) _HeaderBlock;
-		for (int32_t i = NumPseudoHeaderLines; i < count; i++)
+		for (int32_t i = first; i < count; i++)
 		{
-			const uint8_t* bKey = _HeaderBlock + lines[i].KeyStart;
-			if (EqNoCase((const char*) bKey, name, nameLen))
+			if (IsHeaderLineNamed(i, name))
 				nth--;
 
 			if (nth == -1)
 			{
-				buf = _HeaderBlock + (lines[i].KeyStart + lines[i].KeyLen + 1);
-				len = lines[i + 1].KeyStart - 1 - (lines[i].KeyStart + lines[i].KeyLen + 1);
+				const char* val;
+				int32_t valLen;
+				LineValue(i, val, valLen);
+				buf = val;
+				len = valLen;
 				return true;
 			}
 		}
 		return false;
 	}
 
-	const char* Request::HeaderByName(const char* name, int nth) const
+	bool Request::HeaderByName(const char* name, size_t& len, const void*& buf, int nth) const
+	{
+		return HeaderByName(HeaderKey(name), len, buf, nth);
+	}
+
+	const char* Request::HeaderByName(const HeaderKey& name, int nth) const
 	{
 		size_t len;
 		const void* buf;
@@ -1924,6 +4564,11 @@ namespace hb
 			return nullptr;
 	}
 
+	const char* Request::HeaderByName(const char* name, int nth) const
+	{
+		return HeaderByName(HeaderKey(name), nth);
+	}
+
 	void Request::HeaderAt(int32_t index, int32_t& keyLen, const char*& key, int32_t& valLen, const char*& val) const
 	{
 		if ((uint32_t) index >= (uint32_t) HeaderCount())
@@ -1936,11 +4581,8 @@ namespace hb
 		else
 		{
 			index += NumPseudoHeaderLines;
-			auto lines = (const HeaderLine*) _HeaderBlock;
-			keyLen = lines[index].KeyLen;
-			key = (const char*) (_HeaderBlock + lines[index].KeyStart);
-			valLen = lines[index + 1].KeyStart - (lines[index].KeyStart + lines[index].KeyLen);
-			val = (const char*) (_HeaderBlock + lines[index].KeyStart + lines[index].KeyLen + 1);
+			LineKey(index, key, keyLen);
+			LineValue(index, val, valLen);
 		}
 	}
 
@@ -1950,8 +4592,49 @@ namespace hb
 		HeaderAt(index, keyLen, key, valLen, val);
 	}
 
-	// Return false if the decoded length of either the path or any query item exceeds 65534 characters
 	bool Request::ParseURI()
+	{
+		if (!IsURIValid())
+			return false;
+		DecodedURI();
+		return true;
+	}
+
+	// Return false if the decoded length of either the path or any query item exceeds MaxDecodedURIElement
+	bool Request::IsURIValid() const
+	{
+		const char* uri = URI();
+
+		// Percent-decoding never makes anything longer, so a short URI is always fine
+		if (strlen(uri) <= MaxDecodedURIElement)
+			return true;
+
+		int pathRawLen, pathDecodedLen;
+		UrlPathParser::MeasurePath(uri, pathRawLen, pathDecodedLen);
+		if (pathDecodedLen > MaxDecodedURIElement)
+			return false;
+
+		if (uri[pathRawLen] != 0)
+		{
+			UrlQueryParser p(uri + pathRawLen + 1); // +1 to skip the "?"
+			int key, keyLen, val, valLen;
+			while (p.Next(key, keyLen, val, valLen))
+			{
+				if (keyLen > MaxDecodedURIElement || valLen > MaxDecodedURIElement)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	const char* Request::DecodedURI() const
+	{
+		// Several threads may be handling frames of this request, and any of them can be the first to ask
+		std::call_once(_DecodeURIOnce, [this]() { DecodeURI(); });
+		return _CachedURI;
+	}
+
+	void Request::DecodeURI() const
 	{
 		// Decode the URI into Path and Query key=value pairs. We perform percent-decoding here.
 		// Our final output buffer looks like this:
@@ -1960,17 +4643,16 @@ namespace hb
 		// Why 65534? Because we use 65535 as an end-of-list marker
 		// Also, we make sure to keep the 16-bit length counters aligned.
 		// We store the exact lengths in the 16-bit numbers, so we always need to perform the rounding when scanning through the list.
-		const int MAXLEN = 65534;
-		static_assert(MAXLEN < EndOfQueryMarker, "MAXLEN must be less than EndOfQueryMarker");
+		static_assert(MaxDecodedURIElement < EndOfQueryMarker, "MaxDecodedURIElement must be less than EndOfQueryMarker");
 
-		// Measure the size of the buffer that we'll need
-		const char* uri = URI();
+		// Backend rejects a URI that is too long with a 414, so this can only be a Request that was constructed by hand.
+		// The lengths wouldn't fit into our 16-bit counters, so treat it as empty.
+		const char* uri = IsURIValid() ? URI() : "";
 
+		// Measure the size of the buffer that we'll need
 		// measure path length
 		int pathRawLen, pathDecodedLen;
 		UrlPathParser::MeasurePath(uri, pathRawLen, pathDecodedLen);
-		if (pathDecodedLen > MAXLEN)
-			return false;
 
 		const bool hasQuery = uri[pathRawLen] != 0;
 
@@ -1981,16 +4663,15 @@ namespace hb
 			UrlQueryParser p(uri + pathRawLen + 1); // +1 to skip the "?"
 			int key, keyLen, val, valLen;
 			while (p.Next(key, keyLen, val, valLen))
-			{
-				if (keyLen > MAXLEN || valLen > MAXLEN)
-					return false;
 				queryTotalBytes += 2 + RoundUpOdd(keyLen) + 1 + 2 + RoundUpOdd(valLen) + 1; // +2 for lengths, +1 for null terminators. Round to keep lengths 16-bit aligned.
-			}
 		}
 
 		// Alloc buffer and decode path
 		int bufLen = 2 + RoundUpOdd(pathDecodedLen) + 1 + queryTotalBytes + 2;
-		_CachedURI = (char*) hb::Alloc(bufLen, Backend ? Backend->AnyLog() : nullptr); // 2+ for the length of the path, 1+ for the null terminator
+		if ((size_t) bufLen <= _URISpaceLen)
+			_CachedURI = _URISpace;
+		else
+			_CachedURI = (char*) hb::Alloc(bufLen, Backend ? Backend->AnyLog() : nullptr); // 2+ for the length of the path, 1+ for the null terminator
 		char* out = _CachedURI;
 		*((uint16_t*) out) = pathDecodedLen;
 		out += 2;
@@ -2022,7 +4703,206 @@ namespace hb
 		*((uint16_t*) out) = EndOfQueryMarker;
 		out += 2;
 		HTTPBRIDGE_ASSERT(out == _CachedURI + bufLen);
-		return true;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	void OwnedBody::Release()
+	{
+		if (Deleter != nullptr)
+			Deleter(Context, Data, Size);
+		Deleter = nullptr;
+		Context = nullptr;
+		Data = nullptr;
+		Size = 0;
+	}
+
+	// Each thread keeps the FlatBufferBuilders and header buffers of the Responses that it has finished with, so that
+	// later Responses can reuse them, instead of allocating their own. Builders are kept in size classes, and a Response
+	// asks for one that is large enough for its body and headers, so that the builder doesn't need to grow.
+	// A Response is often freed by a different thread than the one that built it. Its buffers simply join the pool
+	// of the thread that frees them.
+	class ResponsePool
+	{
+	public:
+		static const int		NumClasses = 6;		// 1 KB, 4 KB, 16 KB, 64 KB, 256 KB, 1 MB
+		static const size_t		SmallestClass = 1024;
+		static const int		MaxPerClass = 4;
+		static const int		MaxSpareHeaders = 16;
+		static const int32_t	MaxSpareHeaderBuf = 16 * 1024;	// Larger header buffers are freed
+		static const int		MaxSpareBodies = 16;
+
+		~ResponsePool();
+
+		// 'capacity' is how large the builder can grow without reallocating, as far as we know
+		static flatbuffers::FlatBufferBuilder*	GetBuilder(size_t size, size_t& capacity);
+		static void								ReleaseBuilder(flatbuffers::FlatBufferBuilder* fbb, size_t capacity);
+		static void								GetHeaders(Vector<char>& buf, Vector<uint32_t>& index);
+		static void								ReleaseHeaders(Vector<char>& buf, Vector<uint32_t>& index);
+
+		// Empty containers for the SetBody overloads that take over a std::string or a std::vector. Releasing one
+		// frees the body that it holds, but keeps the container itself for the next SetBody.
+		static std::string*						GetString();
+		static void								ReleaseString(std::string* s);
+		static std::vector<uint8_t>*			GetVector();
+		static void								ReleaseVector(std::vector<uint8_t>* v);
+
+	private:
+		struct Builder
+		{
+			flatbuffers::FlatBufferBuilder*	FBB;
+			size_t							Capacity;
+		};
+
+		Builder				Builders[NumClasses][MaxPerClass];
+		int					NumBuilders[NumClasses] = {};
+		Vector<char>		SpareHeaderBufs[MaxSpareHeaders];
+		Vector<uint32_t>	SpareHeaderIndexes[MaxSpareHeaders];
+		int					NumSpareHeaders = 0;
+		std::string*		SpareStrings[MaxSpareBodies];
+		int					NumSpareStrings = 0;
+		std::vector<uint8_t>*	SpareVectors[MaxSpareBodies];
+		int					NumSpareVectors = 0;
+
+		static ResponsePool*	ThisThread();	// Returns null once the thread's pool has been destroyed, while the thread exits
+		static size_t			ClassSize(int c) { return SmallestClass << (2 * c); }
+	};
+
+	static thread_local bool ResponsePoolDestroyed = false;
+
+	ResponsePool::~ResponsePool()
+	{
+		ResponsePoolDestroyed = true;
+		for (int c = 0; c < NumClasses; c++)
+		{
+			for (int i = 0; i < NumBuilders[c]; i++)
+				delete Builders[c][i].FBB;
+		}
+		for (int i = 0; i < NumSpareStrings; i++)
+			delete SpareStrings[i];
+		for (int i = 0; i < NumSpareVectors; i++)
+			delete SpareVectors[i];
+	}
+
+	ResponsePool* ResponsePool::ThisThread()
+	{
+		static thread_local ResponsePool pool;
+		return ResponsePoolDestroyed ? nullptr : &pool;
+	}
+
+	flatbuffers::FlatBufferBuilder* ResponsePool::GetBuilder(size_t size, size_t& capacity)
+	{
+		int c = 0;
+		while (c < NumClasses && ClassSize(c) < size)
+			c++;
+		ResponsePool* pool = ThisThread();
+		if (c < NumClasses && pool != nullptr && pool->NumBuilders[c] != 0)
+		{
+			Builder& b = pool->Builders[c][--pool->NumBuilders[c]];
+			capacity = b.Capacity;
+			return b.FBB;
+		}
+		// flatbuffers insists on a multiple of 8
+		capacity = c < NumClasses ? ClassSize(c) : (size + 7) & ~(size_t) 7;
+		return new flatbuffers::FlatBufferBuilder((flatbuffers::uoffset_t) capacity);
+	}
+
+	void ResponsePool::ReleaseBuilder(flatbuffers::FlatBufferBuilder* fbb, size_t capacity)
+	{
+		// If the builder grew, then it is now at least as large as its contents
+		capacity = std::max(capacity, (size_t) fbb->GetSize());
+
+		// File the builder under the largest class that it can hold without growing
+		int c = NumClasses - 1;
+		while (c >= 0 && ClassSize(c) > capacity)
+			c--;
+		ResponsePool* pool = ThisThread();
+		if (c < 0 || capacity > 2 * ClassSize(NumClasses - 1) || pool == nullptr || pool->NumBuilders[c] == MaxPerClass)
+		{
+			delete fbb;
+			return;
+		}
+		fbb->Clear();
+		pool->Builders[c][pool->NumBuilders[c]++] = {fbb, capacity};
+	}
+
+	void ResponsePool::GetHeaders(Vector<char>& buf, Vector<uint32_t>& index)
+	{
+		ResponsePool* pool = ThisThread();
+		if (pool == nullptr || pool->NumSpareHeaders == 0)
+			return;
+		int i = --pool->NumSpareHeaders;
+		buf.Swap(pool->SpareHeaderBufs[i]);
+		index.Swap(pool->SpareHeaderIndexes[i]);
+	}
+
+	void ResponsePool::ReleaseHeaders(Vector<char>& buf, Vector<uint32_t>& index)
+	{
+		if (buf.Reserved() == 0 && index.Reserved() == 0)
+			return;
+		ResponsePool* pool = ThisThread();
+		if (pool == nullptr || pool->NumSpareHeaders == MaxSpareHeaders || buf.Reserved() > MaxSpareHeaderBuf)
+		{
+			buf.Clear();
+			index.Clear();
+			return;
+		}
+		buf.ClearKeepMemory();
+		index.ClearKeepMemory();
+		int i = pool->NumSpareHeaders++;
+		buf.Swap(pool->SpareHeaderBufs[i]);
+		index.Swap(pool->SpareHeaderIndexes[i]);
+	}
+
+	std::string* ResponsePool::GetString()
+	{
+		ResponsePool* pool = ThisThread();
+		if (pool == nullptr || pool->NumSpareStrings == 0)
+			return new std::string();
+		return pool->SpareStrings[--pool->NumSpareStrings];
+	}
+
+	void ResponsePool::ReleaseString(std::string* s)
+	{
+		ResponsePool* pool = ThisThread();
+		if (pool == nullptr || pool->NumSpareStrings == MaxSpareBodies)
+		{
+			delete s;
+			return;
+		}
+		std::string().swap(*s);
+		pool->SpareStrings[pool->NumSpareStrings++] = s;
+	}
+
+	std::vector<uint8_t>* ResponsePool::GetVector()
+	{
+		ResponsePool* pool = ThisThread();
+		if (pool == nullptr || pool->NumSpareVectors == 0)
+			return new std::vector<uint8_t>();
+		return pool->SpareVectors[--pool->NumSpareVectors];
+	}
+
+	void ResponsePool::ReleaseVector(std::vector<uint8_t>* v)
+	{
+		ResponsePool* pool = ThisThread();
+		if (pool == nullptr || pool->NumSpareVectors == MaxSpareBodies)
+		{
+			delete v;
+			return;
+		}
+		std::vector<uint8_t>().swap(*v);
+		pool->SpareVectors[pool->NumSpareVectors++] = v;
+	}
+
+	// Like FlatBufferBuilder::CreateVector, but with a memcpy, because flatbuffers copies a byte at a time
+	static flatbuffers::Offset<flatbuffers::Vector<uint8_t>> CreateByteVector(flatbuffers::FlatBufferBuilder& fbb, const void* data, size_t len)
+	{
+		uint8_t* dst;
+		auto vec = fbb.CreateUninitializedVector(len, sizeof(uint8_t), &dst);
+		memcpy(dst, data, len);
+		return flatbuffers::Offset<flatbuffers::Vector<uint8_t>>(vec);
 	}
 
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -2073,7 +4953,7 @@ namespace hb
 	Response Response::MakeBodyPart(ConstRequestPtr request, const void* part, size_t len, bool isFinal)
 	{
 		Response r(request);
-		r.SetBodyInternal(part, len, false);
+		r.SetBodyInternal(part, len, false, true);
 		r.Status = StatusMeta_BodyPart;
 		r.IsFinalChunkedFrame = isFinal;
 		return r;
@@ -2129,6 +5009,9 @@ namespace hb
 		// Keys may not be empty, but values are allowed to be empty
 		HTTPBRIDGE_ASSERT(keyLen > 0 && valLen >= 0);
 
+		if (HeaderIndex.Reserved() == 0)
+			ResponsePool::GetHeaders(HeaderBuf, HeaderIndex);
+
 		HeaderIndex.Push(HeaderBuf.Size());
 		memcpy(HeaderBuf.AddSpace((uint32_t) keyLen), key, keyLen);
 		HeaderBuf.Push(0);
@@ -2153,10 +5036,54 @@ namespace hb
 		// Use MakeBodyPart()
 		HTTPBRIDGE_ASSERT(Status != StatusMeta_BodyPart);
 
-		SetBodyInternal(body, len, true);
+		SetBodyInternal(body, len, true, true);
+	}
+
+	static void DeleteStringBody(void* context, const void*, size_t)
+	{
+		ResponsePool::ReleaseString((std::string*) context);
+	}
+
+	static void DeleteVectorBody(void* context, const void*, size_t)
+	{
+		ResponsePool::ReleaseVector((std::vector<uint8_t>*) context);
+	}
+
+	void Response::SetBody(std::string&& body)
+	{
+		// Moving the string into a container from the thread's pool keeps its buffer where it is, without a new allocation
+		std::string* owned = ResponsePool::GetString();
+		*owned = std::move(body);
+		SetBody(owned->data(), owned->size(), DeleteStringBody, owned);
+	}
+
+	void Response::SetBody(std::vector<uint8_t>&& body)
+	{
+		std::vector<uint8_t>* owned = ResponsePool::GetVector();
+		*owned = std::move(body);
+		SetBody(owned->data(), owned->size(), DeleteVectorBody, owned);
+	}
+
+	void Response::SetBody(const void* body, size_t len, BodyDeleter deleter, void* context)
+	{
+		// Use MakeBodyPart()
+		HTTPBRIDGE_ASSERT(Status != StatusMeta_BodyPart);
+		HTTPBRIDGE_ASSERT(Owned.Deleter == nullptr);
+
+		// Take ownership first, so that the body is released even if it ends up being compressed into the frame
+		Owned.Data = body;
+		Owned.Size = len;
+		Owned.Deleter = deleter;
+		Owned.Context = context;
+		SetBodyInternal(body, len, true, false);
+	}
+
+	void Response::SetBodyRef(const void* body, size_t len)
+	{
+		SetBodyInternal(body, len, Status != StatusMeta_BodyPart, false);
 	}
 
-	void Response::SetBodyInternal(const void* body, size_t len, bool isFullBody)
+	void Response::SetBodyInternal(const void* body, size_t len, bool isFullBody, bool copy)
 	{
 		// Ensure sanity, as well as safety because BodyLength is uint32
 		HTTPBRIDGE_ASSERT(len <= 1024 * 1024 * 1024);
@@ -2164,7 +5091,7 @@ namespace hb
 		// Although it's theoretically possible to allow SetBody to be called multiple times
 		// (ie discard FBB every time) it is so wasteful that we rather force the user to
 		// construct their code in such a manner that this is not necessary.
-		HTTPBRIDGE_ASSERT(BodyOffset == 0 && BodyLength == 0);
+		HTTPBRIDGE_ASSERT(BodyOffset == 0 && BodyLength == 0 && BodyRef == nullptr);
 
 		void* enc = nullptr;
 		size_t encLen = -1;
@@ -2176,7 +5103,7 @@ namespace hb
 			// The following two conditions disable transparent compression:
 			// * Content-Encoding is set
 			// * Content-Length is set
-			acceptEncoding = Request->HeaderByName("Accept-Encoding");
+			acceptEncoding = Request->HeaderByName(HeaderKey_Accept_Encoding);
 			if (acceptEncoding && !HeaderByName("Content-Encoding") && !HeaderByName("Content-Length"))
 			{
 				char responseEncoding[ICompressor::ResponseEncodingBufferSize];
@@ -2192,12 +5119,22 @@ namespace hb
 			}
 		}
 
-		CreateBuilder();
+		CreateBuilder(copy || enc ? len : 0);
 
 		FBB->NotNested();
-		FBB->StartVector(len, sizeof(uint8_t));
-		FBB->PushBytes((const uint8_t*) body, len);
-		BodyOffset = (ByteVectorOffset) FBB->EndVector(len);
+		if (copy || enc)
+		{
+			BodyOffset = (ByteVectorOffset) CreateByteVector(*FBB, body, len).o;
+		}
+		else
+		{
+			// Write only the vector's length prefix. Because this is the first thing in FBB, it ends up as the
+			// last 4 bytes of the finished flatbuffer, and the body bytes, which we send straight after the flatbuffer,
+			// complete the vector. To a reader, the frame is indistinguishable from one where the body was copied in.
+			HTTPBRIDGE_ASSERT(FBB->GetSize() == 0);
+			BodyOffset = (ByteVectorOffset) FBB->PushElement((flatbuffers::uoffset_t) len);
+			BodyRef = len != 0 ? body : nullptr;
+		}
 		BodyLength = (uint32_t) len;
 
 		if (enc)
@@ -2211,12 +5148,13 @@ namespace hb
 
 	const char* Response::HeaderByName(const char* name, int nth) const
 	{
+		size_t nameLen = strlen(name);
 		for (int32_t index = 0; index < HeaderCount(); index++)
 		{
 			int i = index << 1;
 			const char* key = &HeaderBuf[HeaderIndex[i]];
 			const char* val = &HeaderBuf[HeaderIndex[i + 1]];
-			if (strcmp(key, name) == 0)
+			if ((size_t) HeaderKeyLen(index) == nameLen && EqNoCase(key, name, nameLen))
 				nth--;
 			if (nth == -1)
 				return val;
@@ -2253,20 +5191,46 @@ namespace hb
 	}
 
 	void Response::FinishFlatbuffer(void*& buf, size_t& len, bool isLast)
+	{
+		const void* bodyRef = nullptr;
+		size_t bodyRefLen = 0;
+		FinishFlatbuffer(buf, len, bodyRef, bodyRefLen, isLast);
+		HTTPBRIDGE_ASSERT(bodyRef == nullptr); // Use the other FinishFlatbuffer
+	}
+
+	void Response::FinishFlatbuffer(void*& buf, size_t& len, const void*& bodyRef, size_t& bodyRefLen, bool isLast)
+	{
+		FinishFlatbuffer(buf, len, bodyRef, bodyRefLen, isLast, nullptr, nullptr);
+	}
+
+	// If cache is not null, then headers that are in the cache are sent by id. Those that headersDefined says
+	// the connection already knows are sent as an id alone, and the rest are defined, and listed in DefinedHeaderIDs.
+	void Response::FinishFlatbuffer(void*& buf, size_t& len, const void*& bodyRef, size_t& bodyRefLen, bool isLast, hb::HeaderCacheSend* cache, const std::atomic<uint64_t>* headersDefined)
 	{
 		HTTPBRIDGE_ASSERT(!IsFlatBufferBuilt);
 
-		CreateBuilder();
+		CreateBuilder(0);
 
-		std::vector<flatbuffers::Offset<httpbridge::TxHeaderLine>> lines;
+		// The lines of all but the most unusual responses fit on the stack
+		const int32_t numLines = HeaderCount() + 1;
+		flatbuffers::Offset<httpbridge::TxHeaderLine> linesStack[64];
+		std::vector<flatbuffers::Offset<httpbridge::TxHeaderLine>> linesHeap;
+		flatbuffers::Offset<httpbridge::TxHeaderLine>* lines = linesStack;
+		if (numLines > 64)
+		{
+			linesHeap.resize(numLines);
+			lines = &linesHeap[0];
+		}
+		int32_t nlines = 0;
 		{
 			char statusStr[4];
 			u32toa((uint32_t) Status, statusStr);
-			auto key = FBB->CreateVector((const uint8_t*) statusStr, 3);
-			auto line = httpbridge::CreateTxHeaderLine(*FBB, key, 0, 0);
-			lines.push_back(line);
+			auto key = CreateByteVector(*FBB, statusStr, 3);
+			lines[nlines++] = httpbridge::CreateTxHeaderLine(*FBB, key, 0, 0);
 		}
 
+		if (HeaderIndex.Reserved() == 0)
+			ResponsePool::GetHeaders(HeaderBuf, HeaderIndex);
 		HeaderIndex.Push(HeaderBuf.Size()); // add a terminator
 
 		for (int32_t i = 0; i < HeaderIndex.Size() - 2; i += 2)
@@ -2274,12 +5238,21 @@ namespace hb
 			// The extra 1's here are for removing the null terminator that we add to keys and values
 			uint32_t keyLen = HeaderIndex[i + 1] - HeaderIndex[i] - 1;
 			uint32_t valLen = HeaderIndex[i + 2] - HeaderIndex[i + 1] - 1;
-			auto key = FBB->CreateVector((const uint8_t*) &HeaderBuf[HeaderIndex[i]], keyLen);
-			auto val = FBB->CreateVector((const uint8_t*) &HeaderBuf[HeaderIndex[i + 1]], valLen);
-			auto line = httpbridge::CreateTxHeaderLine(*FBB, key, val, 0);
-			lines.push_back(line);
+			const char* keyStr = &HeaderBuf[HeaderIndex[i]];
+			const char* valStr = &HeaderBuf[HeaderIndex[i + 1]];
+			uint16_t id = cache != nullptr ? cache->Lookup(keyLen, keyStr, valLen, valStr, Backend != nullptr ? Backend->AnyLog() : nullptr) : 0;
+			if (id != 0 && (headersDefined[(id - 1) >> 6].load(std::memory_order_acquire) & ((uint64_t) 1 << ((id - 1) & 63))) != 0)
+			{
+				lines[nlines++] = httpbridge::CreateTxHeaderLine(*FBB, 0, 0, id);
+				continue;
+			}
+			auto key = CreateByteVector(*FBB, keyStr, keyLen);
+			auto val = CreateByteVector(*FBB, valStr, valLen);
+			lines[nlines++] = httpbridge::CreateTxHeaderLine(*FBB, key, val, id);
+			if (id != 0)
+				DefinedHeaderIDs.Push(id);
 		}
-		auto linesVector = FBB->CreateVector(lines);
+		auto linesVector = FBB->CreateVector(lines, nlines);
 
 		uint8_t flags = 0;
 		if (isLast)
@@ -2293,6 +5266,8 @@ namespace hb
 		frame.add_stream(Stream);
 		frame.add_headers(linesVector);
 		frame.add_body(BodyOffset);
+		if (Window != 0)
+			frame.add_window(Window);
 		auto root = frame.Finish();
 		httpbridge::FinishTxFrameBuffer(*FBB, root);
 		len = FBB->GetSize();
@@ -2301,9 +5276,12 @@ namespace hb
 		// Hack the FBB to write our frame size at the start of the buffer.
 		// This is not a 'hack' in the sense that it's bad or needs to be removed at some point.
 		// It's simply not the intended use of FBB.
-		// Right here 'len' contains the size of the flatbuffer, which is our "frame size"
+		// Right here 'len' contains the size of the flatbuffer, which is our "frame size".
+		// A body from SetBodyRef is sent right after the flatbuffer, so it is part of the frame too.
+		bodyRef = BodyRef;
+		bodyRefLen = BodyRef != nullptr ? BodyLength : 0;
 		uint8_t b4[4];
-		Write32LE(b4, (uint32_t) len);
+		Write32LE(b4, (uint32_t) (len + bodyRefLen));
 		FBB->PushBytes(b4, 4);
 
 		// Write out magic frame marker. This is just used to catch bugs in framing code.
@@ -2388,6 +5366,10 @@ namespace hb
 		{
 			buf = nullptr;
 		}
+		else if (BodyRef != nullptr)
+		{
+			buf = BodyRef;
+		}
 		else
 		{
 			// The flatbuffer buffer grows downward, and GetCurrentBufferPointer() returns the low point.
@@ -2407,17 +5389,20 @@ namespace hb
 
 	void Response::Free()
 	{
-		delete FBB;
+		if (FBB != nullptr)
+			ResponsePool::ReleaseBuilder(FBB, FBBCapacity);
 		FBB = nullptr;
-		HeaderIndex.Clear();
-		HeaderBuf.Clear();
+		ResponsePool::ReleaseHeaders(HeaderBuf, HeaderIndex);
+		DefinedHeaderIDs.Clear();
+		Owned.Release();
 		Backend = nullptr;
 	}
 
-	void Response::CreateBuilder()
+	void Response::CreateBuilder(size_t bodyBytes)
 	{
+		// Reserve enough for the body, the headers that we have, plus the few that Backend::Send might add, and the frame itself
 		if (FBB == nullptr)
-			FBB = new flatbuffers::FlatBufferBuilder();
+			FBB = ResponsePool::GetBuilder(bodyBytes + HeaderBuf.Size() + 40 * (HeaderCount() + 1) + 256, FBBCapacity);
 	}
 
 	int32_t Response::HeaderKeyLen(int32_t _i) const
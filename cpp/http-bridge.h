@@ -26,9 +26,11 @@ TODO
 #include <string.h>
 #include <unordered_map>
 #include <vector>
+#include <string>
 #include <atomic>
 #include <mutex>
 #include <thread>
+#include <condition_variable>
 #include <memory>
 
 namespace flatbuffers
@@ -72,6 +74,8 @@ HTTPBRIDGE_API HTTPBRIDGE_NORETURN_PREFIX void BuiltinTrap() HTTPBRIDGE_NORETURN
 
 #ifdef _WIN32
 #define HTTPBRIDGE_PLATFORM_WINDOWS 1
+#elif defined(__linux__)
+#define HTTPBRIDGE_PLATFORM_LINUX 1
 #endif
 
 	class ITransport;
@@ -80,15 +84,27 @@ HTTPBRIDGE_API HTTPBRIDGE_NORETURN_PREFIX void BuiltinTrap() HTTPBRIDGE_NORETURN
 	class Request;
 	class Response;
 	class InFrame;
+	class Backend;
+	class Dispatcher;
 	class HeaderCacheRecv;		// Implementation and header inside in http-bridge.cpp
+	class HeaderCacheEntry;		// Implementation and header inside in http-bridge.cpp
+	class HeaderCacheSend;		// Implementation and header inside in http-bridge.cpp
+	class RecvChunk;			// Implementation and header inside in http-bridge.cpp
 
 	typedef std::shared_ptr<Request>		RequestPtr;
 	typedef std::shared_ptr<const Request>	ConstRequestPtr;
 	typedef void(*RequestDestroyCallback)(Request*);
+	typedef void(*AsyncSendErrorCallback)(Backend* backend, uint64_t channel, uint64_t stream);
+	typedef void(*HighWaterCallback)(Backend* backend, uint64_t channel, uint64_t stream, size_t heldBytes);
+	typedef void(*DispatchHandler)(void* context, InFrame& frame);
+	typedef void(*BodyDeleter)(void* context, const void* body, size_t len);
 
 	// This dword appears before every frame. It is followed by 4 bytes of frame size, and then the flatbuffer.
 	const uint32_t MagicFrameMarker = 0x48426268; // "HBbh"
 
+	// Size of the part of a body frame that comes before the body bytes. See EncodeBodyPartFrame.
+	const size_t BodyPartFrameHeaderSize = 64;
+
 	enum SendResult
 	{
 		SendResult_All,			// All of the data was sent
@@ -215,6 +231,7 @@ HTTPBRIDGE_API HTTPBRIDGE_NORETURN_PREFIX void BuiltinTrap() HTTPBRIDGE_NORETURN
 	HTTPBRIDGE_API uint64_t		uatoi64(const char* s);
 	HTTPBRIDGE_API int64_t		atoi64(const char* s);
 	HTTPBRIDGE_API int			TranslateVersionToFlatBuffer(hb::HttpVersion v);
+	HTTPBRIDGE_API void			EncodeBodyPartFrame(uint8_t* buf, HttpVersion version, uint64_t channel, uint64_t stream, size_t bodyLen, bool isFinal); // Write the BodyPartFrameHeaderSize bytes that precede a body part
 
 	class HTTPBRIDGE_API Logger
 	{
@@ -223,15 +240,45 @@ HTTPBRIDGE_API HTTPBRIDGE_NORETURN_PREFIX void BuiltinTrap() HTTPBRIDGE_NORETURN
 		void			Logf(HTTPBRIDGE_PRINTF_FORMAT_Z const char* msg, ...);
 	};
 
+	// A response body that belongs to httpbridge, until it is handed back with Deleter. See Response::SetBody.
+	struct OwnedBody
+	{
+		const void*	Data;
+		size_t		Size;
+		BodyDeleter	Deleter;		// Null if there is nothing to release
+		void*		Context;
+
+		void Release();				// Call Deleter, if it is set, and clear it
+	};
+
+	// One piece of a gathered send. See ITransport::SendV.
+	struct SendBuf
+	{
+		const void*	Data;
+		size_t		Size;
+	};
+
 	class HTTPBRIDGE_API ITransport
 	{
 	public:
 		Logger*				Log = nullptr;						// Server::Connect copies its log in here during successful Connect()
+		bool				NonBlocking = false;				// If true, Recv() must return immediately when there is no data. Backend sets this before Connect().
 
 		virtual				~ITransport();						// This must close the socket/file/pipe/etc
 		virtual bool		Connect(const char* addr) = 0;
 		virtual SendResult	Send(const void* data, size_t size, size_t& sent) = 0;
 		virtual RecvResult	Recv(size_t maxSize, void* data, size_t& bytesRead) = 0;
+
+		// Send the concatenation of 'bufs', as though it were one contiguous buffer. The default implementation calls Send() on each piece.
+		virtual SendResult	SendV(const SendBuf* bufs, size_t nbufs, size_t& sent);
+
+		// If true, Send() and SendV() may be called from many threads at once, and each call's data is kept contiguous.
+		// Otherwise, Backend serializes sends with a lock.
+		virtual bool		CanSendConcurrently() const;
+
+		// Write up to maxFds file descriptors into fds, which become readable when Recv() has something to report,
+		// and return the number written. Returning zero means the transport cannot be waited on, and Recv() must block.
+		virtual size_t		PollFds(int* fds, size_t maxFds);
 	};
 
 	// Expose a compressor for compressing responses with gzip, deflate, etc.
@@ -302,6 +349,20 @@ HTTPBRIDGE_API HTTPBRIDGE_NORETURN_PREFIX void BuiltinTrap() HTTPBRIDGE_NORETURN
 		}
 
 		INT Size() const { return Count; }
+		INT Reserved() const { return Capacity; }
+
+		// Set the size to zero, but keep the memory, so that the vector can be filled again without reallocating
+		void ClearKeepMemory()
+		{
+			Count = 0;
+		}
+
+		void Swap(Vector& b)
+		{
+			std::swap(Capacity, b.Capacity);
+			std::swap(Count, b.Count);
+			std::swap(Items, b.Items);
+		}
 
 		void Resize(INT newSize)
 		{
@@ -454,8 +515,95 @@ namespace std
 }
 namespace hb
 {
+	/* A map from StreamKey to T, which many threads can use at once.
+	The streams are spread over NumShards shards, each of which has its own lock and its own unordered_map,
+	so threads that are working on different streams seldom wait for each other. To read or modify an item,
+	hold the lock of ShardFor(key) for as long as you are touching the item.
+
+	The shard is chosen with a cheap multiplicative hash. A client that chooses its stream ids can at worst put
+	all of its streams into one shard, which is no worse than a single lock. The maps inside the shards still
+	use Hash16B, which is what protects their bucket chains from chosen keys.
+	*/
+	template<typename T>
+	class StreamMap
+	{
+	public:
+		static const size_t NumShards = 64;
+
+		struct Shard
+		{
+			std::mutex							Lock;		// Guards Items, and the T objects inside it
+			std::unordered_map<StreamKey, T>	Items;
+			char								Padding[64];	// Keep neighbouring locks off the same cache line
+
+			T* Find(const StreamKey& key)
+			{
+				auto iter = Items.find(key);
+				return iter == Items.end() ? nullptr : &iter->second;
+			}
+		};
+
+		Shard& ShardFor(const StreamKey& key)
+		{
+			uint64_t h = key.Channel * 0x9E3779B97F4A7C15ull ^ key.Stream * 0xC2B2AE3D27D4EB4Full;
+			return Shards[(h >> 32) % NumShards];
+		}
+
+		Shard& ShardAt(size_t i) { return Shards[i]; }
+
+	private:
+		Shard Shards[NumShards];
+	};
+
 	/* A backend that wants to receive HTTP/2 requests
 	To connect to an upstream http-bridge server, call Connect("tcp", "host:port")
+	If the server is on the same machine, you can instead use a unix domain socket, by calling Connect("unix", "/path/to/socket").
+	On Linux, Connect("shm", "/path/to/socket") goes one step further, and moves frames through shared memory
+	rings instead of the socket. The server must be listening with BackendNetwork = "shm".
+	If httpbridge is compiled with HTTPBRIDGE_IO_URING (Linux only), then Connect("uring", addr) uses io_uring
+	for a tcp ("host:port") or unix ("/path/to/socket") connection.
+	Unix domain sockets are not supported on Windows.
+
+	A single connection to the server can become the bottleneck on a machine with many cores. On Linux, you can
+	set Connections > 1 before Connect(), and the backend will open that many connections to the server. The server
+	treats them as one backend. Each stream travels over one connection, chosen by the hash of its StreamKey, and each
+	connection has its own receive buffer, header cache, and send lock. If any of the connections is lost, then the
+	backend closes all of them, so the usual "if (!IsConnected()) Connect()" loop takes care of reconnecting.
+	This requires the Go server.
+
+	Send() is normally synchronous, and threads that send over the same connection take turns on its send lock.
+	With dozens of worker threads, they spend much of their time queued up behind each other. Setting AsyncSend = true
+	before Connect() turns Send() into a copy onto a lock-free queue, and a writer thread per connection sends
+	everything that has accumulated with a single write. Because the send happens later, a failure is reported through
+	AsyncSendError, and through SendResult_Closed from subsequent calls to Send(). Once MaxQueuedBytes are waiting on
+	a connection, Send() waits for the writer to catch up, just as a synchronous Send() waits for the socket.
+
+	SendFile() sends a response whose body comes from a file descriptor. It sets Content-Length, maps the file
+	(on Windows, reads it) in windows of SendFileMapSize, and sends it as body frames of SendFileChunkSize that
+	point straight into the mapping. While the server has paused the stream, SendFile() waits for it to be resumed,
+	so the caller doesn't need to watch Request::State(). It returns when the whole file has been sent, or with
+	SendResult_Closed if the stream was aborted, or the file could not be read. Call it from a worker thread.
+
+	Other senders can get the same freedom from Pause and Resume by setting HoldWhilePaused = true. Send() and
+	SendBodyPart() to a paused stream then copy the frame onto a queue of that stream's own, and return at once.
+	When the Resume frame arrives, Recv() sends the held frames, in order, before any later frame of the stream.
+	MaxHeldBytesTotal caps the memory of all held frames, and HeldHighWater tells you when one stream is holding a lot.
+
+	The Go server gives each response a window of byte credits (see Server.BackendStreamWindow). If UseStreamWindow
+	is true, then a stream is paused as soon as its response has used up the window, and resumed by the WindowUpdate
+	frame that the server sends as the client receives the bytes. The server then sends no Pause or Resume for the
+	stream. Recv() returns such a WindowUpdate as a Resume frame, so code that watches Request::State() works as before.
+	Because a stream can now pause in the middle of your own Send(), a thread that waits for a paused stream to be
+	resumed must not be the thread that calls Recv(). HoldWhilePaused doesn't have that problem.
+
+	By default, Recv() waits up to RecvTimeoutMilliseconds for a frame. On Linux, you can instead
+	integrate Backend into your own event loop: set NonBlocking = true before Connect(), add PollFd() to
+	your epoll/poll set, and when it becomes readable, call Recv() until it returns false.
+	Wakeup() can be called from any thread, and interrupts Wait() or a waiting Recv() immediately.
+
+	RecvMany() receives a batch of frames. It waits for the first frame in the same way as Recv(), and then
+	decodes every frame that is already in the receive buffers, up to maxFrames, without reading any more.
+	This lets you hand a whole batch over to your worker threads with a single queue operation.
 	*/
 	class HTTPBRIDGE_API Backend
 	{
@@ -480,6 +628,62 @@ namespace hb
 		// as it will be set automatically after calling your compressor.
 		ICompressor*		Compressor = nullptr;
 
+		// If true, Recv() never waits for data. Use PollFd() or Wait() to find out when to call Recv() again.
+		// Do not change this after Connect() has been called.
+		bool				NonBlocking = false;
+
+		// If true, every body frame that Recv() returns has a private copy of its body, in InFrame.BodyBytes, which
+		// you may modify. If false, InFrame.BodyBytes points into the receive buffer, and must be treated as read-only.
+		// Either way, InFrame::Body() gives you a reference to the bytes that outlives the InFrame.
+		bool				CopyFrameBodies = false;
+
+		// Number of connections to open to the server. Only Linux supports more than one. See the comment above the class.
+		// Do not change this after Connect() has been called.
+		uint32_t			Connections = 1;
+
+		// If true, Send() copies the frame onto a queue and returns immediately, and a writer thread per connection
+		// drains the queue, coalescing frames into large writes. Use this when many threads are sending at once.
+		// Send() returns SendResult_Closed once a writer has failed. Do not change this after Connect() has been called.
+		bool				AsyncSend = false;
+
+		// Called by a writer thread for every queued frame that could not be sent, when AsyncSend is true. May be null.
+		AsyncSendErrorCallback	AsyncSendError = nullptr;
+
+		// When AsyncSend is true, a writer that wrote less than CoalesceMicroseconds ago holds back its next write until that
+		// much time has passed, or until CoalesceBytes are queued, so that small frames share a write. A writer that has been
+		// idle for longer than that writes immediately, so a quiet backend sees no extra latency. Zero disables the delay.
+		uint32_t			CoalesceMicroseconds = 0;
+		size_t				CoalesceBytes = 64 * 1024;
+
+		// When AsyncSend is true, Send() waits while this many bytes are queued on the stream's connection, the way that a
+		// blocking socket would. Without a limit, a fast sender could queue far more than the server accepts for a paused stream.
+		size_t				MaxQueuedBytes = 8 * 1024 * 1024;
+
+		// If true, a frame that is sent to a paused stream is held by Backend, and sent as soon as the stream is resumed.
+		// See the comment above the class. Do not change this after Connect() has been called.
+		bool				HoldWhilePaused = false;
+
+		// Most bytes that may be held for all paused streams together. A Send() that would go beyond this returns
+		// SendResult_BufferFull, and has no effect, so you can try again later.
+		size_t				MaxHeldBytesTotal = 256 * 1024 * 1024;
+
+		// Called by the sending thread when the bytes held for one stream rise above HeldHighWaterBytes. It is called again
+		// only after the stream's held frames have all been sent. May be null.
+		HighWaterCallback	HeldHighWater = nullptr;
+		size_t				HeldHighWaterBytes = 4 * 1024 * 1024;
+
+		// If true, then a stream that the server gives a window of byte credits pauses itself once its response has
+		// used up the window, instead of waiting for a Pause frame. See the comment above the class.
+		// Do not change this after Connect() has been called.
+		bool				UseStreamWindow = false;
+
+		// Maximum amount of time that a blocking Recv() will wait for a frame
+		static const uint32_t RecvTimeoutMilliseconds = 500;
+
+		// SendFile() sends body frames of this size, from a mapped window of the file of SendFileMapSize
+		static const size_t SendFileChunkSize = 256 * 1024;
+		static const size_t SendFileMapSize = 16 * 1024 * 1024;
+
 							Backend();
 							~Backend();																// Destructor calls Close()
 		bool				Connect(const char* network, const char* addr);
@@ -488,7 +692,12 @@ namespace hb
 		SendResult			Send(Response& response);
 		SendResult			Send(ConstRequestPtr request, StatusCode status);									// Convenience method for sending a simple response
 		SendResult			SendBodyPart(ConstRequestPtr request, const void* body, size_t len, bool isFinal);	// Stream out the body of a response. isFinal is necessary for chunked responses; must be true on the final frame.
+		SendResult			SendFile(Response& header, int fd, uint64_t offset, uint64_t length);				// Send header, followed by 'length' bytes of fd, from 'offset'. See below.
 		bool				Recv(InFrame& frame);																// Returns true if a frame was received
+		size_t				RecvMany(InFrame* frames, size_t maxFrames);										// Like Recv(), but also returns every complete frame that has already been received. Returns the number of frames.
+		int					PollFd();																			// An fd that is readable when Recv() has work to do, or after Wakeup(). Stays valid across reconnects. -1 if not supported (non-Linux).
+		bool				Wait(uint32_t timeoutMilliseconds);													// Wait for PollFd(). Returns false on timeout, or if woken by Wakeup().
+		void				Wakeup();																			// Interrupt Wait() or a blocking Recv(). Callable from any thread.
 		bool				ResendWhenBodyIsDone(InFrame& frame);												// Called by InFrame.ResendWhenBodyIsDone(). Returns false if out of memory.
 		Logger*				AnyLog();
 		void				UnregisterBufferedBytes(size_t bytes);												// Called by Request's destructor, if it has a buffered request.
@@ -501,6 +710,7 @@ namespace hb
 			OutOfMemory,
 			URITooLong,
 			BodyLongerThanContentLength,
+			Consumed,						// The frame was handled internally, and there is nothing to give to the caller
 		};
 		// InternalRecvResult is guaranteed to be a strict super set of RecvResult.
 		// The reason we keep these separate is to avoid confusing the user with enums
@@ -518,44 +728,194 @@ namespace hb
 			StatusCode			Status;
 		};
 		static const uint64_t ResponseBodyUninitialized = -1;
+		static const uint32_t MaxRecvFrameSize = 100 * 1024 * 1024;
+		static const uint32_t MaxSendHeaderIDs = 1024;		// Number of response header ids in HeaderCacheSend
+		// A frame waiting to be sent by a writer thread, or held for a paused stream. Data is the whole frame, and follows the struct in the same allocation.
+		struct QueuedFrame
+		{
+			QueuedFrame*	Next;
+			uint64_t		Channel;
+			uint64_t		Stream;
+			size_t			Size;		// Size of Data()
+			OwnedBody		Body;		// A body that is sent after Data(), instead of being copied into it. Body.Deleter is null if there is none.
+			size_t			BodyBytes;	// Response body bytes in the frame, which is what it costs in credits. Only set for held frames.
+			uint8_t*		Data() { return (uint8_t*) (this + 1); }
+		};
+
 		struct RequestState
 		{
-			RequestPtr	Request;
-			uint64_t	ResponseBodyRemaining;
-			bool		IsResponseHeaderSent;
+			RequestPtr		Request;
+			uint64_t		ResponseBodyRemaining;
+			bool			IsResponseHeaderSent;
+			bool			IsFlushing = false;			// A thread is sending the Held frames. Later frames must join the queue behind them.
+			bool			FinishAfterFlush = false;	// The last frame of the response is held, so the stream ends once Held is empty
+			bool			IsAboveHighWater = false;	// HeldHighWater has been called
+			QueuedFrame*	Held = nullptr;				// Frames that were sent while the stream was paused (HoldWhilePaused). Oldest first.
+			QueuedFrame*	HeldTail = nullptr;
+			size_t			HeldBytes = 0;
+			bool			HasCredits = false;			// The server gave us a window, so Credits decides when the stream pauses, instead of Pause and Resume frames
+			int64_t			Credits = 0;				// Response body bytes that the server will still accept. Goes negative when a frame is larger than what was left.
+		};
+		typedef StreamMap<RequestState> StreamToRequestMap;
+
+
+		// One connection to the server. A frame can only be decoded by the connection that it arrived on,
+		// because the server's header cache is per connection.
+		struct Connection
+		{
+			ITransport*				Transport = nullptr;
+			hb::HeaderCacheRecv*	HeaderCacheRecv = nullptr;
+			hb::RecvChunk*			Recv = nullptr;			// Received bytes, which are decoded in place
+			bool					Idle = false;			// True if the most recent Transport->Recv() returned no data
+			std::mutex				SendLock;				// Guards sending data out over Transport
+
+			// AsyncSend state. SendQueue is a lock-free stack of frames, newest first, which the Writer thread takes as a whole.
+			std::atomic<QueuedFrame*>	SendQueue;
+			std::atomic<bool>			SendFailed;
+			std::atomic<size_t>			QueuedBytes;		// Total size of the frames in SendQueue
+			std::atomic<bool>			WriterSleeping;		// Writer is about to wait on WriterCV, so it must be notified
+			std::mutex					WriterLock;			// Guards setting WriterStop, and waiting on WriterCV
+			std::condition_variable		WriterCV;
+			std::atomic<bool>			WriterStop;			// Set by Close(). From then on, PushQueuedFrame() refuses new frames.
+			std::atomic<uint32_t>		RoomWaiters;		// Number of senders that are waiting on RoomCV for QueuedBytes to drop
+			std::condition_variable		RoomCV;				// Waited on with WriterLock
+			std::thread					Writer;
+
+			// Bit (id - 1) is set once a frame that defines response header 'id' has taken its place on this connection.
+			// Only then may later frames send that header by id alone.
+			std::atomic<uint64_t>		HeadersDefined[MaxSendHeaderIDs / 64];
+
+			Connection() : SendQueue(nullptr), SendFailed(false), QueuedBytes(0), WriterSleeping(false), WriterStop(false), RoomWaiters(0)
+			{
+				for (auto& d : HeadersDefined)
+					d.store(0);
+			}
 		};
-		typedef std::unordered_map<StreamKey, RequestState> StreamToRequestMap;
 
-		hb::HeaderCacheRecv* HeaderCacheRecv = nullptr;
 		Logger				NullLog;
-		hb::Buffer			RecvBuf;
 		std::thread::id		ThreadId;
 
-		std::mutex			TransportLock;					// Guards sending data out over Transport
-		ITransport*			Transport = nullptr;
+		std::vector<Connection*>	Conns;					// Empty when we are not connected. Other threads may only touch this while they hold a ConnPin.
+		size_t						RecvNext = 0;			// Recv() visits the connections round-robin, starting here
+		std::atomic<bool>			SendOpen;				// Set by Connect(). Close() clears it, and then waits for SendPins to reach zero.
+		std::atomic<uint32_t>		SendPins;				// Number of threads that hold a ConnPin
 
-		std::mutex			CurrentRequestLock;				// Guards access to the map, as well as the RequestState objects stored inside the map
-		StreamToRequestMap	CurrentRequests;
+		// Keeps Conns alive while a thread sends, so that Close() can't delete a connection underneath it.
+		// If Open is false, then the backend is closing, and the caller must not touch Conns.
+		struct ConnPin
+		{
+			Backend*	B;
+			bool		Open;
+			ConnPin(Backend* b) : B(b)
+			{
+				B->SendPins++;
+				Open = B->SendOpen;
+			}
+			~ConnPin() { B->SendPins--; }
+		};
+
+		int					EpollFd = -1;					// Holds WakeupFd and the PollFds() of every transport. Linux only.
+		int					WakeupFd = -1;					// eventfd, signalled by Wakeup()
+		std::atomic<bool>	WakeupPending;
+
+		StreamToRequestMap	CurrentRequests;				// Each shard's lock guards the RequestState objects inside it
+		hb::HeaderCacheSend*	HeaderCacheSend = nullptr;	// Response headers that we send by id. Shared by all threads and connections.
 
 		std::atomic<size_t>	BufferedRequestsTotalBytes;		// Total number of body bytes allocated for "BufferedRequests"
+		std::atomic<size_t>	HeldBytesTotal;					// Total size of the Held frames of all streams
+
+		std::mutex				StreamStateLock;			// Used with StreamStateChanged, which is notified whenever a stream is paused, resumed, or aborted
+		std::condition_variable	StreamStateChanged;
 
-		InternalRecvResponse	RecvInternal(InFrame& inframe);
+		bool					RecvOne(Connection& con, InFrame& frame);
+		InternalRecvResponse	RecvInternal(Connection& con, InFrame& inframe);
 		void					RequestFinished(const StreamKey& key);
-		bool					Connect(ITransport* transport, const char* addr);
-		FrameStatus				UnpackHeader(const httpbridge::TxFrame* txframe, InFrame& inframe);
-		FrameStatus				UnpackBody(const httpbridge::TxFrame* txframe, InFrame& inframe);
+		SendResult				ConsumeResponseBody(const StreamKey& key, Response* header, size_t bodyBytes, bool isFinalChunk, bool& isLast, bool& hold);
+		SendResult				HoldFrame(const StreamKey& key, const SendBuf* parts, size_t nparts, OwnedBody* body, size_t bodyBytes, bool isLast);
+		SendResult				FlushHeldFrames(const StreamKey& key);
+		void					ResumeHeldFrames(const StreamKey& key);
+		void					FreeFrameList(QueuedFrame* list);
+		static bool				HaveCompleteFrame(const Connection& con);
+		bool					MakeRecvRoom(Connection& con);
+		void					ConsumeWakeup();
+		bool					WaitWhilePaused(const Request& request);
+		void					NotifyStreamStateChanged();
+		void					WatchTransportFds(Connection& con, bool watch);
+		bool					AddConnection(ITransport* transport, const char* addr);
+		bool					SendHello();
+		SendResult				SendFrame(Connection& con, const SendBuf* parts, size_t nparts);
+		SendResult				QueueFrame(Connection& con, uint64_t channel, uint64_t stream, const SendBuf* parts, size_t nparts, OwnedBody* body = nullptr);
+		QueuedFrame*			NewQueuedFrame(uint64_t channel, uint64_t stream, const SendBuf* parts, size_t nparts, OwnedBody* body);
+		SendResult				PushQueuedFrame(Connection& con, QueuedFrame* frame);
+		void					WaitForQueueRoom(Connection& con);
+		static void				NotifyQueueRoom(Connection& con);
+		void					WriterThread(Connection* con);
+		void					FailQueuedFrames(QueuedFrame* list);
+		static void				FreeQueuedFrame(QueuedFrame* frame);
+		Connection*				ConnectionFor(const StreamKey& key);
+		FrameStatus				UnpackHeader(Connection& con, const httpbridge::TxFrame* txframe, InFrame& inframe);
+		FrameStatus				UnpackBody(Connection& con, const httpbridge::TxFrame* txframe, InFrame& inframe);
 		FrameStatus				UnpackControlFrame(const httpbridge::TxFrame* txframe, InFrame& inframe);
-		size_t					TotalHeaderBlockSize(const httpbridge::TxFrame* frame);
+		FrameStatus				UnpackWindowUpdate(const httpbridge::TxFrame* txframe, InFrame& inframe);
+		size_t					TotalHeaderBlockSize(Connection& con, const httpbridge::TxFrame* frame, size_t& uriLen);
 		void					LogAndPanic(const char* msg);
 		void					SendResponse(RequestPtr request, StatusCode status);
 		void					SendResponse(uint64_t channel, uint64_t stream, StatusCode status);
-		RequestState*			GetRequest(uint64_t channel, uint64_t stream);
-		RequestState*			GetRequestOrDie(uint64_t channel, uint64_t stream);
+		void					AddRequest(const StreamKey& key, RequestPtr request);
 		static StreamKey		MakeStreamKey(uint64_t channel, uint64_t stream);
 		static StreamKey		MakeStreamKey(ConstRequestPtr request);
 		static StreamKey		MakeStreamKey(const httpbridge::TxFrame* txframe);
 	};
 
+	// Case-insensitive FNV-1a hash of a header name. This is constexpr so that HeaderKey constants are hashed at compile time.
+	constexpr uint32_t HeaderNameHash(const char* name, uint32_t h = 2166136261u)
+	{
+		return *name == 0 ? h : HeaderNameHash(name + 1, (h ^ (uint8_t) (*name >= 'A' && *name <= 'Z' ? *name + ('a' - 'A') : *name)) * 16777619u);
+	}
+
+	constexpr uint32_t ConstStrLen(const char* s)
+	{
+		return *s == 0 ? 0 : 1 + ConstStrLen(s + 1);
+	}
+
+	// Headers that every Request indexes in a fixed slot, so that looking them up needs no probing
+	static const int NumWellKnownHeaders = 8;
+	constexpr int WellKnownHeaderSlot(uint32_t hash)
+	{
+		return	hash == HeaderNameHash("content-type") ? 0 :
+				hash == HeaderNameHash("content-length") ? 1 :
+				hash == HeaderNameHash("accept-encoding") ? 2 :
+				hash == HeaderNameHash("authorization") ? 3 :
+				hash == HeaderNameHash("cookie") ? 4 :
+				hash == HeaderNameHash("host") ? 5 :
+				hash == HeaderNameHash("user-agent") ? 6 :
+				hash == HeaderNameHash("accept") ? 7 :
+				-1;
+	}
+
+	/* The name of a header, together with its hash
+	Declare the headers that you look up often as constexpr HeaderKey, and Request::HeaderByName won't need to hash them.
+	A HeaderKey made from a runtime string works too, but is hashed when it is constructed.
+	*/
+	struct HeaderKey
+	{
+		const char*	Name;
+		uint32_t	Len;
+		uint32_t	Hash;
+		int			Slot;		// Well-known header slot, or -1
+
+		constexpr HeaderKey(const char* name) : Name(name), Len(ConstStrLen(name)), Hash(HeaderNameHash(name)), Slot(WellKnownHeaderSlot(HeaderNameHash(name))) {}
+	};
+
+	constexpr HeaderKey HeaderKey_Content_Type("Content-Type");
+	constexpr HeaderKey HeaderKey_Content_Length("Content-Length");
+	constexpr HeaderKey HeaderKey_Accept_Encoding("Accept-Encoding");
+	constexpr HeaderKey HeaderKey_Authorization("Authorization");
+	constexpr HeaderKey HeaderKey_Cookie("Cookie");
+	constexpr HeaderKey HeaderKey_Host("Host");
+	constexpr HeaderKey HeaderKey_User_Agent("User-Agent");
+	constexpr HeaderKey HeaderKey_Accept("Accept");
+
 	/* HTTP request
 
 	Note that header keys and values are always null terminated. The HTTP/2 spec allows headers
@@ -624,8 +984,10 @@ namespace hb
 		StreamState				State() const;								// If State is not Active, then you shouldn't be sending any frames
 		void					SetState(StreamState newState);				// Atomically set the state, but once in Aborted state, always stay Aborted.
 
-		// This is called automatically by Backend. Returns false if an element is too long
-		bool					ParseURI();
+		// The path and query are decoded on the first call to Path(), Query() or NextQuery(), from whichever thread gets there first.
+		// Backend only calls IsURIValid(), and responds with a 414 if it returns false.
+		bool					ParseURI();			// Decode the URI now. Returns false if an element is too long
+		bool					IsURIValid() const;	// Returns false if an element of the URI is too long to decode
 		
 		ConstString				Method() const;		// Returns the method, such as GET or POST
 		ConstString				URI() const;		// Returns the raw URI of the request
@@ -650,11 +1012,14 @@ namespace hb
 		// The buffer is guaranteed to be null terminated, regardless of its contents.
 		// 'nth' allows you to fetch multiple headers, if there is more than one header with the same name.
 		// Set nth=0 to fetch the first header, nth=1 to fetch the 2nd, etc.
+		// Header names are case-insensitive. The first header of each name is found through an index, built by Initialize().
 		// Returns false if the header does not exist.
+		bool					HeaderByName(const HeaderKey& name, size_t& valLen, const void*& val, int nth = 0) const;
 		bool					HeaderByName(const char* name, size_t& valLen, const void*& val, int nth = 0) const;
 
 		// Using this function means you cannot consume headers with embedded null characters in them, but a lot of the time that's OK.
 		// Returns null if the header does not exist.
+		const char*				HeaderByName(const HeaderKey& name, int nth = 0) const;
 		const char*				HeaderByName(const char* name, int nth = 0) const;
 
 		// Retrieve a header by index (valid indexes are 0 .. HeaderCount()-1)
@@ -666,12 +1031,65 @@ namespace hb
 		void					HeaderAt(int32_t index, const char*& key, const char*& val) const;
 
 	private:
+		friend class Backend;
 		static const int			NumPseudoHeaderLines = 1;
 		static const uint16_t		EndOfQueryMarker = 65535;
+		static const int			MaxDecodedURIElement = 65534;	// Maximum decoded length of the path, or of a query key or value
 		int32_t						_HeaderCount = 0;
 		const uint8_t*				_HeaderBlock = nullptr;		// First HeaderLine[] array and then the headers themselves
-		char*						_CachedURI = nullptr;
+		mutable char*				_CachedURI = nullptr;		// Decoded path and query. Only access this through DecodedURI()
+		mutable std::once_flag		_DecodeURIOnce;
 		std::atomic<StreamState>	_State;
+		uint32_t					_ResponseWindow = 0;		// The initial credits that the server gave our response, or zero if it uses Pause and Resume
+
+		// A Request that was received by Backend lives in a slab, together with its header block. DecodeURI puts
+		// _CachedURI in _URISpace, if it fits. Neither of those is freed by the destructor.
+		// Headers that the server sent through the header cache are not copied into the header block. Instead,
+		// _HeaderEntries holds a reference to the cache entry of each such line (and null for the other lines).
+		bool						_HeaderBlockInSlab = false;
+		HeaderCacheEntry* const*	_HeaderEntries = nullptr;
+		char*						_URISpace = nullptr;
+		size_t						_URISpaceLen = 0;
+
+		// Header index. A header line number of zero means 'none', since line zero is the pseudo header.
+		static const int			HeaderIndexSize = 32;		// Must be a power of 2
+		static const int			MaxIndexedHeaders = 24;		// Lines beyond this are only found by scanning
+		uint16_t					_WellKnownHeaders[NumWellKnownHeaders] = {};	// Line of the first header with each well-known name
+		uint32_t					_HeaderIndex[HeaderIndexSize] = {};			// Open addressing, of (top 16 bits of hash) << 16 | line
+
+		const char*					DecodedURI() const;
+		void						DecodeURI() const;
+		void						LineKey(int32_t line, const char*& key, int32_t& keyLen) const;
+		void						LineValue(int32_t line, const char*& val, int32_t& valLen) const;
+		void						BuildHeaderIndex();
+		int32_t						FindHeaderLine(const HeaderKey& name) const;
+		bool						IsHeaderLineNamed(int32_t line, const HeaderKey& name) const;
+	};
+
+	/* A reference to the body bytes of a received frame, obtained from InFrame::Body()
+	The bytes stay valid for as long as any BodyView refers to them. Copying a BodyView only bumps a reference count.
+	Note that a BodyView of a frame that points into the receive buffer keeps that whole block of the receive
+	buffer (typically 64 KB) alive, so don't hold on to many of them for long periods.
+	*/
+	class HTTPBRIDGE_API BodyView
+	{
+	public:
+		BodyView();
+		BodyView(const BodyView& b);
+		BodyView(BodyView&& b);
+		~BodyView();
+
+		BodyView& operator=(const BodyView& b);
+		BodyView& operator=(BodyView&& b);
+
+		const uint8_t*	Data() const { return Bytes; }
+		size_t			Size() const { return Len; }
+
+	private:
+		friend class InFrame;
+		RecvChunk*		Chunk = nullptr;
+		const uint8_t*	Bytes = nullptr;
+		size_t			Len = 0;
 	};
 
 	/* A frame received from the server
@@ -688,20 +1106,68 @@ namespace hb
 		bool			IsHeader;			// Is this the first frame of the request? For a request with an empty body, IsHeader and IsLast are both true.
 		bool			IsLast;				// Is this the last frame of the request?
 
-		uint8_t*		BodyBytes;			// Body bytes in this frame, unless the frame is being buffered, in which case BodyBytes is null.
+		uint8_t*		BodyBytes;			// Body bytes in this frame, unless the frame is being buffered, in which case BodyBytes is null. Read-only, unless Backend.CopyFrameBodies is true.
 		size_t			BodyBytesLen;		// Length of BodyBytes, unless the frame is being buffered, in which case BodyBytesLen is 0.
 
 		InFrame();
+		InFrame(InFrame&& b);				// Takes over b's request and body, and resets b
 		~InFrame();
 
-		void	Reset();					// Reset the frame object to it's default state.
-		bool	ResendWhenBodyIsDone();		// Calls Request->Backend->ResentWhenBodyIsDone(this)
+		InFrame& operator=(InFrame&& b);
+
+		void		Reset();				// Reset the frame object to it's default state.
+		bool		ResendWhenBodyIsDone();	// Calls Request->Backend->ResentWhenBodyIsDone(this)
+		BodyView	Body() const;			// A reference to BodyBytes that remains valid after this frame is reset
 
 	private:
+		friend class Backend;
+		RecvChunk*	BodyChunk = nullptr;	// Holds BodyBytes
+		void		ReleaseBody();
+
 		InFrame(const InFrame&) = delete;
 		InFrame& operator= (const InFrame&) = delete;
 	};
 
+	/* A pool of worker threads that handle received frames
+
+	Call Start() once, and then pass every frame that you receive to Dispatch(). Each worker has its own queue.
+	All of the frames of a stream go to the same worker, chosen by the hash of its StreamKey, so a handler sees
+	the body frames of a request in order, and never concurrently. A frame that holds an entire request (IsHeader
+	and IsLast, for example a request that was buffered with ResendWhenBodyIsDone) has no ordering constraints,
+	so a worker whose queue is empty will steal such frames from the back of another worker's queue.
+	Idle workers sleep on a condition variable, and are woken by Dispatch().
+
+	Dispatch() must be called from a single thread (typically the thread that calls Backend::Recv).
+	The handler is called on a worker thread, and may call Backend::Send() etc. Since the frames of different
+	streams are handled concurrently, any state that the handler shares between streams needs its own locking.
+	*/
+	class HTTPBRIDGE_API Dispatcher
+	{
+	public:
+							Dispatcher();
+							~Dispatcher();												// Destructor calls Stop()
+		void				Start(uint32_t workers, DispatchHandler handler, void* context);	// If workers is zero, use the number of CPU cores
+		void				Stop();														// Wait for all queued frames to be handled, and then join the workers
+		void				Dispatch(InFrame& frame);									// Queue the frame, leaving 'frame' reset
+		size_t				WorkerCount() const { return Workers.size(); }
+
+	private:
+		struct Worker;
+		std::vector<Worker*>	Workers;
+		DispatchHandler			Handler = nullptr;
+		void*					Context = nullptr;
+		std::atomic<bool>		Stopping;
+
+		static void			WorkerThread(Dispatcher* d, Worker* w);
+		bool				PopOwn(Worker* w, InFrame& frame);
+		bool				Steal(Worker* w, InFrame& frame);
+		void				WakeIdleWorker(Worker* except);
+		static bool			IsStealable(const InFrame& frame);
+
+		Dispatcher(const Dispatcher&) = delete;
+		Dispatcher& operator= (const Dispatcher&) = delete;
+	};
+
 	/* HTTP Response (or part of a response)
 
 	If you don't set a Content-Length header, then Backend implicitly adds a Content-Length header equal to the size
@@ -754,12 +1220,16 @@ namespace hb
 		void			AddHeader(int32_t keyLen, const char* key, int32_t valLen, const char* value);		// Add a header
 		void			AddHeader_ContentLength(uint64_t contentLength);									// Convenience method to add a Content-Length header
 		void			SetBody(const void* body, size_t len);												// Set body. Panics if called more than once.
+		void			SetBody(std::string&& body);														// Set body, taking over 'body' instead of copying it
+		void			SetBody(std::vector<uint8_t>&& body);												// Set body, taking over 'body' instead of copying it
+		void			SetBody(const void* body, size_t len, BodyDeleter deleter, void* context);			// Set body without copying it. deleter(context, body, len) is called once httpbridge is done with 'body'.
+		void			SetBodyRef(const void* body, size_t len);											// Set body without copying it. 'body' must remain valid until the response has been sent.
 		SendResult		Send();																				// Call Backend->Send(this)
 
 		int32_t			HeaderCount() const { return HeaderIndex.Size() / 2; }
 		size_t			BodyBytes() const { return BodyLength; }
 
-		// Fetch a header by name.
+		// Fetch a header by name. Header names are case-insensitive.
 		// Returns null if the header does not exist.
 		const char*		HeaderByName(const char* name, int nth = 0) const;
 		
@@ -772,27 +1242,36 @@ namespace hb
 		// Both key and val are guaranteed to be null terminated
 		void			HeaderAt(int32_t index, const char*& key, const char*& val) const;
 
-		void			FinishFlatbuffer(void*& buf, size_t& len, bool isLast);
+		void			FinishFlatbuffer(void*& buf, size_t& len, bool isLast);								// Panics if the body was set with SetBodyRef
+		void			FinishFlatbuffer(void*& buf, size_t& len, const void*& bodyRef, size_t& bodyRefLen, bool isLast); // The frame is 'buf' followed by 'bodyRef'
 		void			SerializeToHttp(void*& buf, size_t& len);											// The returned 'buf' must be freed with hb::Free()
 		void			GetBody(const void*& buf, size_t& len) const;										// Retrieve a pointer to the Body buffer, as well as it's size
 		std::string		GetBody() const;																	// Retrieve a copy of the Body buffer.
 
 	private:
-		flatbuffers::FlatBufferBuilder*		FBB = nullptr;
+		friend class Backend;
+
+		flatbuffers::FlatBufferBuilder*		FBB = nullptr;			// From the thread's ResponsePool
+		size_t								FBBCapacity = 0;
 		ByteVectorOffset					BodyOffset = 0;
 		uint32_t							BodyLength = 0;
+		const void*							BodyRef = nullptr;		// Set by SetBodyRef. The body lives here, and not inside FBB.
+		OwnedBody							Owned = {};				// Set by the SetBody overloads that take ownership. Usually the same as BodyRef.
+		uint32_t							Window = 0;				// Set by Backend::Send on the response header of a stream that uses credits, to tell the server so
 		bool								IsFlatBufferBuilt = false;
 		
 		// Our header keys and values are always null terminated. This is necessary in order
 		// to provide a consistent API between Request and Response objects.
 		Vector<uint32_t>					HeaderIndex;
 		Vector<char>						HeaderBuf;
+		Vector<uint16_t>					DefinedHeaderIDs;		// Header ids that the frame defines. Backend::Send marks them on the connection once the frame is sent.
 
+		void	FinishFlatbuffer(void*& buf, size_t& len, const void*& bodyRef, size_t& bodyRefLen, bool isLast, hb::HeaderCacheSend* cache, const std::atomic<uint64_t>* headersDefined);
 		void	Free();
-		void	CreateBuilder();
+		void	CreateBuilder(size_t bodyBytes);		// bodyBytes is the size of the body that will be copied into the frame
 		int32_t	HeaderKeyLen(int32_t i) const;
 		int32_t	HeaderValueLen(int32_t i) const;
-		void	SetBodyInternal(const void* body, size_t len, bool isFullBody);
+		void	SetBodyInternal(const void* body, size_t len, bool isFullBody, bool copy);
 	};
 }
 
@@ -17,12 +17,14 @@ enum TxFrameType {
   TxFrameType_Abort = 2,
   TxFrameType_Pause = 3,
   TxFrameType_Resume = 4,
+  TxFrameType_Hello = 5,
+  TxFrameType_WindowUpdate = 6,
   TxFrameType_MIN = TxFrameType_Header,
-  TxFrameType_MAX = TxFrameType_Resume
+  TxFrameType_MAX = TxFrameType_WindowUpdate
 };
 
 inline const char **EnumNamesTxFrameType() {
-  static const char *names[] = { "Header", "Body", "Abort", "Pause", "Resume", nullptr };
+  static const char *names[] = { "Header", "Body", "Abort", "Pause", "Resume", "Hello", "WindowUpdate", nullptr };
   return names;
 }
 
@@ -116,7 +118,8 @@ struct TxFrame FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_CHANNEL = 10,
     VT_STREAM = 12,
     VT_HEADERS = 14,
-    VT_BODY = 16
+    VT_BODY = 16,
+    VT_WINDOW = 18
   };
   TxFrameType frametype() const { return static_cast<TxFrameType>(GetField<int8_t>(VT_FRAMETYPE, 0)); }
   TxHttpVersion version() const { return static_cast<TxHttpVersion>(GetField<int8_t>(VT_VERSION, 0)); }
@@ -125,6 +128,7 @@ struct TxFrame FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   uint64_t stream() const { return GetField<uint64_t>(VT_STREAM, 0); }
   const flatbuffers::Vector<flatbuffers::Offset<TxHeaderLine>> *headers() const { return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<TxHeaderLine>> *>(VT_HEADERS); }
   const flatbuffers::Vector<uint8_t> *body() const { return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_BODY); }
+  uint32_t window() const { return GetField<uint32_t>(VT_WINDOW, 0); }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<int8_t>(verifier, VT_FRAMETYPE) &&
@@ -137,6 +141,7 @@ struct TxFrame FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            verifier.VerifyVectorOfTables(headers()) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_BODY) &&
            verifier.Verify(body()) &&
+           VerifyField<uint32_t>(verifier, VT_WINDOW) &&
            verifier.EndTable();
   }
 };
@@ -151,10 +156,11 @@ struct TxFrameBuilder {
   void add_stream(uint64_t stream) { fbb_.AddElement<uint64_t>(TxFrame::VT_STREAM, stream, 0); }
   void add_headers(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<TxHeaderLine>>> headers) { fbb_.AddOffset(TxFrame::VT_HEADERS, headers); }
   void add_body(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> body) { fbb_.AddOffset(TxFrame::VT_BODY, body); }
+  void add_window(uint32_t window) { fbb_.AddElement<uint32_t>(TxFrame::VT_WINDOW, window, 0); }
   TxFrameBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
   TxFrameBuilder &operator=(const TxFrameBuilder &);
   flatbuffers::Offset<TxFrame> Finish() {
-    auto o = flatbuffers::Offset<TxFrame>(fbb_.EndTable(start_, 7));
+    auto o = flatbuffers::Offset<TxFrame>(fbb_.EndTable(start_, 8));
     return o;
   }
 };
@@ -166,10 +172,12 @@ inline flatbuffers::Offset<TxFrame> CreateTxFrame(flatbuffers::FlatBufferBuilder
     uint64_t channel = 0,
     uint64_t stream = 0,
     flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<TxHeaderLine>>> headers = 0,
-    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> body = 0) {
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> body = 0,
+    uint32_t window = 0) {
   TxFrameBuilder builder_(_fbb);
   builder_.add_stream(stream);
   builder_.add_channel(channel);
+  builder_.add_window(window);
   builder_.add_body(body);
   builder_.add_headers(headers);
   builder_.add_flags(flags);
@@ -185,8 +193,9 @@ inline flatbuffers::Offset<TxFrame> CreateTxFrameDirect(flatbuffers::FlatBufferB
     uint64_t channel = 0,
     uint64_t stream = 0,
     const std::vector<flatbuffers::Offset<TxHeaderLine>> *headers = nullptr,
-    const std::vector<uint8_t> *body = nullptr) {
-  return CreateTxFrame(_fbb, frametype, version, flags, channel, stream, headers ? _fbb.CreateVector<flatbuffers::Offset<TxHeaderLine>>(*headers) : 0, body ? _fbb.CreateVector<uint8_t>(*body) : 0);
+    const std::vector<uint8_t> *body = nullptr,
+    uint32_t window = 0) {
+  return CreateTxFrame(_fbb, frametype, version, flags, channel, stream, headers ? _fbb.CreateVector<flatbuffers::Offset<TxHeaderLine>>(*headers) : 0, body ? _fbb.CreateVector<uint8_t>(*body) : 0, window);
 }
 
 inline const httpbridge::TxFrame *GetTxFrame(const void *buf) { return flatbuffers::GetRoot<httpbridge::TxFrame>(buf); }
@@ -44,7 +44,11 @@ int main(int argc, char** argv)
 	// Start our mini embedded HTTP/1.1 server, which forwards requests on to an httpbridge backend
 	hb::Server server;
 	SingleServer = &server;
-	server.ListenAndRun("127.0.0.1", 8080, 8081);
+	// If a path is given on the command line, then backends connect to us over a unix domain socket at that path
+	if (argc > 1)
+		server.ListenAndRun("127.0.0.1", 8080, argv[1]);
+	else
+		server.ListenAndRun("127.0.0.1", 8080, 8081);
 	
 	hb::Shutdown();
 
@@ -85,6 +85,27 @@ bool Server::ListenAndRun(const char* addr, uint16_t httpPort, uint16_t backendP
 	return true;
 }
 
+bool Server::ListenAndRun(const char* addr, uint16_t httpPort, const char* backendUnixPath)
+{
+	StopSignal = 0;
+	NextChannelID = 1;
+
+	bool httpOK = CreateSocketAndListen(HttpListenSocket, addr, httpPort);
+	bool backendOK = CreateUnixSocketAndListen(BackendListenSocket, backendUnixPath);
+	if (!(httpOK && backendOK))
+	{
+		Close();
+		return false;
+	}
+
+	fprintf(Log, "http listening on %d\n", (int) httpPort);
+	fprintf(Log, "backend listening on %s\n", backendUnixPath);
+
+	Process();
+	Close();
+	return true;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // http_parser callbacks
 
@@ -205,6 +226,50 @@ bool Server::CreateSocketAndListen(socket_t& sock, const char* addr, uint16_t po
 	return true;
 }
 
+bool Server::CreateUnixSocketAndListen(socket_t& sock, const char* path)
+{
+#ifdef HTTPBRIDGE_PLATFORM_WINDOWS
+	fprintf(Log, "unix domain sockets are not supported on Windows\n");
+	return false;
+#else
+	sockaddr_un service;
+	memset(&service, 0, sizeof(service));
+	service.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(service.sun_path))
+	{
+		fprintf(Log, "unix socket path is too long (%s)\n", path);
+		return false;
+	}
+	strcpy(service.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == InvalidSocket)
+	{
+		fprintf(Log, "socket() failed: %d\n", LastError());
+		return false;
+	}
+
+	// Remove the socket file left behind by a previous run, otherwise bind() fails with EADDRINUSE
+	unlink(path);
+
+	int err = ::bind(sock, (sockaddr*) &service, sizeof(service));
+	if (err == ErrSOCKET_ERROR)
+	{
+		fprintf(Log, "bind() on %s failed: %d\n", path, LastError());
+		return false;
+	}
+	BackendUnixPath = path;
+
+	if (listen(sock, SOMAXCONN) == ErrSOCKET_ERROR)
+	{
+		fprintf(Log, "listen() on %s failed: %d\n", path, LastError());
+		return false;
+	}
+
+	return true;
+#endif
+}
+
 void Server::AcceptHttp()
 {
 	sockaddr_in addr;
@@ -237,13 +302,15 @@ void Server::AcceptHttp()
 
 void Server::AcceptBackend()
 {
-	sockaddr_in addr;
+	sockaddr_storage addr;
 	socklen_t addr_len = sizeof(addr);
 	BackendSock = accept(BackendListenSocket, (sockaddr*) &addr, &addr_len);
 	if (BackendSock == InvalidSocket)
 		fprintf(Log, "backend accept() failed: %d\n", LastError());
 	else
 		fprintf(Log, "backend connected on socket [%d]\n", (int) BackendSock);
+	// A new connection starts with no header ids defined
+	BackendHeaders.clear();
 }
 
 void Server::Process()
@@ -426,12 +493,32 @@ void Server::HandleBackendFrame(uint32_t frameSize, const void* frameBuf)
 		for (uint32_t i = 1; i < frame->headers()->size(); i++)
 		{
 			auto header = frame->headers()->Get(i);
+			uint16_t id = header->id();
+			if (id != 0 && header->key() == nullptr)
+			{
+				// The backend has sent this line before, under the same id
+				if (id < BackendHeaders.size())
+				{
+					const std::string& line = BackendHeaders[id];
+					HttpSendBuf.Write(line.c_str(), line.size());
+					if (line.size() > 14 && EqualsNoCase(line.c_str(), "CONTENT-LENGTH", 14) && line[14] == ':')
+						haveContentLength = true;
+				}
+				continue;
+			}
+			size_t start = HttpSendBuf.Count;
 			HttpSendBuf.Write(header->key()->Data(), header->key()->size());
 			HttpSendBuf.WriteStr(": ");
 			HttpSendBuf.Write(header->value()->Data(), header->value()->size());
 			HttpSendBuf.WriteStr(CRLF);
 			if (header->key()->size() == 14 && EqualsNoCase((const char*) header->key()->Data(), "CONTENT-LENGTH", 14))
 				haveContentLength = true;
+			if (id != 0)
+			{
+				if (id >= BackendHeaders.size())
+					BackendHeaders.resize(id + 1);
+				BackendHeaders[id].assign((const char*) HttpSendBuf.Data + start, HttpSendBuf.Count - start);
+			}
 		}
 		// We must always send Content-Length, otherwise the client can't assume that we've finished
 		// transmitting until he gets a chunk or a close.
@@ -539,6 +626,11 @@ void Server::Close()
 {
 	CloseSocket(HttpListenSocket);
 	CloseSocket(BackendListenSocket);
+#ifndef HTTPBRIDGE_PLATFORM_WINDOWS
+	if (BackendUnixPath != "")
+		unlink(BackendUnixPath.c_str());
+#endif
+	BackendUnixPath = "";
 }
 
 void Server::CloseSocket(socket_t& sock)
@@ -12,6 +12,7 @@
 #else
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -92,6 +93,10 @@ public:
 	// Addr is the address to listen on, such as "127.0.0.1", or "0.0.0.0" to listen on all addresses.
 	// If we manage to listen on both ports, then this function only returns when Stop() is called
 	bool ListenAndRun(const char* addr, uint16_t httpPort, uint16_t backendPort);
+
+	// Same as above, except that the backend connects over a unix domain socket, which is created at backendUnixPath.
+	// Any existing file at backendUnixPath is deleted first. Not supported on Windows.
+	bool ListenAndRun(const char* addr, uint16_t httpPort, const char* backendUnixPath);
 	
 	void Stop()							{ StopSignal = 1;  }
 
@@ -101,6 +106,7 @@ private:
 
 	socket_t				HttpListenSocket = InvalidSocket;
 	socket_t				BackendListenSocket = InvalidSocket;
+	std::string				BackendUnixPath;				// Non-empty if BackendListenSocket is a unix domain socket
 	std::thread				AcceptThread;
 	uint64_t				NextChannelID;
 
@@ -110,8 +116,10 @@ private:
 
 	socket_t				BackendSock = InvalidSocket;	// We only support a single backend connection
 	Buffer					BackendRecvBuf;					// Buffer for receiving frames from backend
+	std::vector<std::string> BackendHeaders;				// Response header lines that the backend sends by id, indexed by id. Each is "Key: Value\r\n".
 
 	bool CreateSocketAndListen(socket_t& sock, const char* addr, uint16_t port);
+	bool CreateUnixSocketAndListen(socket_t& sock, const char* path);
 	void AcceptHttp();
 	void AcceptBackend();
 	void Process();
@@ -82,10 +82,11 @@ public:
 		{
 			if (inframe.IsLast)
 			{
-				ThreadRequestQueueLock.lock();
-				ThreadRequestQueue.push_back(inframe.Request);
-				ThreadRequestQueueLock.unlock();
+				// Dispatch() takes the frame from us, so forget about the request first
+				EndRequest(inframe);
+				Workers.Dispatch(inframe);
 			}
+			return;
 		}
 		else if (prefix_match("/garbage-stream"))
 		{
@@ -106,12 +107,23 @@ public:
 		}
 		else if (prefix_match("/echo-path"))
 		{
-			std::string path = inframe.Request->Path();
+			std::string path = inframe.Request->Path().CStr();
 			hb::Response r(inframe.Request);
 			r.AddHeader_ContentLength(path.size());
 			r.SetBody(path.c_str(), path.size());
 			r.Send();
 		}
+		else if (prefix_match("/echo-header"))
+		{
+			// Respond with the value of the header named by ?Name=, in both the body and the X-Echo header
+			const char* val = inframe.Request->HeaderByName(inframe.Request->QueryStr("Name").c_str());
+			std::string body = val != nullptr ? val : "";
+			hb::Response r(inframe.Request);
+			r.AddHeader("X-Echo", body.c_str());
+			r.AddHeader_ContentLength(body.size());
+			r.SetBody(body.c_str(), body.size());
+			r.Send();
+		}
 		else if (prefix_match("/echo"))
 		{
 			HttpEcho(inframe, lr);
@@ -129,18 +141,14 @@ public:
 
 	void StartThreads()
 	{
-		Threads.resize(NumWorkerThreads);
-		for (size_t i = 0; i < Threads.size(); i++)
-			Threads[i] = std::thread(WorkerThread, this);
+		Workers.Start(NumWorkerThreads, HandleWorkerFrame, this);
 		StreamOutThread = std::thread(StreamOutThreadFunc, this);
 	}
 
 	void WaitForThreadsToDie()
 	{
-		for (auto& t : Threads)
-			t.join();
+		Workers.Stop();
 		StreamOutThread.join();
-		Threads.clear();
 	}
 
 private:
@@ -151,9 +159,7 @@ private:
 		bool		NoContentLength = false;
 	};
 	std::unordered_map<RequestKey, LocalRequest*>	Requests;
-	std::vector<std::thread>						Threads;
-	std::vector<hb::RequestPtr>						ThreadRequestQueue;
-	std::mutex										ThreadRequestQueueLock;
+	hb::Dispatcher									Workers;
 	
 	struct StreamOut
 	{
@@ -208,7 +214,7 @@ private:
 		Requests.erase(key);
 	}
 
-	static void SendResponseInChunks(hb::ConstRequestPtr request, hb::StatusCode status, const void* body, size_t bodyLen, size_t maxBodyChunkSize, bool sendContentLength)
+	void SendResponseInChunks(hb::ConstRequestPtr request, hb::StatusCode status, const void* body, size_t bodyLen, size_t maxBodyChunkSize, bool sendContentLength)
 	{
 		hb::Response head(request, status);
 		if (sendContentLength)
@@ -236,8 +242,12 @@ private:
 				printf("Stream aborted\n");
 				break;
 			}
-			else if (request->State() == hb::StreamState::Paused)
+			else if (request->State() == hb::StreamState::Paused && !request->Backend->HoldWhilePaused)
 			{
+				// When the backend has several connections, we can read /stop before the ABORT for this stream,
+				// which arrives on another connection, so don't wait for a RESUME that will never come.
+				if (Stop)
+					break;
 				hb::SleepNano(20 * 1000 * 1000); // 20 ms
 			}
 			else
@@ -249,6 +259,8 @@ private:
 				res = request->Backend->SendBodyPart(request, (uint8_t*) body + bodyPos, chunk, isFinal);
 				if (res == hb::SendResult_All)
 					bodyPos += chunk;
+				else if (res == hb::SendResult_BufferFull)
+					hb::SleepNano(1000 * 1000);			// HoldWhilePaused is holding as much as it may
 				else if (res == hb::SendResult_Closed)
 					printf("Backend closed\n");			// We should stress this path in tests
 				else
@@ -352,65 +364,28 @@ private:
 		free(buf);
 	}
 
-	static void WorkerThread(Server* server)
+	// Runs on one of our Dispatcher's worker threads
+	static void HandleWorkerFrame(void* context, hb::InFrame& inframe)
 	{
-		int backoffMicroSeconds = 0;
-		unsigned int tick = 0;
-		while (!server->Stop)
+		auto server = (Server*) context;
+		auto req = inframe.Request;
+		if (req->Path() == "/echo-thread")
 		{
-			tick++;
-			hb::RequestPtr req = nullptr;
-			server->ThreadRequestQueueLock.lock();
-			if (server->ThreadRequestQueue.size() != 0)
-			{
-				req = server->ThreadRequestQueue.back();
-				server->ThreadRequestQueue.pop_back();
-			}
-			server->ThreadRequestQueueLock.unlock();
+			size_t chunkSize = 0;
+			if (req->Query("MaxTransmitBodyChunkSize") != nullptr)
+				chunkSize = (size_t) req->QueryInt64("MaxTransmitBodyChunkSize");
+			bool noContentLength = req->QueryInt64("NoContentLength") == 1;
 
-			if (req != nullptr)
+			if (chunkSize == 0)
 			{
-				if (req->Path() == "/echo-thread")
-				{
-					size_t chunkSize = 0;
-					if (req->Query("MaxTransmitBodyChunkSize") != nullptr)
-						chunkSize = (size_t) req->QueryInt64("MaxTransmitBodyChunkSize");
-					bool noContentLength = req->QueryInt64("NoContentLength") == 1;
-
-					if (chunkSize == 0)
-					{
-						// send response as single frame
-						hb::Response resp(req);
-						resp.SetBody(req->BodyBuffer.Data, req->BodyBuffer.Count);
-						resp.Send();
-					}
-					else
-					{
-						SendResponseInChunks(req, hb::Status200_OK, req->BodyBuffer.Data, req->BodyBuffer.Count, chunkSize, !noContentLength);
-					}
-				}
-				else if (req->Path() == "/garbage-stream")
-				{
-					char buf[8192];
-					size_t qsize = (size_t) req->QueryInt64("Size");
-					hb::Response head(req);
-					head.AddHeader_ContentLength(qsize);
-					head.Send();
-					size_t remain = qsize;
-					while (remain != 0)
-					{
-						size_t chunk = std::min((size_t) 8192, remain);
-						hb::Response::MakeBodyPart(req, buf, chunk, false).Send();
-						remain -= chunk;
-					}
-				}
+				// send response as single frame
+				hb::Response resp(req);
+				resp.SetBody(req->BodyBuffer.Data, req->BodyBuffer.Count);
+				resp.Send();
 			}
 			else
 			{
-				backoffMicroSeconds = 1 + backoffMicroSeconds * 2;
-				if (backoffMicroSeconds > 1000)
-					backoffMicroSeconds = 1000;
-				hb::SleepNano(backoffMicroSeconds * 1000);
+				server->SendResponseInChunks(req, hb::Status200_OK, req->BodyBuffer.Data, req->BodyBuffer.Count, chunkSize, !noContentLength);
 			}
 		}
 	}
@@ -420,28 +395,48 @@ private:
 
 int main(int argc, char** argv)
 {
+	// Usage: test-backend [network address [connections [async] [hold] [window]]]. The Go test suite passes these when run with
+	// -backend_network, -backend_connections, -backend_async_send, -backend_hold_while_paused, or -backend_use_stream_window
+	const char* network = argc > 2 ? argv[1] : "tcp";
+	const char* addr = argc > 2 ? argv[2] : "127.0.0.1:8081";
+	int connections = argc > 3 ? atoi(argv[3]) : 1;
+	bool asyncSend = false;
+	bool holdWhilePaused = false;
+	bool useStreamWindow = false;
+	for (int i = 4; i < argc; i++)
+	{
+		asyncSend = asyncSend || strcmp(argv[i], "async") == 0;
+		holdWhilePaused = holdWhilePaused || strcmp(argv[i], "hold") == 0;
+		useStreamWindow = useStreamWindow || strcmp(argv[i], "window") == 0;
+	}
+
 	hb::Startup();
 	
 	hb::Logger stdlog;
 	hb::Backend backend;
 	backend.Log = &stdlog;
+	backend.Connections = connections;
+	backend.AsyncSend = asyncSend;
+	backend.HoldWhilePaused = holdWhilePaused;
+	backend.UseStreamWindow = useStreamWindow;
 	Server server;
 	server.Backend = &backend;
 	server.StartThreads();
 
+	hb::InFrame inframes[16];
 	while (!server.Stop)
 	{
 		if (!backend.IsConnected())
 		{
-			if (!backend.Connect("tcp", "127.0.0.1:8081"))
+			if (!backend.Connect(network, addr))
 				hb::SleepNano(500 * 1000 * 1000);
 			else
 				printf("Connected\n");
 		}
 
-		hb::InFrame inframe;
-		if (backend.Recv(inframe))
-			server.HandleFrame(inframe);
+		size_t n = backend.RecvMany(inframes, 16);
+		for (size_t i = 0; i < n; i++)
+			server.HandleFrame(inframes[i]);
 	}
 
 	server.WaitForThreadsToDie();
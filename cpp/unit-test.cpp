@@ -1,7 +1,22 @@
 // This tests isolated pieces of code that don't need interaction with a real HTTP server.
 #define _CRT_SECURE_NO_WARNINGS
 #include "http-bridge.h"
+#include "http-bridge_generated.h"
 #include <stdio.h>
+#include <thread>
+#include <chrono>
+#include <string>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <set>
+#include <mutex>
+#endif
 
 #ifdef assert
 #undef assert
@@ -224,6 +239,64 @@ void TestRequestQuerySplitter()
 	}
 }
 
+void TestRequestLazyURI()
+{
+	{
+		// Nobody calls ParseURI, and several threads race to be the first to decode the URI
+		hb::Backend back;
+		hb::Request r;
+		SetupRequest(r, back, "/a%20b?x=1&y=%41");
+		std::atomic<int> ok(0);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < 4; i++)
+		{
+			threads.push_back(std::thread([&]() {
+				if (r.Path() == "/a b" && r.QueryStr("y") == "A" && r.QueryInt64("x") == 1)
+					ok++;
+			}));
+		}
+		for (auto& t : threads)
+			t.join();
+		assert(ok == 4);
+	}
+	{
+		// IsURIValid doesn't need the URI to be decoded, and a URI that is too long decodes as empty
+		std::string uri = "/" + std::string(65535, 'a');
+		hb::Backend back;
+		hb::Request r;
+		SetupRequest(r, back, uri.c_str());
+		assert(!r.IsURIValid());
+		assert(r.Path() == "");
+		const char *key, *val;
+		assert(r.NextQuery(0, key, val) == 0);
+	}
+}
+
+void TestRequestHeaderIndex()
+{
+	static_assert(hb::HeaderKey_Cookie.Slot != -1 && hb::HeaderKey("X-Custom").Slot == -1, "Well-known slots are resolved at compile time");
+
+	// More headers than MaxIndexedHeaders, and two headers whose names differ only by case
+	std::unordered_map<std::string, std::string> headers;
+	for (int i = 0; i < 40; i++)
+		headers["X-Header-" + std::to_string(i)] = std::to_string(i);
+	headers["content-type"] = "text/plain";
+	headers["Cookie"] = "a";
+	headers["COOKIE"] = "b";
+	auto r = hb::Request::CreateMocked("GET", "/", headers);
+
+	for (int i = 0; i < 40; i++)
+		assert(r->HeaderByName(("x-header-" + std::to_string(i)).c_str()) == std::to_string(i));
+	assert(streq(r->HeaderByName(hb::HeaderKey_Content_Type), "text/plain"));
+	assert(streq(r->HeaderByName("Content-Type"), "text/plain"));
+	assert(r->HeaderByName("Content") == nullptr);
+	assert(r->HeaderByName(hb::HeaderKey_Authorization) == nullptr);
+
+	std::string cookies = std::string(r->HeaderByName(hb::HeaderKey_Cookie, 0)) + r->HeaderByName("cookie", 1);
+	assert(cookies == "ab" || cookies == "ba");
+	assert(r->HeaderByName(hb::HeaderKey_Cookie, 2) == nullptr);
+}
+
 void TestResponseMisc()
 {
 	hb::Response r;
@@ -250,6 +323,77 @@ void TestResponseMisc()
 	assert(valLen == 0);
 	assert(r.HeaderByName("a") == nullptr);
 	assert(!r.HasHeader("a"));
+	assert(streq(r.HeaderByName("ABC"), "1234"));
+}
+
+// A body from SetBodyRef is sent after the flatbuffer, instead of inside it. The concatenated frame must decode exactly
+// like a regular frame, because the Go server reads it with the ordinary flatbuffer accessors.
+void TestResponseBodyRef()
+{
+	for (size_t bodyLen : {0, 1, 3, 4, 7, 1000})
+	{
+		std::string body;
+		for (size_t i = 0; i < bodyLen; i++)
+			body += (char) ('a' + i % 26);
+
+		hb::Response r(nullptr, hb::HttpVersion11, 5, 6, hb::Status200_OK);
+		r.AddHeader("Content-Type", "text/plain");
+		r.SetBodyRef(body.c_str(), body.size());
+		assert(r.GetBody() == body);
+
+		void* buf = nullptr;
+		size_t len = 0;
+		const void* ref = nullptr;
+		size_t refLen = 0;
+		r.FinishFlatbuffer(buf, len, ref, refLen, true);
+		assert(refLen == bodyLen);
+		assert(bodyLen == 0 || ref == body.c_str());
+
+		std::string frame((const char*) buf, len);
+		frame.append((const char*) ref, refLen);
+		assert(hb::Read32LE(&frame[0]) == hb::MagicFrameMarker);
+		assert(hb::Read32LE(&frame[4]) == frame.size() - 8);
+
+		auto tx = httpbridge::GetTxFrame(&frame[8]);
+		assert(tx->channel() == 5 && tx->stream() == 6);
+		assert(tx->flags() == httpbridge::TxFrameFlags_Final);
+		assert(tx->headers()->size() == 2);
+		assert(tx->headers()->Get(1)->key()->size() == 12);
+		assert(tx->body()->size() == bodyLen);
+		assert(memcmp(tx->body()->Data(), body.c_str(), bodyLen) == 0);
+	}
+}
+
+void TestBodyPartFrame()
+{
+	for (size_t bodyLen : {0, 1, 3, 1000})
+	{
+		for (bool isFinal : {false, true})
+		{
+			std::string body;
+			for (size_t i = 0; i < bodyLen; i++)
+				body += (char) ('a' + i % 26);
+
+			uint64_t channel = 0x123456789abcdef0ull;
+			uint64_t stream = 7;
+			std::string frame(hb::BodyPartFrameHeaderSize, 0);
+			hb::EncodeBodyPartFrame((uint8_t*) &frame[0], hb::HttpVersion11, channel, stream, bodyLen, isFinal);
+			frame += body;
+			assert(hb::Read32LE(&frame[0]) == hb::MagicFrameMarker);
+			assert(hb::Read32LE(&frame[4]) == frame.size() - 8);
+
+			flatbuffers::Verifier verifier((const uint8_t*) &frame[8], frame.size() - 8);
+			assert(httpbridge::VerifyTxFrameBuffer(verifier));
+			auto tx = httpbridge::GetTxFrame(&frame[8]);
+			assert(tx->frametype() == httpbridge::TxFrameType_Body);
+			assert(tx->version() == httpbridge::TxHttpVersion_Http11);
+			assert(tx->flags() == (isFinal ? httpbridge::TxFrameFlags_Final : 0));
+			assert(tx->channel() == channel && tx->stream() == stream);
+			assert(tx->headers() == nullptr);
+			assert(tx->body()->size() == bodyLen);
+			assert(memcmp(tx->body()->Data(), body.c_str(), bodyLen) == 0);
+		}
+	}
 }
 
 void TestUtilFunctions()
@@ -282,12 +426,1306 @@ void TestMockedRequest()
 	assert(memcmp(r->BodyBuffer.Data, "boddy", 5) == 0);
 }
 
+#ifdef __linux__
+static int64_t MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Listen on a loopback port chosen by the OS
+static int ListenLoopback(char* addr, size_t addrSize)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(sa);
+	assert(bind(s, (sockaddr*) &sa, sizeof(sa)) == 0);
+	assert(listen(s, 8) == 0);
+	assert(getsockname(s, (sockaddr*) &sa, &len) == 0);
+	snprintf(addr, addrSize, "127.0.0.1:%d", (int) ntohs(sa.sin_port));
+	return s;
+}
+
+static void AppendFrame(std::vector<uint8_t>& out, flatbuffers::FlatBufferBuilder& fbb)
+{
+	uint8_t head[8];
+	hb::Write32LE(head, hb::MagicFrameMarker);
+	hb::Write32LE(head + 4, fbb.GetSize());
+	out.insert(out.end(), head, head + 8);
+	out.insert(out.end(), fbb.GetBufferPointer(), fbb.GetBufferPointer() + fbb.GetSize());
+}
+
+// Append a GET request frame to 'out'. If body is not empty, then the whole body is included in the frame.
+// If contentLength is not zero, then the body follows in body frames. 'window' is the response window that the server grants.
+static void AppendRequestFrame(std::vector<uint8_t>& out, uint64_t channel, const std::string& body = "", uint64_t contentLength = 0, uint32_t window = 0)
+{
+	flatbuffers::FlatBufferBuilder fbb;
+	std::vector<flatbuffers::Offset<httpbridge::TxHeaderLine>> lines;
+	auto key = fbb.CreateVector((const uint8_t*) "GET", 3);
+	auto val = fbb.CreateVector((const uint8_t*) "/", 1);
+	lines.push_back(httpbridge::CreateTxHeaderLine(fbb, key, val));
+	flatbuffers::Offset<flatbuffers::Vector<uint8_t>> bodyVec = 0;
+	if (body.size() != 0 || contentLength != 0)
+	{
+		std::string len = std::to_string(contentLength != 0 ? contentLength : body.size());
+		key = fbb.CreateVector((const uint8_t*) "Content-Length", 14);
+		val = fbb.CreateVector((const uint8_t*) len.c_str(), len.size());
+		lines.push_back(httpbridge::CreateTxHeaderLine(fbb, key, val));
+	}
+	if (body.size() != 0)
+		bodyVec = fbb.CreateVector((const uint8_t*) body.c_str(), body.size());
+	uint8_t flags = contentLength != 0 ? 0 : httpbridge::TxFrameFlags_Final;
+	auto root = httpbridge::CreateTxFrame(fbb, httpbridge::TxFrameType_Header, httpbridge::TxHttpVersion_Http11, flags, channel, 1, fbb.CreateVector(lines), bodyVec, window);
+	httpbridge::FinishTxFrameBuffer(fbb, root);
+	AppendFrame(out, fbb);
+}
+
+static void AppendBodyFrame(std::vector<uint8_t>& out, uint64_t channel, const std::string& body, bool isFinal)
+{
+	flatbuffers::FlatBufferBuilder fbb;
+	auto bodyVec = fbb.CreateVector((const uint8_t*) body.c_str(), body.size());
+	auto root = httpbridge::CreateTxFrame(fbb, httpbridge::TxFrameType_Body, httpbridge::TxHttpVersion_Http11, isFinal ? httpbridge::TxFrameFlags_Final : 0, channel, 1, 0, bodyVec);
+	httpbridge::FinishTxFrameBuffer(fbb, root);
+	AppendFrame(out, fbb);
+}
+
+static void SendAll(int sock, const std::vector<uint8_t>& buf)
+{
+	for (size_t sent = 0; sent != buf.size(); )
+	{
+		ssize_t n = send(sock, &buf[sent], buf.size() - sent, 0);
+		assert(n > 0);
+		sent += n;
+	}
+}
+
+static void SendRequestFrame(int sock, uint64_t channel, uint32_t window = 0)
+{
+	std::vector<uint8_t> buf;
+	AppendRequestFrame(buf, channel, "", 0, window);
+	SendAll(sock, buf);
+}
+
+static void SendControlFrame(int sock, httpbridge::TxFrameType type, uint64_t channel, uint32_t window = 0)
+{
+	flatbuffers::FlatBufferBuilder fbb;
+	auto root = httpbridge::CreateTxFrame(fbb, type, httpbridge::TxHttpVersion_Http11, 0, channel, 1, 0, 0, window);
+	httpbridge::FinishTxFrameBuffer(fbb, root);
+	uint8_t head[8];
+	hb::Write32LE(head, hb::MagicFrameMarker);
+	hb::Write32LE(head + 4, fbb.GetSize());
+	assert(send(sock, head, 8, 0) == 8);
+	assert(send(sock, fbb.GetBufferPointer(), fbb.GetSize(), 0) == (ssize_t) fbb.GetSize());
+}
+
+// Read one whole frame, and return the TxFrame inside it
+static const httpbridge::TxFrame* RecvFrame(int sock, std::vector<uint8_t>& buf)
+{
+	uint8_t head[8];
+	assert(recv(sock, head, 8, MSG_WAITALL) == 8);
+	assert(hb::Read32LE(head) == hb::MagicFrameMarker);
+	buf.resize(hb::Read32LE(head + 4));
+	assert(recv(sock, &buf[0], buf.size(), MSG_WAITALL) == (ssize_t) buf.size());
+	return httpbridge::GetTxFrame(&buf[0]);
+}
+
+static std::string HeaderValue(const httpbridge::TxFrame* frame, const char* key)
+{
+	for (auto line : *frame->headers())
+	{
+		if (line->key() != nullptr && line->key()->size() == strlen(key) && memcmp(line->key()->Data(), key, strlen(key)) == 0)
+			return std::string((const char*) line->value()->Data(), line->value()->size());
+	}
+	return "";
+}
+#endif
+
+void TestBackendWakeup()
+{
+#ifdef __linux__
+	hb::Backend backend;
+	assert(backend.PollFd() != -1);
+
+	// Without a wakeup, Wait times out
+	assert(!backend.Wait(10));
+
+	// A wakeup that arrives before Wait is not lost
+	auto start = std::chrono::steady_clock::now();
+	backend.Wakeup();
+	assert(!backend.Wait(5000));
+	assert(MillisecondsSince(start) < 1000);
+
+	// Wakeup from another thread interrupts Wait
+	start = std::chrono::steady_clock::now();
+	std::thread waker([&backend] {
+		hb::SleepNano(20 * 1000 * 1000);
+		backend.Wakeup();
+	});
+	assert(!backend.Wait(5000));
+	assert(MillisecondsSince(start) < 1000);
+	waker.join();
+
+	// The wakeup has been consumed
+	assert(!backend.Wait(10));
+	pollfd pfd = {backend.PollFd(), POLLIN, 0};
+	assert(poll(&pfd, 1, 0) == 0);
+#endif
+}
+
+// Destroying an io_uring transport must not leave the kernel receiving into its freed chunks
+void TestUringTeardown()
+{
+#if defined(__linux__) && defined(HTTPBRIDGE_IO_URING)
+	for (int i = 0; i < 20; i++)
+	{
+		char addr[100];
+		int listener = ListenLoopback(addr, sizeof(addr));
+		hb::Backend backend;
+		if (!backend.Connect("uring", addr))
+		{
+			// io_uring is not available here
+			close(listener);
+			return;
+		}
+		int server = accept(listener, nullptr, nullptr);
+		assert(server != -1);
+
+		// Keep data arriving while the transport is destroyed
+		std::thread sender([server] {
+			char buf[4096] = {0};
+			while (send(server, buf, sizeof(buf), MSG_NOSIGNAL) > 0) {}
+		});
+		hb::SleepNano(i * 100 * 1000);
+		backend.Close();
+
+		// The socket was shut down, so the sender stops
+		sender.join();
+		char b;
+		assert(recv(server, &b, 1, 0) == 0);
+		close(server);
+		close(listener);
+	}
+#endif
+}
+
+void TestBackendNonBlocking()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+
+	hb::Backend backend;
+	backend.NonBlocking = true;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	// Nothing to read, so Recv must return immediately, and PollFd must not be readable
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	assert(!backend.Recv(frame));
+	assert(MillisecondsSince(start) < 100);
+	pollfd pfd = {backend.PollFd(), POLLIN, 0};
+	assert(poll(&pfd, 1, 0) == 0);
+
+	// When PollFd becomes readable, calling Recv until it returns false must drain all the frames
+	SendRequestFrame(server, 1);
+	SendRequestFrame(server, 2);
+	uint64_t next = 1;
+	while (next <= 2)
+	{
+		assert(poll(&pfd, 1, 5000) == 1);
+		while (backend.Recv(frame))
+		{
+			assert(frame.IsHeader && frame.IsLast && frame.Request->Channel == next);
+			hb::Response response(frame.Request);
+			assert(response.Send() == hb::SendResult_All);
+			next++;
+		}
+	}
+	assert(poll(&pfd, 1, 0) == 0);
+
+	close(server);
+	close(listener);
+#endif
+}
+
+void TestBackendStriping()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+
+	const int nconn = 3;
+	hb::Backend backend;
+	backend.Connections = nconn;
+	assert(backend.Connect("tcp", addr));
+
+	// Every connection starts with a Hello frame, which tells the server which connections belong together
+	int servers[nconn];
+	std::string token;
+	std::vector<uint8_t> buf;
+	for (int i = 0; i < nconn; i++)
+	{
+		int s = accept(listener, nullptr, nullptr);
+		assert(s != -1);
+		auto hello = RecvFrame(s, buf);
+		assert(hello->frametype() == httpbridge::TxFrameType_Hello);
+		assert(HeaderValue(hello, "Connections") == "3");
+		if (i == 0)
+			token = HeaderValue(hello, "Backend");
+		assert(token.size() != 0 && HeaderValue(hello, "Backend") == token);
+		int index = atoi(HeaderValue(hello, "Connection").c_str());
+		assert(index >= 0 && index < nconn);
+		servers[index] = s;
+	}
+
+	// Requests may arrive on any connection, and the response to each one comes back on exactly one connection
+	const uint64_t nreq = 12;
+	for (uint64_t channel = 1; channel <= nreq; channel++)
+		SendRequestFrame(servers[channel % nconn], channel);
+	uint64_t received = 0;
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (received < nreq && MillisecondsSince(start) < 5000)
+	{
+		if (backend.Recv(frame))
+		{
+			hb::Response response(frame.Request);
+			assert(response.Send() == hb::SendResult_All);
+			received++;
+		}
+	}
+	assert(received == nreq);
+
+	uint64_t seen = 0;
+	uint64_t perConnection[nconn] = {0};
+	for (uint64_t i = 0; i < nreq; i++)
+	{
+		pollfd pfd[nconn];
+		for (int j = 0; j < nconn; j++)
+			pfd[j] = {servers[j], POLLIN, 0};
+		assert(poll(pfd, nconn, 5000) > 0);
+		int j = 0;
+		while (pfd[j].revents == 0)
+			j++;
+		auto response = RecvFrame(servers[j], buf);
+		assert(response->frametype() == httpbridge::TxFrameType_Header && response->channel() >= 1 && response->channel() <= nreq);
+		assert((seen & (1ull << response->channel())) == 0);
+		seen |= 1ull << response->channel();
+		perConnection[j]++;
+	}
+	// The streams are spread over the connections, and not all sent down one of them
+	assert(perConnection[0] != nreq && perConnection[1] != nreq && perConnection[2] != nreq);
+
+	// Losing any one connection closes the whole backend
+	close(servers[1]);
+	start = std::chrono::steady_clock::now();
+	while (backend.IsConnected() && MillisecondsSince(start) < 5000)
+		backend.Recv(frame);
+	assert(!backend.IsConnected());
+
+	close(servers[0]);
+	close(servers[2]);
+	close(listener);
+#endif
+}
+
+#ifdef __linux__
+static std::atomic<int> AsyncSendErrors;
+
+static void CountAsyncSendError(hb::Backend*, uint64_t, uint64_t)
+{
+	AsyncSendErrors++;
+}
+#endif
+
+void TestBackendAsyncSend()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+
+	// The writer thread will send to a closed socket
+	signal(SIGPIPE, SIG_IGN);
+
+	hb::Backend backend;
+	backend.AsyncSend = true;
+	backend.AsyncSendError = CountAsyncSendError;
+	backend.CoalesceMicroseconds = 50;
+	AsyncSendErrors = 0;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	// One more request than we have workers, which we use to test failure
+	const uint64_t nworkers = 16;
+	const uint64_t nreq = nworkers + 1;
+	for (uint64_t channel = 1; channel <= nreq; channel++)
+		SendRequestFrame(server, channel);
+	std::vector<hb::RequestPtr> requests;
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (requests.size() < nreq && MillisecondsSince(start) < 5000)
+	{
+		if (backend.Recv(frame))
+			requests.push_back(frame.Request);
+	}
+	assert(requests.size() == nreq);
+
+	// Many threads send at once. Each response is a header, followed by numbered body parts.
+	const uint32_t nparts = 50;
+	std::vector<std::thread> workers;
+	for (uint64_t i = 0; i < nworkers; i++)
+	{
+		workers.push_back(std::thread([&requests, i, nparts]() {
+			hb::Response response(requests[i]);
+			response.AddHeader_ContentLength(nparts * sizeof(uint32_t));
+			assert(response.Send() == hb::SendResult_All);
+			for (uint32_t part = 0; part < nparts; part++)
+				assert(requests[i]->Backend->SendBodyPart(requests[i], &part, sizeof(part), part == nparts - 1) == hb::SendResult_All);
+		}));
+	}
+
+	// Every frame arrives, and the frames of each stream are in order
+	std::vector<uint32_t> nextPart(nreq + 1, 0);
+	std::vector<uint8_t> buf;
+	for (uint64_t i = 0; i < nworkers * (nparts + 1); i++)
+	{
+		auto f = RecvFrame(server, buf);
+		uint64_t channel = f->channel();
+		assert(channel >= 1 && channel <= nworkers);
+		if (f->frametype() == httpbridge::TxFrameType_Header)
+		{
+			assert(nextPart[channel] == 0);
+			nextPart[channel] = 1;
+			continue;
+		}
+		uint32_t part;
+		assert(f->frametype() == httpbridge::TxFrameType_Body && f->body()->size() == sizeof(part));
+		memcpy(&part, f->body()->Data(), sizeof(part));
+		assert(part + 1 == nextPart[channel]);
+		assert(((f->flags() & httpbridge::TxFrameFlags_Final) != 0) == (part == nparts - 1));
+		nextPart[channel]++;
+	}
+	for (auto& w : workers)
+		w.join();
+	assert(AsyncSendErrors == 0);
+
+	// Once the server is gone, the writer fails, and Send() stops accepting frames
+	hb::RequestPtr last = requests[nreq - 1];
+	hb::Response response(last);
+	response.AddHeader_ContentLength(-1);
+	assert(response.Send() == hb::SendResult_All);
+	close(server);
+	char chunk[1000] = {0};
+	start = std::chrono::steady_clock::now();
+	while (backend.SendBodyPart(last, chunk, sizeof(chunk), false) == hb::SendResult_All && MillisecondsSince(start) < 5000)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	assert(backend.SendBodyPart(last, chunk, sizeof(chunk), false) == hb::SendResult_Closed);
+	assert(AsyncSendErrors != 0);
+
+	backend.Close();
+	close(listener);
+#endif
+}
+
+// With AsyncSend, a server that stops reading holds back the sender once MaxQueuedBytes are queued
+void TestBackendAsyncSendLimit()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	backend.AsyncSend = true;
+	backend.MaxQueuedBytes = 64 * 1024;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	SendRequestFrame(server, 1);
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (!backend.Recv(frame) && MillisecondsSince(start) < 5000) {}
+	hb::RequestPtr request = frame.Request;
+	assert(request != nullptr);
+
+	const size_t total = 256 * 1024 * 1024;
+	std::atomic<size_t> sent(0);
+	std::thread worker([&request, &sent, total]() {
+		hb::Response response(request);
+		response.AddHeader_ContentLength(total);
+		assert(response.Send() == hb::SendResult_All);
+		static char chunk[64 * 1024];
+		for (size_t pos = 0; pos < total; pos += sizeof(chunk))
+		{
+			assert(request->Backend->SendBodyPart(request, chunk, sizeof(chunk), pos + sizeof(chunk) == total) == hb::SendResult_All);
+			sent += sizeof(chunk);
+		}
+	});
+
+	// Once the socket buffers are full, the worker stops
+	size_t before = 0;
+	start = std::chrono::steady_clock::now();
+	while (MillisecondsSince(start) < 5000)
+	{
+		before = sent;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		if (sent == before)
+			break;
+	}
+	assert(sent == before && sent < total);
+
+	// When the server reads again, everything gets through
+	size_t received = 0;
+	char buf[64 * 1024];
+	while (received < total)
+	{
+		ssize_t n = recv(server, buf, sizeof(buf), 0);
+		assert(n > 0);
+		received += n;
+	}
+	worker.join();
+	assert(sent == total);
+
+	backend.Close();
+	close(server);
+	close(listener);
+#endif
+}
+
+// Worker threads keep sending while the server goes away, and Recv() closes the backend underneath them.
+// With AsyncSend, the frames that were still queued when the backend closed are reported to AsyncSendError.
+void TestBackendCloseWhileSending()
+{
+#ifdef __linux__
+	signal(SIGPIPE, SIG_IGN);
+	for (int async = 0; async < 2; async++)
+	{
+		AsyncSendErrors = 0;
+		for (int iter = 0; iter < 10; iter++)
+		{
+			char addr[100];
+			int listener = ListenLoopback(addr, sizeof(addr));
+			hb::Backend backend;
+			backend.Connections = 2;
+			backend.AsyncSend = async != 0;
+			backend.AsyncSendError = CountAsyncSendError;
+			assert(backend.Connect("tcp", addr));
+			int servers[2];
+			for (int i = 0; i < 2; i++)
+			{
+				servers[i] = accept(listener, nullptr, nullptr);
+				assert(servers[i] != -1);
+			}
+			// Keep reading the connection that survives, so that nobody blocks on it
+			int survivor = servers[1];
+			std::thread reader([survivor] {
+				char buf[4096];
+				while (recv(survivor, buf, sizeof(buf), 0) > 0) {}
+			});
+
+			const uint64_t nworkers = 8;
+			for (uint64_t channel = 1; channel <= nworkers; channel++)
+				SendRequestFrame(servers[0], channel);
+			std::vector<hb::RequestPtr> requests;
+			hb::InFrame frame;
+			auto start = std::chrono::steady_clock::now();
+			while (requests.size() < nworkers && MillisecondsSince(start) < 5000)
+			{
+				if (backend.Recv(frame))
+					requests.push_back(frame.Request);
+			}
+			assert(requests.size() == nworkers);
+
+			std::vector<std::thread> workers;
+			for (uint64_t i = 0; i < nworkers; i++)
+			{
+				workers.push_back(std::thread([&requests, i]() {
+					hb::Response response(requests[i]);
+					response.AddHeader_ContentLength(-1);
+					if (response.Send() != hb::SendResult_All)
+						return;
+					char chunk[100] = {0};
+					while (requests[i]->Backend->SendBodyPart(requests[i], chunk, sizeof(chunk), false) == hb::SendResult_All) {}
+				}));
+			}
+
+			hb::SleepNano(iter * 200 * 1000);
+			close(servers[0]);
+			start = std::chrono::steady_clock::now();
+			while (backend.IsConnected() && MillisecondsSince(start) < 5000)
+				backend.Recv(frame);
+			assert(!backend.IsConnected());
+
+			// Every worker sees that the backend is gone
+			for (auto& w : workers)
+				w.join();
+			reader.join();
+			close(servers[1]);
+			close(listener);
+		}
+		assert(async == 0 || AsyncSendErrors != 0);
+	}
+#endif
+}
+
+static std::atomic<int> OwnedBodiesReleased;
+
+static void ReleaseOwnedBody(void* context, const void* body, size_t)
+{
+	assert(context == body);
+	delete[] (char*) body;
+	OwnedBodiesReleased++;
+}
+
+// A body that is handed over with SetBody is sent without a copy, and released exactly once, by whichever of
+// the Response or the AsyncSend queue holds it last.
+void TestResponseOwnedBody()
+{
+	OwnedBodiesReleased = 0;
+	{
+		std::string str(1000, 's');
+		const char* data = str.data();
+		hb::Response r(nullptr, hb::HttpVersion11, 5, 6, hb::Status200_OK);
+		r.SetBody(std::move(str));
+		void* buf;
+		size_t len;
+		const void* ref = nullptr;
+		size_t refLen = 0;
+		r.FinishFlatbuffer(buf, len, ref, refLen, true);
+		assert(ref == data && refLen == 1000);
+	}
+	{
+		hb::Response r(nullptr, hb::HttpVersion11, 5, 6, hb::Status200_OK);
+		r.SetBody(std::vector<uint8_t>(10, 'v'));
+		assert(r.GetBody() == std::string(10, 'v'));
+	}
+	{
+		char* body = new char[100];
+		hb::Response a(nullptr, hb::HttpVersion11, 5, 6, hb::Status200_OK);
+		a.SetBody(body, 100, ReleaseOwnedBody, body);
+		hb::Response b = std::move(a);
+		assert(OwnedBodiesReleased == 0);
+	}
+	assert(OwnedBodiesReleased == 1);
+
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	backend.AsyncSend = true;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+	SendRequestFrame(server, 1);
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (!backend.Recv(frame) && MillisecondsSince(start) < 5000) {}
+	assert(frame.Request != nullptr);
+
+	const size_t bodyLen = 100000;
+	char* body = new char[bodyLen];
+	for (size_t i = 0; i < bodyLen; i++)
+		body[i] = (char) i;
+	{
+		hb::Response r(frame.Request);
+		r.SetBody(body, bodyLen, ReleaseOwnedBody, body);
+		assert(r.Send() == hb::SendResult_All);
+	}
+	std::vector<uint8_t> buf;
+	auto f = RecvFrame(server, buf);
+	assert(f->body()->size() == bodyLen);
+	for (size_t i = 0; i < bodyLen; i++)
+		assert(f->body()->Data()[i] == (uint8_t) i);
+	start = std::chrono::steady_clock::now();
+	while (OwnedBodiesReleased != 2 && MillisecondsSince(start) < 5000)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	assert(OwnedBodiesReleased == 2);
+
+	backend.Close();
+	close(server);
+	close(listener);
+#endif
+}
+
+#ifdef __linux__
+static std::atomic<int> HighWaterCalls;
+
+static void CountHighWater(hb::Backend*, uint64_t, uint64_t, size_t)
+{
+	HighWaterCalls++;
+}
+
+static hb::FrameType RecvControlFrame(hb::Backend& backend)
+{
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (!backend.Recv(frame) && MillisecondsSince(start) < 5000) {}
+	return frame.Type;
+}
+#endif
+
+// With HoldWhilePaused, frames that are sent to a paused stream go out when the stream is resumed, in order
+void TestBackendHoldWhilePaused()
+{
+#ifdef __linux__
+	for (bool asyncSend : {false, true})
+	{
+		char addr[100];
+		int listener = ListenLoopback(addr, sizeof(addr));
+		hb::Backend backend;
+		backend.AsyncSend = asyncSend;
+		backend.HoldWhilePaused = true;
+		backend.HeldHighWater = CountHighWater;
+		backend.HeldHighWaterBytes = 1000;
+		HighWaterCalls = 0;
+		assert(backend.Connect("tcp", addr));
+		int server = accept(listener, nullptr, nullptr);
+		assert(server != -1);
+		SendRequestFrame(server, 1);
+		SendRequestFrame(server, 2);
+		std::vector<hb::RequestPtr> requests;
+		hb::InFrame frame;
+		auto start = std::chrono::steady_clock::now();
+		while (requests.size() < 2 && MillisecondsSince(start) < 5000)
+		{
+			if (backend.Recv(frame))
+				requests.push_back(frame.Request);
+		}
+		assert(requests.size() == 2);
+
+		const uint32_t nparts = 20;
+		hb::Response head(requests[0]);
+		head.AddHeader_ContentLength(nparts * sizeof(uint32_t) * 25);
+		assert(head.Send() == hb::SendResult_All);
+		std::vector<uint8_t> buf;
+		assert(RecvFrame(server, buf)->frametype() == httpbridge::TxFrameType_Header);
+
+		SendControlFrame(server, httpbridge::TxFrameType_Pause, 1);
+		assert(RecvControlFrame(backend) == hb::FrameType::Pause);
+		uint32_t part[25];
+		for (uint32_t i = 0; i < nparts; i++)
+		{
+			for (auto& p : part)
+				p = i;
+			if (i == nparts - 1)
+			{
+				// Beyond the memory cap, a send is refused, and can be retried
+				backend.MaxHeldBytesTotal = 0;
+				assert(backend.SendBodyPart(requests[0], part, sizeof(part), false) == hb::SendResult_BufferFull);
+				backend.MaxHeldBytesTotal = 1024 * 1024;
+			}
+			assert(backend.SendBodyPart(requests[0], part, sizeof(part), false) == hb::SendResult_All);
+		}
+		pollfd pfd = {server, POLLIN, 0};
+		assert(poll(&pfd, 1, 50) == 0);
+		assert(HighWaterCalls == 1);
+
+		// A held frame of an aborted stream is dropped
+		hb::Response head2(requests[1]);
+		head2.AddHeader_ContentLength(100);
+		assert(head2.Send() == hb::SendResult_All);
+		assert(RecvFrame(server, buf)->channel() == 2);
+		SendControlFrame(server, httpbridge::TxFrameType_Pause, 2);
+		assert(RecvControlFrame(backend) == hb::FrameType::Pause);
+		assert(backend.SendBodyPart(requests[1], part, 50, false) == hb::SendResult_All);
+		SendControlFrame(server, httpbridge::TxFrameType_Abort, 2);
+		assert(RecvControlFrame(backend) == hb::FrameType::Abort);
+
+		SendControlFrame(server, httpbridge::TxFrameType_Resume, 1);
+		assert(RecvControlFrame(backend) == hb::FrameType::Resume);
+		for (uint32_t i = 0; i < nparts; i++)
+		{
+			auto f = RecvFrame(server, buf);
+			assert(f->channel() == 1 && f->frametype() == httpbridge::TxFrameType_Body && f->body()->size() == sizeof(part));
+			memcpy(part, f->body()->Data(), sizeof(part));
+			assert(part[0] == i);
+			assert(((f->flags() & httpbridge::TxFrameFlags_Final) != 0) == (i == nparts - 1));
+		}
+		assert(poll(&pfd, 1, 50) == 0);
+
+		// The last frame finished the stream
+		assert(backend.SendBodyPart(requests[0], part, 1, false) == hb::SendResult_Closed);
+
+		backend.Close();
+		close(server);
+		close(listener);
+	}
+#endif
+}
+
+// A stream that the server gives a window pauses itself once the window is used up, and WindowUpdate resumes it
+void TestBackendWindow()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	backend.UseStreamWindow = true;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+	SendRequestFrame(server, 1, 100);
+	SendRequestFrame(server, 2, 100);
+	std::vector<hb::RequestPtr> requests;
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (requests.size() < 2 && MillisecondsSince(start) < 5000)
+	{
+		if (backend.Recv(frame))
+			requests.push_back(frame.Request);
+	}
+	assert(requests.size() == 2);
+
+	// The response header tells the server that we honour its window
+	hb::Response head(requests[0]);
+	head.AddHeader_ContentLength(300);
+	assert(head.Send() == hb::SendResult_All);
+	std::vector<uint8_t> buf;
+	assert(RecvFrame(server, buf)->window() == 100);
+
+	char part[60] = {0};
+	assert(backend.SendBodyPart(requests[0], part, 60, false) == hb::SendResult_All);
+	assert(requests[0]->State() == hb::StreamState::Active);
+	assert(backend.SendBodyPart(requests[0], part, 60, false) == hb::SendResult_All);
+	assert(requests[0]->State() == hb::StreamState::Paused);
+	RecvFrame(server, buf);
+	RecvFrame(server, buf);
+
+	SendControlFrame(server, httpbridge::TxFrameType_WindowUpdate, 1, 50);
+	assert(RecvControlFrame(backend) == hb::FrameType::Resume);
+	assert(requests[0]->State() == hb::StreamState::Active);
+
+	// A WindowUpdate that doesn't resume the stream is not given to the caller, but its credits count
+	SendControlFrame(server, httpbridge::TxFrameType_WindowUpdate, 1, 40);
+	assert(!backend.Recv(frame));
+	assert(backend.SendBodyPart(requests[0], part, 60, false) == hb::SendResult_All);
+	assert(requests[0]->State() == hb::StreamState::Active);
+	RecvFrame(server, buf);
+
+	// With HoldWhilePaused, the held frames go out as credits arrive, and no sooner
+	backend.HoldWhilePaused = true;
+	hb::Response head2(requests[1]);
+	head2.AddHeader_ContentLength(300);
+	assert(head2.Send() == hb::SendResult_All);
+	RecvFrame(server, buf);
+	for (int i = 0; i < 5; i++)
+		assert(backend.SendBodyPart(requests[1], part, 60, false) == hb::SendResult_All);
+	for (int i = 0; i < 2; i++)
+		assert(RecvFrame(server, buf)->channel() == 2);
+	pollfd pfd = {server, POLLIN, 0};
+	assert(poll(&pfd, 1, 50) == 0);
+
+	SendControlFrame(server, httpbridge::TxFrameType_WindowUpdate, 2, 50);
+	assert(RecvControlFrame(backend) == hb::FrameType::Resume);
+	assert(RecvFrame(server, buf)->channel() == 2);
+	assert(poll(&pfd, 1, 50) == 0);
+	assert(requests[1]->State() == hb::StreamState::Paused);
+
+	SendControlFrame(server, httpbridge::TxFrameType_WindowUpdate, 2, 200);
+	assert(RecvControlFrame(backend) == hb::FrameType::Resume);
+	assert(RecvFrame(server, buf)->channel() == 2);
+	assert((RecvFrame(server, buf)->flags() & httpbridge::TxFrameFlags_Final) != 0);
+
+	// The last frame finished the stream
+	assert(backend.SendBodyPart(requests[1], part, 1, false) == hb::SendResult_Closed);
+
+	// Without UseStreamWindow, the window is ignored, and the server goes on using Pause and Resume
+	backend.UseStreamWindow = false;
+	SendRequestFrame(server, 3, 100);
+	start = std::chrono::steady_clock::now();
+	while (!backend.Recv(frame) && MillisecondsSince(start) < 5000) {}
+	assert(frame.Request != nullptr);
+	hb::Response head4(frame.Request);
+	head4.AddHeader_ContentLength(300);
+	assert(head4.Send() == hb::SendResult_All);
+	assert(RecvFrame(server, buf)->window() == 0);
+	for (int i = 0; i < 5; i++)
+		assert(backend.SendBodyPart(frame.Request, part, 60, false) == hb::SendResult_All);
+	assert(frame.Request->State() == hb::StreamState::Active);
+
+	backend.Close();
+	close(server);
+	close(listener);
+#endif
+}
+
+void TestBackendSendFile()
+{
+#ifdef __linux__
+	// An odd offset and length, so that neither end of the file's body lines up with a page
+	const uint64_t offset = 5001;
+	const uint64_t length = hb::Backend::SendFileChunkSize * 2 + 777;
+	std::vector<uint8_t> content(offset + length);
+	for (size_t i = 0; i < content.size(); i++)
+		content[i] = (uint8_t) (i * 7 + (i >> 10));
+	char path[] = "/tmp/httpbridge-unit-test-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+	assert(write(fd, &content[0], content.size()) == (ssize_t) content.size());
+
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	// Pause the stream before the response starts
+	SendRequestFrame(server, 1);
+	SendControlFrame(server, httpbridge::TxFrameType_Pause, 1);
+	hb::InFrame frame;
+	hb::RequestPtr request;
+	auto start = std::chrono::steady_clock::now();
+	while (request == nullptr || request->State() != hb::StreamState::Paused)
+	{
+		assert(MillisecondsSince(start) < 5000);
+		if (backend.Recv(frame) && frame.IsHeader)
+			request = frame.Request;
+	}
+
+	std::thread sender([&]() {
+		hb::Response header(request);
+		header.AddHeader("Content-Type", "application/octet-stream");
+		assert(backend.SendFile(header, fd, offset, length) == hb::SendResult_All);
+	});
+
+	// The header goes out immediately, but the body waits for the stream to be resumed
+	std::vector<uint8_t> buf;
+	auto f = RecvFrame(server, buf);
+	assert(f->frametype() == httpbridge::TxFrameType_Header);
+	assert(HeaderValue(f, "Content-Length") == std::to_string(length));
+	pollfd pfd = {server, POLLIN, 0};
+	assert(poll(&pfd, 1, 100) == 0);
+
+	SendControlFrame(server, httpbridge::TxFrameType_Resume, 1);
+	start = std::chrono::steady_clock::now();
+	while (request->State() != hb::StreamState::Active && MillisecondsSince(start) < 5000)
+		backend.Recv(frame);
+
+	std::vector<uint8_t> body;
+	while (body.size() < length)
+	{
+		f = RecvFrame(server, buf);
+		assert(f->frametype() == httpbridge::TxFrameType_Body);
+		body.insert(body.end(), f->body()->Data(), f->body()->Data() + f->body()->size());
+		assert(((f->flags() & httpbridge::TxFrameFlags_Final) != 0) == (body.size() == length));
+	}
+	assert(body.size() == length && memcmp(&body[0], &content[offset], length) == 0);
+	sender.join();
+
+	close(fd);
+	close(server);
+	close(listener);
+#endif
+}
+
+void TestBackendRecvChunks()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	// Lots of small frames in one write, which straddle chunk boundaries, and then frames that are much larger
+	// than a chunk, followed again by small frames, once the receive buffer has shrunk back.
+	std::vector<std::string> bodies;
+	for (int i = 0; i < 2000; i++)
+		bodies.push_back(std::string(1 + i % 97, (char) ('a' + i % 26)));
+	for (int i = 0; i < 3; i++)
+		bodies.push_back(std::string(3 * 1024 * 1024 + i, (char) ('A' + i)));
+	for (int i = 0; i < 100; i++)
+		bodies.push_back(std::string(1 + i, (char) ('0' + i % 10)));
+	std::vector<uint8_t> stream;
+	for (size_t i = 0; i < bodies.size(); i++)
+		AppendRequestFrame(stream, i + 1, bodies[i]);
+	std::thread sender([&]() { SendAll(server, stream); });
+
+	hb::InFrame frame;
+	size_t received = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (received < bodies.size() && MillisecondsSince(start) < 10000)
+	{
+		if (!backend.Recv(frame))
+			continue;
+		assert(frame.IsHeader && frame.IsLast && frame.Request->Channel == received + 1);
+		const std::string& body = bodies[received];
+		assert(frame.Request->BodyBuffer.Count == body.size() && memcmp(frame.Request->BodyBuffer.Data, body.c_str(), body.size()) == 0);
+		received++;
+	}
+	assert(received == bodies.size());
+	sender.join();
+
+	close(server);
+	close(listener);
+#endif
+}
+
+void TestBackendRequestSlab()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	std::vector<uint8_t> stream;
+	AppendRequestFrame(stream, 1);
+	AppendRequestFrame(stream, 2);
+	SendAll(server, stream);
+
+	hb::InFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	while (!backend.Recv(frame) && MillisecondsSince(start) < 5000) {}
+	assert(frame.Request->Channel == 1 && frame.Request->Path() == "/" && frame.Request->HeaderCount() == 0);
+	const hb::Request* first = frame.Request.get();
+
+	// Once the response is sent and the frame is gone, nothing refers to the request, and the next request reuses its slab
+	assert(backend.Send(frame.Request, hb::Status200_OK) == hb::SendResult_All);
+	frame.Reset();
+	while (!backend.Recv(frame) && MillisecondsSince(start) < 5000) {}
+	assert(frame.Request->Channel == 2 && frame.Request->Path() == "/");
+	assert(frame.Request.get() == first);
+
+	close(server);
+	close(listener);
+#endif
+}
+
+// Append a GET request frame with one header, which goes through the header cache. If value is empty, then the frame
+// refers to the cache entry, instead of setting it.
+static void AppendCachedHeaderFrame(std::vector<uint8_t>& out, uint64_t channel, uint16_t id, const std::string& key, const std::string& value)
+{
+	flatbuffers::FlatBufferBuilder fbb;
+	std::vector<flatbuffers::Offset<httpbridge::TxHeaderLine>> lines;
+	lines.push_back(httpbridge::CreateTxHeaderLine(fbb, fbb.CreateVector((const uint8_t*) "GET", 3), fbb.CreateVector((const uint8_t*) "/", 1)));
+	auto k = fbb.CreateVector((const uint8_t*) key.c_str(), value.size() != 0 ? key.size() : 0);
+	auto v = fbb.CreateVector((const uint8_t*) value.c_str(), value.size());
+	lines.push_back(httpbridge::CreateTxHeaderLine(fbb, k, v, id));
+	lines.push_back(httpbridge::CreateTxHeaderLine(fbb, fbb.CreateVector((const uint8_t*) "Accept", 6), fbb.CreateVector((const uint8_t*) "*/*", 3)));
+	auto root = httpbridge::CreateTxFrame(fbb, httpbridge::TxFrameType_Header, httpbridge::TxHttpVersion_Http11, httpbridge::TxFrameFlags_Final, channel, 1, fbb.CreateVector(lines));
+	httpbridge::FinishTxFrameBuffer(fbb, root);
+	AppendFrame(out, fbb);
+}
+
+void TestBackendHeaderCache()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	std::string cookie(4000, 'c');
+	std::vector<uint8_t> stream;
+	AppendCachedHeaderFrame(stream, 1, 7, "Cookie", cookie);
+	AppendCachedHeaderFrame(stream, 2, 7, "", "");
+	AppendCachedHeaderFrame(stream, 3, 7, "Cookie", "replaced");
+	SendAll(server, stream);
+
+	hb::InFrame frames[3];
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < 3; i++)
+	{
+		while (!backend.Recv(frames[i]) && MillisecondsSince(start) < 5000) {}
+		assert(frames[i].Request->Channel == i + 1);
+	}
+
+	// The first two requests share the cached cookie, instead of each having a copy of it
+	assert(frames[0].Request->HeaderByName(hb::HeaderKey_Cookie) == cookie);
+	assert(frames[1].Request->HeaderByName(hb::HeaderKey_Cookie) == frames[0].Request->HeaderByName(hb::HeaderKey_Cookie));
+	// Replacing the entry doesn't affect the requests that are using the old one
+	assert(streq(frames[2].Request->HeaderByName("cookie"), "replaced"));
+	frames[0].Reset();
+	assert(frames[1].Request->HeaderByName(hb::HeaderKey_Cookie) == cookie);
+
+	int32_t keyLen, valLen;
+	const char *key, *val;
+	frames[1].Request->HeaderAt(1, keyLen, key, valLen, val);
+	assert(keyLen == 6 && valLen == 3 && streq(key, "Accept") && streq(val, "*/*"));
+	assert(frames[1].Request->Method() == "GET" && frames[1].Request->URI() == "/");
+
+	close(server);
+	close(listener);
+#endif
+}
+
+// A repeated response header goes inline, then is defined with an id, and is thereafter sent as the id alone
+void TestBackendResponseHeaderCache()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	uint16_t id = 0;
+	for (uint64_t channel = 1; channel <= 4; channel++)
+	{
+		SendRequestFrame(server, channel);
+		hb::InFrame frame;
+		auto start = std::chrono::steady_clock::now();
+		while (!backend.Recv(frame))
+			assert(MillisecondsSince(start) < 5000);
+		hb::Response response(frame.Request);
+		response.AddHeader("Cache-Control", "no-store");
+		response.AddHeader("X-Channel", std::to_string(channel).c_str());
+		assert(response.Send() == hb::SendResult_All);
+
+		std::vector<uint8_t> buf;
+		auto f = RecvFrame(server, buf);
+		assert(f->headers()->size() == 3);
+		auto cacheControl = f->headers()->Get(1);
+		auto xChannel = f->headers()->Get(2);
+		// A value that changes every time is never cached
+		assert(xChannel->id() == 0 && HeaderValue(f, "X-Channel") == std::to_string(channel));
+		if (channel == 1)
+		{
+			assert(cacheControl->id() == 0 && HeaderValue(f, "Cache-Control") == "no-store");
+		}
+		else if (channel == 2)
+		{
+			id = cacheControl->id();
+			assert(id != 0 && HeaderValue(f, "Cache-Control") == "no-store");
+		}
+		else
+		{
+			assert(cacheControl->id() == id && cacheControl->key() == nullptr && cacheControl->value() == nullptr);
+		}
+	}
+
+	close(server);
+	close(listener);
+#endif
+}
+
+void TestBackendBodyView()
+{
+#ifdef __linux__
+	for (int copy = 0; copy < 2; copy++)
+	{
+		char addr[100];
+		int listener = ListenLoopback(addr, sizeof(addr));
+		hb::Backend backend;
+		backend.MaxAutoBufferSize = 0;
+		backend.CopyFrameBodies = copy == 1;
+		assert(backend.Connect("tcp", addr));
+		int server = accept(listener, nullptr, nullptr);
+		assert(server != -1);
+
+		// A streamed upload, with enough body frames to fill several receive chunks
+		std::vector<std::string> parts;
+		uint64_t total = 0;
+		for (int i = 0; i < 300; i++)
+		{
+			parts.push_back(std::string(1000 + i * 7, (char) ('a' + i % 26)));
+			total += parts.back().size();
+		}
+		std::vector<uint8_t> stream;
+		AppendRequestFrame(stream, 1, "", total);
+		for (size_t i = 0; i < parts.size(); i++)
+			AppendBodyFrame(stream, 1, parts[i], i == parts.size() - 1);
+		SendAll(server, stream);
+
+		// Views remain valid after their frames have been reset, and the receive buffer has moved on
+		std::vector<hb::BodyView> views;
+		hb::InFrame frame;
+		auto start = std::chrono::steady_clock::now();
+		bool last = false;
+		while (!last && MillisecondsSince(start) < 5000)
+		{
+			if (!backend.Recv(frame) || frame.BodyBytesLen == 0)
+				continue;
+			if (copy == 1)
+				frame.BodyBytes[0] = '!';
+			views.push_back(frame.Body());
+			last = frame.IsLast;
+		}
+		assert(last && views.size() == parts.size());
+		for (size_t i = 0; i < parts.size(); i++)
+		{
+			assert(views[i].Size() == parts[i].size());
+			assert(views[i].Data()[0] == (copy == 1 ? '!' : parts[i][0]));
+			assert(memcmp(views[i].Data() + 1, parts[i].c_str() + 1, parts[i].size() - 1) == 0);
+		}
+
+		// A view can outlive the connection
+		backend.Close();
+		hb::BodyView v = views[0];
+		views.clear();
+		assert(v.Size() == parts[0].size() && v.Data()[1] == parts[0][1]);
+
+		close(server);
+		close(listener);
+	}
+#endif
+}
+
+void TestBackendRecvMany()
+{
+#ifdef __linux__
+	char addr[100];
+	int listener = ListenLoopback(addr, sizeof(addr));
+	hb::Backend backend;
+	assert(backend.Connect("tcp", addr));
+	int server = accept(listener, nullptr, nullptr);
+	assert(server != -1);
+
+	const uint64_t nreq = 50;
+	std::vector<uint8_t> stream;
+	for (uint64_t channel = 1; channel <= nreq; channel++)
+		AppendRequestFrame(stream, channel);
+	SendAll(server, stream);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	// Everything has arrived, so one read is enough for all of the requests, and they come back in order
+	hb::InFrame frames[16];
+	uint64_t received = 0;
+	size_t calls = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (received < nreq && MillisecondsSince(start) < 5000)
+	{
+		size_t n = backend.RecvMany(frames, 16);
+		if (n == 0)
+			continue;
+		calls++;
+		assert(n == std::min((uint64_t) 16, nreq - received));
+		for (size_t i = 0; i < n; i++)
+			assert(frames[i].IsHeader && frames[i].Request->Channel == ++received);
+	}
+	assert(received == nreq && calls == 4);
+
+	close(server);
+	close(listener);
+#endif
+}
+
+// Frames of a stream must arrive in order, on one thread at a time. We number them through BodyBytesLen.
+struct DispatchLog
+{
+	std::mutex						Lock;
+	std::vector<size_t>				NextFrame;		// Per stream
+	std::vector<int>				InFlight;		// Per stream
+
+	std::set<std::thread::id>		Threads;
+	std::atomic<int>				Handled;
+	bool							OK = true;
+};
+
+static void LogDispatchedFrame(void* context, hb::InFrame& frame)
+{
+	auto log = (DispatchLog*) context;
+	size_t stream = (size_t) frame.Request->Stream;
+	bool wholeRequest = frame.IsHeader && frame.IsLast;
+	{
+		std::lock_guard<std::mutex> lock(log->Lock);
+		log->Threads.insert(std::this_thread::get_id());
+		if (!wholeRequest && (log->InFlight[stream]++ != 0 || log->NextFrame[stream]++ != frame.BodyBytesLen))
+			log->OK = false;
+	}
+	std::this_thread::sleep_for(std::chrono::microseconds(wholeRequest ? 5000 : 50));
+	if (!wholeRequest)
+	{
+		std::lock_guard<std::mutex> lock(log->Lock);
+		log->InFlight[stream]--;
+	}
+	log->Handled++;
+}
+
+void TestDispatcher()
+{
+	const size_t nstreams = 8;
+	const size_t nframes = 20;
+	DispatchLog log;
+	log.Handled = 0;
+	log.NextFrame.resize(nstreams + 1);
+	log.InFlight.resize(nstreams + 1);
+
+	hb::Dispatcher d;
+	d.Start(4, LogDispatchedFrame, &log);
+	assert(d.WorkerCount() == 4);
+
+	// Interleave the frames of several streams
+	std::vector<hb::RequestPtr> requests;
+	for (size_t s = 0; s < nstreams; s++)
+	{
+		requests.push_back(hb::Request::CreateMocked("POST", "/upload", {}));
+		requests.back()->Stream = s;
+	}
+	for (size_t i = 0; i < nframes; i++)
+	{
+		for (size_t s = 0; s < nstreams; s++)
+		{
+			hb::InFrame frame;
+			frame.Request = requests[s];
+			frame.IsHeader = i == 0;
+			frame.IsLast = i == nframes - 1;
+			frame.BodyBytesLen = i;
+			d.Dispatch(frame);
+			assert(frame.Request == nullptr);
+		}
+	}
+
+	// Whole requests on a single stream all have the same home worker, but they get stolen by the other workers
+	for (size_t i = 0; i < 16; i++)
+	{
+		hb::InFrame frame;
+		frame.Request = hb::Request::CreateMocked("GET", "/", {});
+		frame.Request->Stream = nstreams;
+		frame.IsHeader = true;
+		frame.IsLast = true;
+		d.Dispatch(frame);
+	}
+
+	d.Stop();
+	assert(log.OK);
+	assert(log.Handled == (int) (nstreams * nframes + 16));
+	for (size_t s = 0; s < nstreams; s++)
+		assert(log.NextFrame[s] == nframes);
+	assert(log.Threads.size() > 1);
+}
+
 int main(int argc, char** argv)
 {
 	run(TestMockedRequest);
 	run(TestUrlQueryParser);
 	run(TestRequestQuerySplitter);
+	run(TestRequestLazyURI);
+	run(TestRequestHeaderIndex);
 	run(TestResponseMisc);
+	run(TestResponseBodyRef);
+	run(TestBodyPartFrame);
 	run(TestUtilFunctions);
+	run(TestBackendWakeup);
+	run(TestUringTeardown);
+	run(TestBackendNonBlocking);
+	run(TestBackendStriping);
+	run(TestBackendAsyncSend);
+	run(TestBackendAsyncSendLimit);
+	run(TestBackendCloseWhileSending);
+	run(TestResponseOwnedBody);
+	run(TestBackendHoldWhilePaused);
+	run(TestBackendWindow);
+	run(TestBackendSendFile);
+	run(TestBackendRecvChunks);
+	run(TestBackendRequestSlab);
+	run(TestBackendHeaderCache);
+	run(TestBackendResponseHeaderCache);
+	run(TestBackendBodyView);
+	run(TestBackendRecvMany);
+	run(TestDispatcher);
 	return 0;
 }
\ No newline at end of file
@@ -127,8 +127,20 @@ func (rcv *TxFrame) BodyBytes() []byte {
 	return nil
 }
 
+func (rcv *TxFrame) Window() uint32 {
+	o := flatbuffers.UOffsetT(rcv._tab.Offset(18))
+	if o != 0 {
+		return rcv._tab.GetUint32(o + rcv._tab.Pos)
+	}
+	return 0
+}
+
+func (rcv *TxFrame) MutateWindow(n uint32) bool {
+	return rcv._tab.MutateUint32Slot(18, n)
+}
+
 func TxFrameStart(builder *flatbuffers.Builder) {
-	builder.StartObject(7)
+	builder.StartObject(8)
 }
 func TxFrameAddFrametype(builder *flatbuffers.Builder, frametype int8) {
 	builder.PrependInt8Slot(0, frametype, 0)
@@ -157,6 +169,9 @@ func TxFrameAddBody(builder *flatbuffers.Builder, body flatbuffers.UOffsetT) {
 func TxFrameStartBodyVector(builder *flatbuffers.Builder, numElems int) flatbuffers.UOffsetT {
 	return builder.StartVector(1, numElems, 1)
 }
+func TxFrameAddWindow(builder *flatbuffers.Builder, window uint32) {
+	builder.PrependUint32Slot(7, window, 0)
+}
 func TxFrameEnd(builder *flatbuffers.Builder) flatbuffers.UOffsetT {
 	return builder.EndObject()
 }
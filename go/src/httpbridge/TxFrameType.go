@@ -8,6 +8,8 @@ const (
 	TxFrameTypeAbort = 2
 	TxFrameTypePause = 3
 	TxFrameTypeResume = 4
+	TxFrameTypeHello = 5
+	TxFrameTypeWindowUpdate = 6
 )
 
 var EnumNamesTxFrameType = map[int]string{
@@ -16,5 +18,7 @@ var EnumNamesTxFrameType = map[int]string{
 	TxFrameTypeAbort:"Abort",
 	TxFrameTypePause:"Pause",
 	TxFrameTypeResume:"Resume",
+	TxFrameTypeHello:"Hello",
+	TxFrameTypeWindowUpdate:"WindowUpdate",
 }
 
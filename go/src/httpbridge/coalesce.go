@@ -0,0 +1,149 @@
+package httpbridge
+
+import (
+	"errors"
+	"net"
+	"sync"
+	"time"
+)
+
+var errBackendGone = errors.New("httpbridge backend connection closed")
+
+// write() blocks while this many times maxBytes is waiting to be sent, so that a backend which reads
+// slowly still holds back whoever is sending to it, the way that a direct write to its socket would.
+const coalescePendingLimit = 4
+
+// coalescingWriter sends frames to a backend from a goroutine of its own, so that frames which are
+// sent close together can share a single write (see Server.BackendCoalesceDelay).
+// A write error is returned by the next call to write(), because the frame that failed has already
+// been accepted by then.
+type coalescingWriter struct {
+	con      net.Conn
+	delay    time.Duration
+	maxBytes int
+	done     chan bool // Closed when the backend disconnects
+
+	lock    sync.Mutex // Guards pending, spare, and err
+	room    *sync.Cond // Signalled on lock when pending is taken, or when we fail
+	pending []byte
+	spare   []byte
+	err     error
+
+	wake chan struct{} // Signalled when pending becomes non-empty
+	full chan struct{} // Signalled when pending reaches maxBytes
+}
+
+func newCoalescingWriter(con net.Conn, delay time.Duration, maxBytes int, done chan bool) *coalescingWriter {
+	w := &coalescingWriter{
+		con:      con,
+		delay:    delay,
+		maxBytes: maxBytes,
+		done:     done,
+		wake:     make(chan struct{}, 1),
+		full:     make(chan struct{}, 1),
+	}
+	w.room = sync.NewCond(&w.lock)
+	go w.run()
+	return w
+}
+
+func signalChan(c chan struct{}) {
+	select {
+	case c <- struct{}{}:
+	default:
+	}
+}
+
+// Queue up one whole frame. This blocks while too much is already queued.
+func (w *coalescingWriter) write(frame []byte) error {
+	w.lock.Lock()
+	defer w.lock.Unlock()
+	for w.err == nil && len(w.pending) >= coalescePendingLimit*w.maxBytes {
+		w.room.Wait()
+	}
+	if w.err != nil {
+		return w.err
+	}
+	wasEmpty := len(w.pending) == 0
+	w.pending = append(w.pending, frame...)
+	if wasEmpty {
+		signalChan(w.wake)
+	}
+	if len(w.pending) >= w.maxBytes {
+		signalChan(w.full)
+	}
+	return nil
+}
+
+func (w *coalescingWriter) run() {
+	timer := time.NewTimer(time.Hour)
+	timer.Stop()
+	lastWrite := time.Time{}
+	for {
+		select {
+		case <-w.wake:
+		case <-w.done:
+			w.fail(errBackendGone)
+			return
+		}
+
+		// If we wrote recently, then more frames are probably on their way, so give them a chance to join this write.
+		// If we've been quiet for a while, then write immediately, so that a lightly loaded server sees no extra latency.
+		if since := time.Since(lastWrite); since < w.delay {
+			timer.Reset(w.delay - since)
+			select {
+			case <-timer.C:
+			case <-w.full:
+				if !timer.Stop() {
+					<-timer.C
+				}
+			case <-w.done:
+				w.fail(errBackendGone)
+				return
+			}
+		}
+
+		w.lock.Lock()
+		// Any 'full' signal refers to the frames that we're about to take
+		select {
+		case <-w.full:
+		default:
+		}
+		if len(w.pending) == 0 {
+			w.lock.Unlock()
+			continue
+		}
+		buf := w.pending
+		w.pending = w.spare[:0]
+		w.room.Broadcast()
+		w.lock.Unlock()
+
+		var err error
+		for remain := buf; len(remain) != 0 && err == nil; {
+			var n int
+			n, err = w.con.Write(remain)
+			remain = remain[n:]
+		}
+		lastWrite = time.Now()
+
+		w.lock.Lock()
+		w.spare = buf[:0]
+		w.lock.Unlock()
+		if err != nil {
+			w.fail(err)
+			// Our reader notices the closed connection, and removes the backend
+			w.con.Close()
+			return
+		}
+	}
+}
+
+func (w *coalescingWriter) fail(err error) {
+	w.lock.Lock()
+	if w.err == nil {
+		w.err = err
+	}
+	w.pending = nil
+	w.room.Broadcast()
+	w.lock.Unlock()
+}
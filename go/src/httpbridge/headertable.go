@@ -0,0 +1,142 @@
+package httpbridge
+
+import (
+	"container/list"
+	"net/http"
+	"sync"
+)
+
+const (
+	defaultHeaderTableSize = 256       // Default for Server.BackendHeaderTableSize
+	headerTableMaxBytes    = 64 * 1024 // Most key+value bytes that we ask one backend connection to remember
+	headerTableMaxPair     = 4 * 1024  // A pair that is longer than this is always sent inline
+)
+
+type headerPair struct {
+	key   string
+	value string
+}
+
+type headerTableEntry struct {
+	pair headerPair
+	id   uint16
+}
+
+// headerTable decides which request header lines we send to a backend connection by id (see TxHeaderLine.id).
+// The backend remembers every pair that we give an id to, so after the line that defines the pair, we send
+// only the id. A pair gets an id the second time that we see it, so that one-off values (such as the
+// Content-Length of an upload) don't push the common pairs out of the table.
+// When the table is full, the least recently used pair loses its id, and the next new pair takes it over.
+// The backend replaces its copy when it sees the new definition, and requests that it has already received
+// keep their copy of the old pair.
+//
+// Whoever calls lookup() must hold 'lock' until the frame has been handed to the connection's writer,
+// so that the backend sees definitions in the same order as we make them.
+type headerTable struct {
+	lock       sync.Mutex
+	maxEntries int
+	entries    map[headerPair]*list.Element // Value is *headerTableEntry
+	lru        *list.List                   // Front is most recently used
+	seen       map[headerPair]struct{}      // Pairs that we've seen once, but have not given an id to
+	nbytes     int                          // Total key+value bytes of 'entries'
+	freeIDs    []uint16                     // Ids of evicted entries
+	nextID     uint16                       // Next id that has never been used
+}
+
+func newHeaderTable(maxEntries int) *headerTable {
+	if maxEntries > 65535 {
+		maxEntries = 65535
+	}
+	return &headerTable{
+		maxEntries: maxEntries,
+		entries:    make(map[headerPair]*list.Element),
+		lru:        list.New(),
+		seen:       make(map[headerPair]struct{}),
+		nextID:     1,
+	}
+}
+
+// Returns the id to send with the pair, or zero if the pair must be sent inline, without an id.
+// If known is true, then the backend already has the pair, and the line needs only the id.
+// Otherwise, the line must carry the key and value, which defines the pair, if id is not zero.
+func (t *headerTable) lookup(key, value string) (id uint16, known bool) {
+	if len(key) == 0 || len(key)+len(value) > headerTableMaxPair {
+		return 0, false
+	}
+	pair := headerPair{key, value}
+	if el, ok := t.entries[pair]; ok {
+		t.lru.MoveToFront(el)
+		return el.Value.(*headerTableEntry).id, true
+	}
+	if _, ok := t.seen[pair]; !ok {
+		// Forget the stragglers every now and then, so that unique values don't accumulate here
+		if len(t.seen) >= 4*t.maxEntries {
+			t.seen = make(map[headerPair]struct{})
+		}
+		t.seen[pair] = struct{}{}
+		return 0, false
+	}
+	delete(t.seen, pair)
+
+	size := len(key) + len(value)
+	for t.lru.Len() != 0 && (t.lru.Len() >= t.maxEntries || t.nbytes+size > headerTableMaxBytes) {
+		oldest := t.lru.Remove(t.lru.Back()).(*headerTableEntry)
+		delete(t.entries, oldest.pair)
+		t.nbytes -= len(oldest.pair.key) + len(oldest.pair.value)
+		t.freeIDs = append(t.freeIDs, oldest.id)
+	}
+	if n := len(t.freeIDs); n != 0 {
+		id = t.freeIDs[n-1]
+		t.freeIDs = t.freeIDs[:n-1]
+	} else {
+		id = t.nextID
+		t.nextID++
+	}
+	t.entries[pair] = t.lru.PushFront(&headerTableEntry{pair, id})
+	t.nbytes += size
+	return id, false
+}
+
+// Highest response header id that a backend uses (see HeaderCacheSend in http-bridge.cpp)
+const maxResponseHeaderID = 1024
+
+// responseHeaderTable holds the response headers that a backend connection sends by id.
+// The backend defines an id once on each connection, and thereafter sends only the id. An id never changes
+// its meaning, so an entry is written once, by the goroutine that reads the connection, before that goroutine
+// passes on any frame that refers to it. The goroutines that write responses only ever read the table.
+type responseHeaderTable struct {
+	entries [maxResponseHeaderID + 1]*responseHeader
+}
+
+type responseHeader struct {
+	key    string   // Canonical form, ready to be used as a key of http.Header
+	values []string // Shared by every response that uses this pair. Its capacity is 1, so an append makes a copy.
+	skip   bool     // True for our special chunked Content-Length of -1, which the client must not see
+}
+
+// Record the pairs that a response header frame defines
+func (t *responseHeaderTable) learn(frame *TxFrame) {
+	line := &TxHeaderLine{}
+	for i := 1; i < frame.HeadersLength(); i++ {
+		frame.Headers(line, i)
+		id := int(line.Id())
+		if id == 0 || id > maxResponseHeaderID || line.KeyLength() == 0 || t.entries[id] != nil {
+			continue
+		}
+		key := string(line.KeyBytes())
+		val := string(line.ValueBytes())
+		t.entries[id] = &responseHeader{
+			key:    http.CanonicalHeaderKey(key),
+			values: []string{val},
+			skip:   key == "Content-Length" && val == "-1",
+		}
+	}
+}
+
+// Returns nil if the id has not been defined
+func (t *responseHeaderTable) get(id uint16) *responseHeader {
+	if int(id) > maxResponseHeaderID {
+		return nil
+	}
+	return t.entries[id]
+}
@@ -16,7 +16,23 @@ import (
 
 type backendID int64
 type streamID string
-type responseChan chan *TxFrame
+type responseChan chan backendFrame
+
+// A frame from a backend, along with the response header table of the connection that it arrived on.
+// The backend can send a response over any of its connections, and the ids in a header frame refer to
+// the table of the connection that carried it.
+type backendFrame struct {
+	*TxFrame
+	headers *responseHeaderTable
+}
+
+// Number of bytes that the frame holds on to. The empty frame, which marks a stream that we aborted, has size zero.
+func (f backendFrame) size() int64 {
+	if f.TxFrame == nil {
+		return 0
+	}
+	return int64(len(f._tab.Bytes))
+}
 
 // Allocate this much size up front for frame buffer, so that flatbuffer doesn't need to be reallocated.
 // When last checked, actual size was around 40 bytes.
@@ -24,22 +40,29 @@ const frameBaseSize = 100
 
 // Number of frames that we will queue up in each response channel. This is tricky territory.
 // Why do we want any queue here at all?
-// If we don't have a queue, then the big main loop inside handleBackendConnection, which fetches
-// data out of the backend's TCP socket, will block if it tries to write to a responseChan that
-// is full. This will happen when the TCP socket that is writing to the client stalls, which
-// is a very frequent occurrence (ie we are exceeding the data rate of the browser's TCP socket).
-// So, this queue is here partly as a threshold that we can use to detect when to tell a backend
-// that it must pause sending on a particular stream. Once we see that the client queue has drained,
-// then we inform the backend that it is once again clear to send.
-// This is an annoying burden to place on the client, and it may someday be necessary to implement
-// a send buffer on the client side, so that most high level code doesn't need to worry about this,
-// and it can rely instead on the backend to automatically buffer up some amount of transmit data,
-// for paused streams. Increasing the buffer size here is definitely not an ideal thing to do, because
-// it adds more memory pressure to the single load balancer process.
-// We make this number large - much larger than responseChanBufferHigh - because once a channel
-// is full, we are totally hosed.
+// The big main loop inside handleBackendConnection, which fetches data out of the backend's socket,
+// must never wait for a client, because every other stream on that connection would wait with it.
+// When the TCP socket that is writing to the client stalls, which is a very frequent occurrence
+// (ie we are exceeding the data rate of the browser's TCP socket), frames pile up here instead.
+// Once a channel is full, further frames go onto the stream's overflow list (see streamInfo.push).
+// A backend that honours our window (see Server.BackendStreamWindow) never sends more than a window's
+// worth of frames ahead of the client, so for such a stream this queue never grows beyond that.
+// For any other backend, the queue length is also our signal to tell the backend that it must pause
+// sending on a particular stream. Once we see that the client queue has drained, then we inform the
+// backend that it is once again clear to send. A backend that ignores Pause no longer stalls the other
+// streams on its connection, but the overflow lists are capped, so that it can't make us buffer without
+// limit. If a frame would take a stream's overflow past responseOverflowMaxStream bytes, or the overflow
+// of all of the streams on its backend connection past responseOverflowMaxBackend bytes, then we abort
+// the stream.
 const responseChanBufferSize = 200
 
+// Limits on the total size of the frames on overflow lists. See responseChanBufferSize.
+// A backend that does honour Pause still has a lot in flight when the Pause reaches it (both socket buffers,
+// and whatever it sends in the meantime), which can put well over 10 MB into a fast stream's overflow, so these
+// limits leave plenty of room above that.
+const responseOverflowMaxStream = 64 * 1024 * 1024
+const responseOverflowMaxBackend = 256 * 1024 * 1024
+
 // When the queue length of a response channel reaches this number, we send a PAUSE frame to the backend.
 const responseChanBufferHigh = 15
 
@@ -49,6 +72,9 @@ const responseChanBufferLow = 5
 // This is always on, but I leave the switch up here to make testing easier.
 const enablePause = true
 
+// Default for Server.BackendStreamWindow
+const defaultStreamWindow = 256 * 1024
+
 const magicFrameMarker = 0x48426268
 
 type sendBodyResult int
@@ -76,12 +102,39 @@ type Server struct {
 	BackendTimeout      time.Duration
 	Log                 Logger
 
+	// The network that backends connect to us over. This is either "tcp" (the default), "unix", or "shm".
+	// When BackendNetwork is "unix", then BackendPort is the filesystem path of the socket, such as "/run/hb.sock".
+	// Unix domain sockets avoid the loopback TCP stack, when the backend runs on the same machine.
+	// "shm" (Linux only) also listens on a unix socket, but the backend hands us shared memory rings
+	// over that socket, and frames are thereafter exchanged through shared memory.
+	BackendNetwork string
+
+	// Small frames that we send to a backend in quick succession can share a single write.
+	// If BackendCoalesceDelay is non-zero, then a frame that is sent within BackendCoalesceDelay of the previous
+	// write to that backend connection is held back until the delay has passed, or until BackendCoalesceBytes
+	// are waiting (default 64 KB). A connection that has been quiet for longer than that writes immediately.
+	BackendCoalesceDelay time.Duration
+	BackendCoalesceBytes int
+
+	// Request headers such as User-Agent, Cookie, and Accept-Encoding tend to repeat from one request to the next.
+	// Each backend connection remembers up to BackendHeaderTableSize such key/value pairs (default 256), and
+	// once a pair has been remembered, we send only its id over that connection. Set this to -1 to send all
+	// headers in full.
+	BackendHeaderTableSize int
+
+	// The number of response body bytes that a backend may send on a stream, ahead of what the client has received.
+	// As the client receives the body, we grant the backend more with WindowUpdate frames. The default is 256 KB.
+	// A backend that ignores the window (see Backend::UseStreamWindow) gets Pause and Resume instead.
+	// Set this to -1 to always use Pause and Resume.
+	BackendStreamWindow int
+
 	httpServer      http.Server
 	httpListener    net.Listener
 	backendListener net.Listener
 
-	// Access to 'backends' and 'nextBackendID' is guarded by 'backendsLock'
+	// Access to 'backends', 'backendGroups', 'nextBackendID', and backendConnection.group is guarded by 'backendsLock'
 	backends      []*backendConnection
+	backendGroups map[string]*backendGroup
 	backendsLock  sync.Mutex
 	nextBackendID backendID
 
@@ -112,8 +165,114 @@ const (
 )
 
 type streamInfo struct {
-	state streamState // This is manipulated atomically. Use getState() and setState(), which do atomic accesses.
-	rchan responseChan
+	state   streamState // This is manipulated atomically. Use getState() and setState(), which do atomic accesses.
+	rchan   responseChan
+	backend *backendConnection // The connection that carries our request. Control frames for the stream must go out on this same connection, so that they stay in order.
+	window  uint32             // Response window that we gave the backend, or zero if we didn't
+
+	// Held while we pause or resume the stream, from the state check through to sending the control frame.
+	// Otherwise a Resume could overtake the Pause that it answers, and leave the backend paused for good.
+	controlLock sync.Mutex
+
+	lock          sync.Mutex     // Guards overflow, overflowBytes, unregistered and credits
+	overflow      []backendFrame // Frames that arrived while rchan was full. They come after everything in rchan.
+	overflowBytes int64          // Total size of the frames in overflow. These bytes are also counted in backend.overflowBytes.
+	unregistered  bool           // Nobody will read rchan anymore
+	credits       bool           // The backend's response header said that it honours our window
+}
+
+// Queue a frame for the goroutine that sends the response. This never blocks.
+// If the frame would take the overflow of the stream, or of its backend connection, past its limit, then we drop
+// the stream's overflow, and return false. The caller must then abort the stream.
+func (i *streamInfo) push(frame backendFrame) bool {
+	i.lock.Lock()
+	if len(i.overflow) == 0 {
+		select {
+		case i.rchan <- frame:
+			i.lock.Unlock()
+			return true
+		default:
+		}
+	}
+	if i.unregistered {
+		i.lock.Unlock()
+		return true
+	}
+	size := frame.size()
+	ok := i.overflowBytes+size <= responseOverflowMaxStream
+	if ok && atomic.AddInt64(&i.backend.overflowBytes, size) > responseOverflowMaxBackend {
+		atomic.AddInt64(&i.backend.overflowBytes, -size)
+		ok = false
+	}
+	if ok {
+		i.overflowBytes += size
+		i.overflow = append(i.overflow, frame)
+	} else {
+		// The empty frame tells the sender, once it has sent what is already in rchan, that the rest of the response is not coming
+		i.dropOverflow()
+		i.overflow = append(i.overflow, backendFrame{})
+	}
+	i.lock.Unlock()
+	return ok
+}
+
+// Move overflow frames into rchan, now that the sender has made room there
+func (i *streamInfo) refill() {
+	i.lock.Lock()
+	moved := int64(0)
+	full := false
+	for len(i.overflow) != 0 && !full {
+		select {
+		case i.rchan <- i.overflow[0]:
+			moved += i.overflow[0].size()
+			i.overflow[0] = backendFrame{}
+			i.overflow = i.overflow[1:]
+		default:
+			full = true
+		}
+	}
+	if len(i.overflow) == 0 {
+		i.overflow = nil
+	}
+	i.overflowBytes -= moved
+	atomic.AddInt64(&i.backend.overflowBytes, -moved)
+	i.lock.Unlock()
+}
+
+// Release the overflow, so that it no longer counts against the backend connection. The caller must hold the lock.
+func (i *streamInfo) dropOverflow() {
+	atomic.AddInt64(&i.backend.overflowBytes, -i.overflowBytes)
+	i.overflowBytes = 0
+	i.overflow = nil
+}
+
+// Called by unregisterStream. A frame that is pushed after this is left to the garbage collector.
+func (i *streamInfo) unregister() {
+	i.lock.Lock()
+	i.unregistered = true
+	i.dropOverflow()
+	i.lock.Unlock()
+}
+
+// Number of frames waiting to be sent to the client
+func (i *streamInfo) queued() int {
+	i.lock.Lock()
+	n := len(i.rchan) + len(i.overflow)
+	i.lock.Unlock()
+	return n
+}
+
+func (i *streamInfo) setCredits() {
+	i.lock.Lock()
+	i.credits = true
+	i.lock.Unlock()
+}
+
+func (i *streamInfo) usesCredits() bool {
+	i.lock.Lock()
+	c := i.credits
+	i.lock.Unlock()
+	return c
 }
 
 func (i *streamInfo) getState() streamState {
@@ -136,22 +295,42 @@ func (i *streamInfo) setState(s streamState) {
 }
 
 type backendConnection struct {
-	con            net.Conn
-	id             backendID
-	disconnectChan chan bool  // We never send anything to this channel. But a select{} will wake when the channel is closed, which is how this get used.
-	conWriteLock   sync.Mutex // Take this whenever you send a frame to con. This is necessary so that a partial send doesn't end up splicing two frames into each other.
+	overflowBytes   int64 // Total size of the overflow of the streams that this connection carries. Manipulated atomically. First, so that it is 64-bit aligned.
+	con             net.Conn
+	id              backendID
+	disconnectChan  chan bool  // We never send anything to this channel. But a select{} will wake when the channel is closed, which is how this get used.
+	conWriteLock    sync.Mutex // Take this whenever you send a frame to con. This is necessary so that a partial send doesn't end up splicing two frames into each other.
+	group           *backendGroup
+	writer          *coalescingWriter    // Non-nil if Server.BackendCoalesceDelay is set, in which case all frames go through writer
+	headers         *headerTable         // Nil if Server.BackendHeaderTableSize is negative
+	responseHeaders *responseHeaderTable // Response headers that the backend has defined by id on this connection
+}
+
+// A backend can open several connections to us, so that a single socket doesn't limit its throughput.
+// It then sends a Hello frame as the first frame on each of those connections, and all of the connections
+// that carry the same token form one logical backend. Each request goes out over one of the group's
+// connections, chosen by its channel and stream, and the backend sends the response back over whichever
+// connection it likes. That works, because responses are matched up to their requests via Server.responses.
+// If any connection of a group is lost, we close all of them, because the backend does the same.
+type backendGroup struct {
+	token string
+	conns []*backendConnection // Indexed by the connection number in the Hello frame. Nil until that connection has said Hello.
 }
 
 func (s *Server) ListenAndServe() error {
 	var err error
 	enableHTTPListener := !s.DisableHttpListener
 	s.nextBackendID = 1
+	s.backendGroups = make(map[string]*backendGroup)
 	s.atomics = new(serverAtomics)
 	s.stoppedChan = make(chan bool)
 	s.responses = make(map[streamID]*streamInfo)
 	if s.BackendTimeout == 0 {
 		s.BackendTimeout = time.Second * 120
 	}
+	if s.BackendCoalesceBytes == 0 {
+		s.BackendCoalesceBytes = 64 * 1024
+	}
 	if s.Log.Target == nil {
 		s.Log.Target = os.Stdout
 	}
@@ -162,18 +341,31 @@ func (s *Server) ListenAndServe() error {
 	if !enableHTTPListener {
 		httpPort = "disabled"
 	}
+	backendNetwork := s.BackendNetwork
+	if backendNetwork == "" {
+		backendNetwork = "tcp"
+	}
 	backendPort := s.BackendPort
-	if backendPort == "" {
+	if backendPort == "" && backendNetwork == "tcp" {
 		backendPort = ":81"
 	}
-	s.Log.Infof("http-bridge server starting (http port %v, backend port %v)", httpPort, backendPort)
+	s.Log.Infof("http-bridge server starting (http port %v, backend %v port %v)", httpPort, backendNetwork, backendPort)
 	s.httpServer.Handler = s
 	if enableHTTPListener {
 		if s.httpListener, err = net.Listen("tcp", httpPort); err != nil {
 			return err
 		}
 	}
-	if s.backendListener, err = net.Listen("tcp", backendPort); err != nil {
+	if backendNetwork == "unix" || backendNetwork == "shm" {
+		// Remove the socket file left behind by a previous process, otherwise Listen fails with "address already in use"
+		os.Remove(backendPort)
+	}
+	if backendNetwork == "shm" {
+		s.backendListener, err = listenShm(backendPort, &s.Log)
+	} else {
+		s.backendListener, err = net.Listen(backendNetwork, backendPort)
+	}
+	if err != nil {
 		return err
 	}
 	errPipe := make(chan error)
@@ -207,11 +399,22 @@ func (s *Server) ServeHTTP(w http.ResponseWriter, req *http.Request) {
 	// Temp: We currently have problems between the router's httpbridge server and the client in ImqsCrud.
 	// The ping route /crud/ping also fails intermittently, so we add this retry mechanism and log to try and
 	// determine where the problem lies.
+	// This is not true under HTTP/2. I haven't bothered yet to try and determine the channel correctly.
+	// For now we just pretend that we're running under HTTP/1.1, although with an unlimited number of
+	// simultaneous connections from the client.
+	channel := atomic.AddUint64(&s.atomics.nextChannel, 1)
+
+	// This goes hand in hand with our phoney channel number. I haven't checked, but from the spec,
+	// I assume that the first HTTP/2 stream from a client will usually be 3.
+	// If you fix channel, then you must also fix stream. Our Stream IDs depend upon the combination
+	// of channel + stream being unique for every request/response.
+	stream := uint64(3)
+
 	var backend *backendConnection
 	findRetries := 0
 	for {
 		var err error
-		backend, err = s.findBackend(req)
+		backend, err = s.findBackend(req, channel, stream)
 		if err == nil {
 			break
 		}
@@ -225,18 +428,7 @@ func (s *Server) ServeHTTP(w http.ResponseWriter, req *http.Request) {
 		}
 	}
 
-	// This is not true under HTTP/2. I haven't bothered yet to try and determine the channel correctly.
-	// For now we just pretend that we're running under HTTP/1.1, although with an unlimited number of
-	// simultaneous connections from the client.
-	channel := atomic.AddUint64(&s.atomics.nextChannel, 1)
-
-	// This goes hand in hand with our phoney channel number. I haven't checked, but from the spec,
-	// I assume that the first HTTP/2 stream from a client will usually be 3.
-	// If you fix channel, then you must also fix stream. Our Stream IDs depend upon the combination
-	// of channel + stream being unique for every request/response.
-	stream := uint64(3)
-
-	streamInfo := s.registerStream(channel, stream)
+	streamInfo := s.registerStream(channel, stream, backend)
 	defer s.unregisterStream(channel, stream)
 
 	// ContentLength is -1 when unknown
@@ -246,7 +438,7 @@ func (s *Server) ServeHTTP(w http.ResponseWriter, req *http.Request) {
 		s.Log.Debugf("HB Request %v:%v started (%v)", channel, stream, req.URL.String())
 	}
 
-	if !s.sendHeaderFrame(w, req, backend, channel, stream, hasBody) {
+	if !s.sendHeaderFrame(w, req, backend, channel, stream, hasBody, streamInfo.window) {
 		return
 	}
 
@@ -263,7 +455,7 @@ func (s *Server) ServeHTTP(w http.ResponseWriter, req *http.Request) {
 			// too much memory/space. For example, a chunked upload that ends up being too large.
 			s.Log.Infof("httpbridge request %v:%v aborted prematurely", channel, stream)
 			// Put the frame back into the queue, and let sendResponse send it.
-			streamInfo.rchan <- responseFrame
+			streamInfo.push(responseFrame)
 		case sendBodyResult_ServerStop:
 			sendResponse = false
 		}
@@ -276,19 +468,38 @@ func (s *Server) ServeHTTP(w http.ResponseWriter, req *http.Request) {
 	s.Log.Debugf("HB Request %v:%v finished", channel, stream)
 }
 
-func (s *Server) sendHeaderFrame(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, hasBody bool) bool {
+func (s *Server) sendHeaderFrame(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, hasBody bool, window uint32) bool {
 	builder := flatbuffers.NewBuilder(1000)
 
+	// Hold the table lock until the frame is on its way, so that the backend sees the pairs that
+	// this frame defines before any frame that refers to them.
+	table := backend.headers
+	if table != nil {
+		table.lock.Lock()
+	}
+	s.buildHeaderFrame(builder, req, table, channel, stream, hasBody, window)
+	err := s.endFrameAndSend(backend, builder)
+	if table != nil {
+		table.lock.Unlock()
+	}
+
+	if err != nil {
+		http.Error(w, fmt.Sprintf("Error writing headers to backend %v (%v)", backend.id, err), http.StatusGatewayTimeout)
+		return false
+	}
+
+	return true
+}
+
+// If table is not nil, then the caller must hold table.lock
+func (s *Server) buildHeaderFrame(builder *flatbuffers.Builder, req *http.Request, table *headerTable, channel, stream uint64, hasBody bool, window uint32) {
 	// Headers
 	header_lines := []flatbuffers.UOffsetT{}
+	empty := flatbuffers.UOffsetT(0) // Shared by all of the lines that carry only an id
 
-	// First header line is special "GET /uri" (key is HTTP method, value is HTTP Path)
-	method := createByteVectorFromString(builder, req.Method)
-	uri := createByteVectorFromString(builder, req.RequestURI)
-	TxHeaderLineStart(builder)
-	TxHeaderLineAddKey(builder, method)
-	TxHeaderLineAddValue(builder, uri)
-	header_lines = append(header_lines, TxHeaderLineEnd(builder))
+	// First header line is special "GET /uri" (key is HTTP method, value is HTTP Path).
+	// The URI seldom repeats, so we don't bother looking it up in the table.
+	header_lines = append(header_lines, createHeaderLine(builder, nil, &empty, req.Method, req.RequestURI))
 
 	// Header lines proper
 	haveContentLength := false
@@ -296,26 +507,15 @@ func (s *Server) sendHeaderFrame(w http.ResponseWriter, req *http.Request, backe
 		if k == "Content-Length" {
 			haveContentLength = true
 		}
-		fbKey := createByteVectorFromString(builder, k)
-
 		for _, v := range varr {
-			fbVal := createByteVectorFromString(builder, v)
-			TxHeaderLineStart(builder)
-			TxHeaderLineAddKey(builder, fbKey)
-			TxHeaderLineAddValue(builder, fbVal)
-			header_lines = append(header_lines, TxHeaderLineEnd(builder))
+			header_lines = append(header_lines, createHeaderLine(builder, table, &empty, k, v))
 		}
 	}
 
 	// Unknown content length, so write -1 for it, so that backend knows this is coming.
 	// Both httpbridge and Go use -1 to signal unknown content length.
 	if !haveContentLength && hasBody {
-		key := createByteVectorFromString(builder, "Content-Length")
-		val := createByteVectorFromString(builder, "-1")
-		TxHeaderLineStart(builder)
-		TxHeaderLineAddKey(builder, key)
-		TxHeaderLineAddValue(builder, val)
-		header_lines = append(header_lines, TxHeaderLineEnd(builder))
+		header_lines = append(header_lines, createHeaderLine(builder, table, &empty, "Content-Length", "-1"))
 	}
 
 	TxFrameStartHeadersVector(builder, len(header_lines))
@@ -333,17 +533,13 @@ func (s *Server) sendHeaderFrame(w http.ResponseWriter, req *http.Request, backe
 	s.startFrame(builder, TxFrameTypeHeader, channel, stream, req)
 	TxFrameAddFlags(builder, flags)
 	TxFrameAddHeaders(builder, headers)
-
-	if err := s.endFrameAndSend(backend, builder); err != nil {
-		http.Error(w, fmt.Sprintf("Error writing headers to backend %v (%v)", backend.id, err), http.StatusGatewayTimeout)
-		return false
+	if window != 0 {
+		TxFrameAddWindow(builder, window)
 	}
-
-	return true
 }
 
 // Send the body from the client to the backend
-func (s *Server) sendBody(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, info *streamInfo) (sendBodyResult, *TxFrame) {
+func (s *Server) sendBody(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, info *streamInfo) (sendBodyResult, backendFrame) {
 	// I have no idea what this buffer size should be. Thoughts revolve around the size of a regular ethernet frame (1522 bytes),
 	// or jumbo frames (9000 bytes). Also, you have the multiple simultaneous streams to consider (ie you don't want to bloat
 	// up your front-end's memory with buffers). If the HTTP process and the backend are on the same machine, then I'm guessing you'd
@@ -362,9 +558,10 @@ func (s *Server) sendBody(w http.ResponseWriter, req *http.Request, backend *bac
 		// Check to see if the backend has sent a premature response, or the server is shutting down
 		select {
 		case frame := <-info.rchan:
+			info.refill()
 			return sendBodyResult_PrematureResponse, frame
 		case <-s.stoppedChan:
-			return sendBodyResult_ServerStop, nil
+			return sendBodyResult_ServerStop, backendFrame{}
 		default:
 			// continue transmitting body
 		}
@@ -384,7 +581,7 @@ func (s *Server) sendBody(w http.ResponseWriter, req *http.Request, backend *bac
 		if err != nil && !eof {
 			s.abortStream(channel, stream, info, backend)
 			http.Error(w, fmt.Sprintf("Error reading body for backend %v (%v)", backend.id, err), http.StatusGatewayTimeout)
-			return sendBodyResult_SentError, nil
+			return sendBodyResult_SentError, backendFrame{}
 		}
 
 		s.Log.Debugf("HB sendBody %v", nread)
@@ -404,7 +601,7 @@ func (s *Server) sendBody(w http.ResponseWriter, req *http.Request, backend *bac
 
 		if err := s.endFrameAndSend(backend, builder); err != nil {
 			http.Error(w, fmt.Sprintf("Error writing body to backend %v (%v)", backend.id, err), http.StatusGatewayTimeout)
-			return sendBodyResult_SentError, nil
+			return sendBodyResult_SentError, backendFrame{}
 		}
 		if len(builder.FinishedBytes()) > fbSizeEstimate {
 			// This is a major performance issue, and I don't expect it to ever happen
@@ -412,7 +609,7 @@ func (s *Server) sendBody(w http.ResponseWriter, req *http.Request, backend *bac
 		}
 	}
 
-	return sendBodyResult_Done, nil
+	return sendBodyResult_Done, backendFrame{}
 }
 
 func (s *Server) sendControlFrame(frameType int8, channel, stream uint64, backend *backendConnection) {
@@ -423,6 +620,38 @@ func (s *Server) sendControlFrame(frameType int8, channel, stream uint64, backen
 	}
 }
 
+// Called by the backend reader, once the stream has queued responseChanBufferHigh frames.
+// We check the queue again under controlLock, because the sender may have drained it in the meantime,
+// and it would then never see the Paused state that it must answer with a Resume.
+func (s *Server) pauseStream(channel, stream uint64, info *streamInfo) {
+	info.controlLock.Lock()
+	if info.getState() == streamStateActive && info.queued() >= responseChanBufferHigh {
+		info.setState(streamStatePaused)
+		s.sendControlFrame(TxFrameTypePause, channel, stream, info.backend)
+	}
+	info.controlLock.Unlock()
+}
+
+// Called by the sender, once the queue of a paused stream has drained to responseChanBufferLow
+func (s *Server) resumeStream(channel, stream uint64, info *streamInfo) {
+	info.controlLock.Lock()
+	if info.getState() == streamStatePaused && info.queued() <= responseChanBufferLow {
+		s.sendControlFrame(TxFrameTypeResume, channel, stream, info.backend)
+		info.setState(streamStateActive)
+	}
+	info.controlLock.Unlock()
+}
+
+// Give the backend 'bytes' more of the stream's response window
+func (s *Server) sendWindowUpdate(channel, stream uint64, bytes uint32, backend *backendConnection) {
+	builder := flatbuffers.NewBuilder(frameBaseSize)
+	s.startFrame(builder, TxFrameTypeWindowUpdate, channel, stream, nil)
+	TxFrameAddWindow(builder, bytes)
+	if err := s.endFrameAndSend(backend, builder); err != nil {
+		s.Log.Warnf("httpbridge Error sending WindowUpdate frame to backend %v (%v)", backend.id, err)
+	}
+}
+
 func (s *Server) abortStream(channel, stream uint64, info *streamInfo, backend *backendConnection) {
 	s.Log.Infof("httpbridge aborting stream %v:%v on backend %v", channel, stream, backend.id)
 	info.setState(streamStateAborted)
@@ -440,6 +669,20 @@ func (s *Server) startFrame(builder *flatbuffers.Builder, frameType int8, channe
 }
 
 func (s *Server) endFrameAndSend(backend *backendConnection, builder *flatbuffers.Builder) error {
+	frame_buf := s.endFrame(builder)
+
+	if backend.writer != nil {
+		return backend.writer.write(frame_buf)
+	}
+
+	backend.conWriteLock.Lock()
+	err := s.sendBytes(backend.con, frame_buf)
+	backend.conWriteLock.Unlock()
+	return err
+}
+
+// Finish the frame, and return it, along with its magic marker and size
+func (s *Server) endFrame(builder *flatbuffers.Builder) []byte {
 	frame := TxFrameEnd(builder)
 	builder.Finish(frame)
 	frame_size := uint32(builder.Offset())
@@ -453,12 +696,7 @@ func (s *Server) endFrameAndSend(backend *backendConnection, builder *flatbuffer
 	builder.Prep(flatbuffers.SizeUint32, flatbuffers.SizeUint32)
 	builder.PrependUint32(magicFrameMarker)
 
-	frame_buf := builder.Bytes[builder.Head() : builder.Head()+builder.Offset()]
-
-	backend.conWriteLock.Lock()
-	err := s.sendBytes(backend.con, frame_buf)
-	backend.conWriteLock.Unlock()
-	return err
+	return builder.Bytes[builder.Head() : builder.Head()+builder.Offset()]
 }
 
 func (s *Server) sendBytes(dst io.Writer, buf []byte) error {
@@ -474,12 +712,25 @@ func (s *Server) sendBytes(dst io.Writer, buf []byte) error {
 
 func (s *Server) sendResponse(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, info *streamInfo) {
 	haveSentHeader := false
+	useCredits := false
+	unacked := uint32(0) // Body bytes that the client has received, but that we haven't given back to the backend yet
 	for {
 		// If we've already sent the header of the response to the client, and the backend faults
 		// by timing out, or disconnecting, then we can't send another header, so we have to just
 		// return, and let the Go HTTP serving infrastructure handle the abort to the client.
 		select {
 		case frame := <-info.rchan:
+			info.refill()
+			if frame.TxFrame == nil {
+				// We aborted the stream, because its overflow grew too large
+				if !haveSentHeader {
+					http.Error(w, "httpbridge backend sent too much", http.StatusBadGateway)
+				}
+				return
+			}
+			if frame.Frametype() == TxFrameTypeHeader && frame.Window() != 0 && info.window != 0 {
+				useCredits = true
+			}
 			if err := s.sendResponseFrame(w, req, backend, channel, stream, frame); err != nil {
 				if err != io.EOF {
 					// The client is unable to receive our response, so inform the backend to stop trying
@@ -491,11 +742,15 @@ func (s *Server) sendResponse(w http.ResponseWriter, req *http.Request, backend
 				haveSentHeader = true
 			}
 
-			if info.getState() == streamStatePaused && len(info.rchan) <= responseChanBufferLow {
-				// Resume
-				//fmt.Printf("Resuming %v:%v\n", channel, stream)
-				s.sendControlFrame(TxFrameTypeResume, channel, stream, backend)
-				info.setState(streamStateActive)
+			if useCredits {
+				// Hand the window back in large pieces, so that a stream of small frames doesn't cost a WindowUpdate each
+				unacked += uint32(frame.BodyLength())
+				if unacked >= info.window/2 {
+					s.sendWindowUpdate(channel, stream, unacked, backend)
+					unacked = 0
+				}
+			} else if info.getState() == streamStatePaused && info.queued() <= responseChanBufferLow {
+				s.resumeStream(channel, stream, info)
 			}
 		case <-backend.disconnectChan:
 			if !haveSentHeader {
@@ -516,7 +771,7 @@ func (s *Server) sendResponse(w http.ResponseWriter, req *http.Request, backend
 }
 
 // Returns io.EOF when the stream is finished
-func (s *Server) sendResponseFrame(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, frame *TxFrame) error {
+func (s *Server) sendResponseFrame(w http.ResponseWriter, req *http.Request, backend *backendConnection, channel, stream uint64, frame backendFrame) error {
 	if frame.Frametype() == TxFrameTypeAbort {
 		// Don't do anything else - it's possible that we've already sent the header out, so it's pointless trying to send
 		// another one. If the backend had an intelligible error to send, then it would have sent it as a plain old HTTP
@@ -537,8 +792,18 @@ func (s *Server) sendResponseFrame(w http.ResponseWriter, req *http.Request, bac
 		statusCode, _ := strconv.Atoi(string(codeStr[:]))
 		keyBuf := [40]byte{}
 		valBuf := [100]byte{}
+		header := w.Header()
 		for i := 1; i < frame.HeadersLength(); i++ {
 			frame.Headers(line, i)
+			if id := line.Id(); id != 0 {
+				// The backend sends headers that repeat by id, so we reuse the header map entry that we made when it defined the id
+				if h := frame.headers.get(id); h == nil {
+					s.Log.Errorf("httpbridge backend %v sent undefined header id %v", backend.id, id)
+				} else if !h.skip {
+					header[h.key] = h.values
+				}
+				continue
+			}
 			key := keyBuf[:0]
 			val := valBuf[:0]
 			for j := 0; j < line.KeyLength(); j++ {
@@ -555,7 +820,7 @@ func (s *Server) sendResponseFrame(w http.ResponseWriter, req *http.Request, bac
 				//s.Log.Debugf("HB response is chunked")
 			} else {
 				//s.Log.Debugf("HB sending header (%v)=(%v)", keyStr, valStr)
-				w.Header().Set(keyStr, valStr)
+				header.Set(keyStr, valStr)
 			}
 		}
 		s.Log.Debugf("HB Writing status (%v)", statusCode)
@@ -587,9 +852,18 @@ func (s *Server) AcceptBackendConnections() error {
 			return err
 		}
 		backend := &backendConnection{
-			con:            con,
-			id:             0,
-			disconnectChan: make(chan bool),
+			con:             con,
+			id:              0,
+			disconnectChan:  make(chan bool),
+			responseHeaders: &responseHeaderTable{},
+		}
+		if s.BackendCoalesceDelay != 0 {
+			backend.writer = newCoalescingWriter(con, s.BackendCoalesceDelay, s.BackendCoalesceBytes, backend.disconnectChan)
+		}
+		if s.BackendHeaderTableSize == 0 {
+			backend.headers = newHeaderTable(defaultHeaderTableSize)
+		} else if s.BackendHeaderTableSize > 0 {
+			backend.headers = newHeaderTable(s.BackendHeaderTableSize)
 		}
 		go s.handleBackendConnection(backend)
 	}
@@ -688,27 +962,30 @@ func (s *Server) handleBackendConnection(backend *backendConnection) {
 			}
 
 			frame := GetRootAsTxFrame(buf[8:8+frameSize], 0)
-			info := s.findStreamInfo(frame.Channel(), frame.Stream(), backend)
-			if info != nil {
+			isHeader := frame.Frametype() == TxFrameTypeHeader
+			if isHeader {
+				// Learn the headers that this frame defines before anybody sees it, or any of the frames that refer to them
+				backend.responseHeaders.learn(frame)
+			}
+			if frame.Frametype() == TxFrameTypeHello {
+				if err = s.joinBackendGroup(backend, frame); err != nil {
+					s.Log.Errorf("httpbridge Backend %v sent invalid Hello frame: %v", backend.id, err)
+					break
+				}
+			} else if info := s.findStreamInfo(frame.Channel(), frame.Stream(), backend); info != nil {
 				s.Log.Debugf("HB Sending frame to chan")
 				state := info.getState()
-				if state != streamStateAborted {
-					isFull := len(info.rchan) == responseChanBufferSize
-					if isFull {
-						// I initially thought that I could have a fallback path here, by sending the frame from a different goroutine,
-						// but that doesn't work because now your frames are arriving out of order!
-						s.Log.Warnf("httpbridge response channel %v:%v is full for backend %v", frame.Channel(), frame.Stream(), backend.id)
-					}
-					info.rchan <- frame
-					if isFull {
-						s.Log.Warnf("httpbridge finished sending frame to full response channel %v:%v, for backend %v", frame.Channel(), frame.Stream(), backend.id)
-					}
+				if isHeader && frame.Window() != 0 && info.window != 0 {
+					// The backend honours our window, so it doesn't need Pause and Resume
+					info.setCredits()
 				}
-				if state == streamStateActive && len(info.rchan) >= responseChanBufferHigh && enablePause {
-					// Pause
-					//fmt.Printf("Pausing %v:%v\n", frame.Channel(), frame.Stream())
-					info.setState(streamStatePaused)
-					s.sendControlFrame(TxFrameTypePause, frame.Channel(), frame.Stream(), backend)
+				if state != streamStateAborted && !info.push(backendFrame{frame, backend.responseHeaders}) {
+					s.Log.Warnf("httpbridge backend %v sent too much on stream %v:%v, which the client isn't reading fast enough", backend.id, frame.Channel(), frame.Stream())
+					s.abortStream(frame.Channel(), frame.Stream(), info, info.backend)
+					state = streamStateAborted
+				}
+				if state == streamStateActive && enablePause && !info.usesCredits() && info.queued() >= responseChanBufferHigh {
+					s.pauseStream(frame.Channel(), frame.Stream(), info)
 				}
 			}
 
@@ -752,33 +1029,110 @@ func (s *Server) removeBackend(backend *backendConnection) {
 			break
 		}
 	}
+	if g := backend.group; g != nil {
+		// The other connections of the group are useless without this one, so close them too.
+		// Their own handleBackendConnection will then remove them.
+		empty := true
+		for i, c := range g.conns {
+			if c == backend {
+				g.conns[i] = nil
+			} else if c != nil {
+				c.con.Close()
+				empty = false
+			}
+		}
+		if empty {
+			delete(s.backendGroups, g.token)
+		}
+	}
 	s.Log.Infof("Backend %v removed. %v remaining", backend.id, len(s.backends))
 	s.backendsLock.Unlock()
 }
 
+// Add a connection to its backend group, as described by the Hello frame that it sent us
+func (s *Server) joinBackendGroup(backend *backendConnection, frame *TxFrame) error {
+	token := ""
+	count := 0
+	index := -1
+	line := &TxHeaderLine{}
+	for i := 0; i < frame.HeadersLength(); i++ {
+		frame.Headers(line, i)
+		val := string(line.ValueBytes())
+		switch string(line.KeyBytes()) {
+		case "Backend":
+			token = val
+		case "Connections":
+			count, _ = strconv.Atoi(val)
+		case "Connection":
+			index, _ = strconv.Atoi(val)
+		}
+	}
+	if token == "" || count < 1 || count > 1024 || index < 0 || index >= count {
+		return fmt.Errorf("token '%v', connection %v of %v", token, index, count)
+	}
+
+	s.backendsLock.Lock()
+	defer s.backendsLock.Unlock()
+	if backend.group != nil {
+		return fmt.Errorf("Hello sent twice")
+	}
+	g := s.backendGroups[token]
+	if g == nil {
+		g = &backendGroup{
+			token: token,
+			conns: make([]*backendConnection, count),
+		}
+		s.backendGroups[token] = g
+	}
+	if len(g.conns) != count || g.conns[index] != nil {
+		return fmt.Errorf("connection %v of %v conflicts with group of %v", index, count, len(g.conns))
+	}
+	g.conns[index] = backend
+	backend.group = g
+	s.Log.Infof("Backend %v is connection %v of %v for backend group %v", backend.id, index, count, token)
+	return nil
+}
+
 // At some point we'll probably want to have multiple backends, matched by HTTP route.
 // Right now we simply return the one and only backend, if it exists. Otherwise null.
 // Of course, if we have more than 1 backend, we could just round-robin between them,
 // or whatever. BUT, before we do that, we need to establish a scheme, and do it properly.
-func (s *Server) findBackend(req *http.Request) (*backendConnection, error) {
+// A backend group counts as one backend. While a group exists, we assume that any connection
+// which is not part of a group is one of the group's connections that hasn't sent its Hello yet.
+func (s *Server) findBackend(req *http.Request, channel, stream uint64) (*backendConnection, error) {
 	s.backendsLock.Lock()
 	defer s.backendsLock.Unlock()
-	if len(s.backends) == 1 {
+	if len(s.backendGroups) == 1 {
+		for _, g := range s.backendGroups {
+			// Spread requests evenly over the connections. Our channel numbers are sequential.
+			start := int((channel ^ stream) % uint64(len(g.conns)))
+			for i := 0; i < len(g.conns); i++ {
+				if c := g.conns[(start+i)%len(g.conns)]; c != nil {
+					return c, nil
+				}
+			}
+		}
+	} else if len(s.backendGroups) == 0 && len(s.backends) == 1 {
 		return s.backends[0], nil
-	} else {
-		return nil, fmt.Errorf("Expected 1 httpbridge backend, but found %v", len(s.backends))
 	}
+	return nil, fmt.Errorf("Expected 1 httpbridge backend, but found %v connections in %v groups", len(s.backends), len(s.backendGroups))
 }
 
-func (s *Server) registerStream(channel, stream uint64) *streamInfo {
+func (s *Server) registerStream(channel, stream uint64, backend *backendConnection) *streamInfo {
 	s.responsesLock.Lock()
 	sid := makeStreamID(channel, stream)
 	if _, ok := s.responses[sid]; ok {
 		s.Log.Fatalf("httpbridge registerStream called twice on the same stream (%v:%v)", channel, stream)
 	}
 	info := &streamInfo{
-		state: streamStateActive,
-		rchan: make(responseChan, responseChanBufferSize),
+		state:   streamStateActive,
+		rchan:   make(responseChan, responseChanBufferSize),
+		backend: backend,
+	}
+	if s.BackendStreamWindow == 0 {
+		info.window = defaultStreamWindow
+	} else if s.BackendStreamWindow > 0 {
+		info.window = uint32(s.BackendStreamWindow)
 	}
 	s.responses[sid] = info
 	s.responsesLock.Unlock()
@@ -788,10 +1142,12 @@ func (s *Server) registerStream(channel, stream uint64) *streamInfo {
 func (s *Server) unregisterStream(channel, stream uint64) {
 	s.responsesLock.Lock()
 	sid := makeStreamID(channel, stream)
-	if _, ok := s.responses[sid]; !ok {
+	info, ok := s.responses[sid]
+	if !ok {
 		s.Log.Fatalf("httpbridge unregisterStream called on a non-existing stream (%v:%v)", channel, stream)
 	}
 	delete(s.responses, sid)
+	info.unregister()
 	// We don't close the channel here, because writing to a closed channel causes a panic.
 	// How could we end up trying to write to this channel if it's closed? That could come
 	// about if we, for some reason, sent an ABORT to the backend for this stream, but
@@ -848,3 +1204,30 @@ func makeTxHttpVersionNumber(req *http.Request) int8 {
 func createByteVectorFromString(b *flatbuffers.Builder, value string) flatbuffers.UOffsetT {
 	return b.CreateByteVector([]byte(value))
 }
+
+// Create a TxHeaderLine. If table is not nil, then the line may refer to the pair by id.
+// 'empty' is an empty byte vector that all id-only lines of a frame share. It is created when first needed.
+func createHeaderLine(b *flatbuffers.Builder, table *headerTable, empty *flatbuffers.UOffsetT, key, value string) flatbuffers.UOffsetT {
+	id, known := uint16(0), false
+	if table != nil {
+		id, known = table.lookup(key, value)
+	}
+	var fbKey, fbVal flatbuffers.UOffsetT
+	if known {
+		// The backend already has the pair, so we send empty key and value vectors, which means "retrieve"
+		if *empty == 0 {
+			*empty = b.CreateByteVector(nil)
+		}
+		fbKey, fbVal = *empty, *empty
+	} else {
+		fbKey = createByteVectorFromString(b, key)
+		fbVal = createByteVectorFromString(b, value)
+	}
+	TxHeaderLineStart(b)
+	TxHeaderLineAddKey(b, fbKey)
+	TxHeaderLineAddValue(b, fbVal)
+	if id != 0 {
+		TxHeaderLineAddId(b, id)
+	}
+	return TxHeaderLineEnd(b)
+}
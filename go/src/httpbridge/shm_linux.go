@@ -0,0 +1,334 @@
+//go:build linux
+// +build linux
+
+package httpbridge
+
+import (
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+	"os"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// Shared memory transport (BackendNetwork = "shm").
+//
+// The backend connects to our unix socket, and sends us a memfd and four eventfds (using SCM_RIGHTS).
+// The memfd holds a control page, followed by two single-producer/single-consumer byte rings.
+// Ring 0 carries frames from the backend to us, and ring 1 carries frames from us to the backend.
+// Each ring has a "data ready" doorbell, which the producer rings, and a "space ready" doorbell,
+// which the consumer rings. A doorbell is only rung if the other side has announced that it is
+// about to go to sleep, so while both sides are busy, no syscalls are needed to move a frame.
+// After the handshake, the unix socket carries no data. We use it only to detect a dead backend.
+//
+// The byte stream inside the rings is identical to the TCP byte stream, so we wrap all of this
+// up as a net.Conn, and handleBackendConnection doesn't know the difference.
+//
+// The layout here must match TransportShm in http-bridge.cpp
+
+const (
+	shmHandshakeMagic     = 0x48427368 // "HBsh"
+	shmVersion            = 1
+	shmRingControlStride  = 256
+	shmOffTail            = 0
+	shmOffHead            = 64
+	shmOffConsumerWaiting = 128
+	shmOffProducerWaiting = 132
+	shmHandshakeTimeout   = 5 * time.Second
+)
+
+var errShmClosed = errors.New("httpbridge shm connection closed")
+
+type shmListener struct {
+	net.Listener
+	log *Logger
+}
+
+func listenShm(path string, log *Logger) (net.Listener, error) {
+	l, err := net.Listen("unix", path)
+	if err != nil {
+		return nil, err
+	}
+	return &shmListener{l, log}, nil
+}
+
+// Accept waits for a backend to connect, and then performs the shared memory handshake with it.
+// A backend that fails the handshake is dropped, without affecting the listener.
+func (l *shmListener) Accept() (net.Conn, error) {
+	for {
+		con, err := l.Listener.Accept()
+		if err != nil {
+			return nil, err
+		}
+		sc, err := newShmConn(con.(*net.UnixConn))
+		if err == nil {
+			return sc, nil
+		}
+		l.log.Errorf("httpbridge shm handshake failed: %v", err)
+		con.Close()
+	}
+}
+
+type shmRing struct {
+	tail            *uint64
+	head            *uint64
+	consumerWaiting *uint32
+	producerWaiting *uint32
+	data            []byte
+	dataReady       *os.File // eventfd, rung by producer
+	spaceReady      *os.File // eventfd, rung by consumer
+}
+
+type shmConn struct {
+	con       *net.UnixConn
+	mem       []byte
+	rx        shmRing // backend -> server
+	tx        shmRing // server -> backend
+	closed    int32   // atomic
+	refs      int32   // atomic. The mapping is released when this drops to zero.
+	closeOnce sync.Once
+}
+
+func newShmConn(con *net.UnixConn) (*shmConn, error) {
+	con.SetReadDeadline(time.Now().Add(shmHandshakeTimeout))
+	msg := make([]byte, 16)
+	oob := make([]byte, syscall.CmsgSpace(5*4))
+	n, oobn, _, _, err := con.ReadMsgUnix(msg, oob)
+	if err != nil {
+		return nil, err
+	}
+	fds, err := shmParseRights(oob[:oobn])
+	if err != nil {
+		return nil, err
+	}
+	if len(fds) != 5 {
+		shmCloseFds(fds)
+		return nil, errors.New("expected 5 file descriptors")
+	}
+	ringSize := int(binary.LittleEndian.Uint32(msg[8:12]))
+	controlSize := int(binary.LittleEndian.Uint32(msg[12:16]))
+	if n != len(msg) || binary.LittleEndian.Uint32(msg[0:4]) != shmHandshakeMagic || binary.LittleEndian.Uint32(msg[4:8]) != shmVersion ||
+		ringSize == 0 || ringSize&(ringSize-1) != 0 || controlSize < 2*shmRingControlStride {
+		shmCloseFds(fds)
+		return nil, errors.New("invalid handshake")
+	}
+
+	mem, err := syscall.Mmap(fds[0], 0, controlSize+2*ringSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	syscall.Close(fds[0])
+	if err != nil {
+		shmCloseFds(fds[1:])
+		return nil, err
+	}
+
+	// The eventfds are created non-blocking, so os.NewFile hooks them up to the runtime poller,
+	// and a goroutine waiting on a doorbell doesn't tie up an OS thread.
+	c := &shmConn{
+		con:  con,
+		mem:  mem,
+		refs: 1,
+	}
+	c.rx = shmMakeRing(mem, 0, controlSize, ringSize, fds[1], fds[2])
+	c.tx = shmMakeRing(mem, 1, controlSize, ringSize, fds[3], fds[4])
+
+	ack := make([]byte, 4)
+	binary.LittleEndian.PutUint32(ack, shmHandshakeMagic)
+	if _, err := con.Write(ack); err != nil {
+		c.Close()
+		return nil, err
+	}
+	con.SetReadDeadline(time.Time{})
+
+	// The backend never sends anything more over the socket, so when this read returns, the backend is gone
+	go func() {
+		var b [1]byte
+		con.Read(b[:])
+		c.Close()
+	}()
+
+	return c, nil
+}
+
+func shmParseRights(oob []byte) ([]int, error) {
+	msgs, err := syscall.ParseSocketControlMessage(oob)
+	if err != nil {
+		return nil, err
+	}
+	fds := []int{}
+	for i := range msgs {
+		if f, err := syscall.ParseUnixRights(&msgs[i]); err == nil {
+			fds = append(fds, f...)
+		}
+	}
+	return fds, nil
+}
+
+func shmCloseFds(fds []int) {
+	for _, fd := range fds {
+		syscall.Close(fd)
+	}
+}
+
+func shmMakeRing(mem []byte, index, controlSize, ringSize int, dataReady, spaceReady int) shmRing {
+	ctl := index * shmRingControlStride
+	data := controlSize + index*ringSize
+	return shmRing{
+		tail:            (*uint64)(unsafe.Pointer(&mem[ctl+shmOffTail])),
+		head:            (*uint64)(unsafe.Pointer(&mem[ctl+shmOffHead])),
+		consumerWaiting: (*uint32)(unsafe.Pointer(&mem[ctl+shmOffConsumerWaiting])),
+		producerWaiting: (*uint32)(unsafe.Pointer(&mem[ctl+shmOffProducerWaiting])),
+		data:            mem[data : data+ringSize],
+		dataReady:       os.NewFile(uintptr(dataReady), "httpbridge-doorbell"),
+		spaceReady:      os.NewFile(uintptr(spaceReady), "httpbridge-doorbell"),
+	}
+}
+
+func (c *shmConn) isClosed() bool {
+	return atomic.LoadInt32(&c.closed) != 0
+}
+
+// acquire and release keep the mapping alive while a Read or Write is busy with it
+func (c *shmConn) acquire() bool {
+	atomic.AddInt32(&c.refs, 1)
+	if c.isClosed() {
+		c.release()
+		return false
+	}
+	return true
+}
+
+func (c *shmConn) release() {
+	if atomic.AddInt32(&c.refs, -1) == 0 {
+		syscall.Munmap(c.mem)
+		c.rx.dataReady.Close()
+		c.rx.spaceReady.Close()
+		c.tx.dataReady.Close()
+		c.tx.spaceReady.Close()
+	}
+}
+
+func (c *shmConn) waitForDoorbell(doorbell *os.File) error {
+	var b [8]byte
+	if _, err := doorbell.Read(b[:]); err != nil || c.isClosed() {
+		return errShmClosed
+	}
+	return nil
+}
+
+func ringDoorbell(doorbell *os.File) {
+	var b [8]byte
+	binary.LittleEndian.PutUint64(b[:], 1)
+	doorbell.Write(b[:])
+}
+
+func (c *shmConn) Read(p []byte) (int, error) {
+	if !c.acquire() {
+		return 0, io.EOF
+	}
+	defer c.release()
+	r := &c.rx
+	head := atomic.LoadUint64(r.head)
+	avail := atomic.LoadUint64(r.tail) - head
+	for avail == 0 {
+		// Announce that we're going to sleep, and then check again, so that we can't miss the producer's doorbell
+		atomic.StoreUint32(r.consumerWaiting, 1)
+		avail = atomic.LoadUint64(r.tail) - head
+		if avail == 0 {
+			if err := c.waitForDoorbell(r.dataReady); err != nil {
+				atomic.StoreUint32(r.consumerWaiting, 0)
+				return 0, io.EOF
+			}
+			avail = atomic.LoadUint64(r.tail) - head
+		}
+		atomic.StoreUint32(r.consumerWaiting, 0)
+	}
+	n := int(avail)
+	if n > len(p) {
+		n = len(p)
+	}
+	pos := int(head & uint64(len(r.data)-1))
+	first := copy(p[:n], r.data[pos:])
+	copy(p[first:n], r.data)
+	atomic.StoreUint64(r.head, head+uint64(n))
+	if atomic.LoadUint32(r.producerWaiting) != 0 {
+		ringDoorbell(r.spaceReady)
+	}
+	return n, nil
+}
+
+func (c *shmConn) Write(p []byte) (int, error) {
+	if !c.acquire() {
+		return 0, errShmClosed
+	}
+	defer c.release()
+	r := &c.tx
+	size := uint64(len(r.data))
+	tail := atomic.LoadUint64(r.tail)
+	sent := 0
+	for sent != len(p) {
+		space := size - (tail - atomic.LoadUint64(r.head))
+		if space == 0 {
+			atomic.StoreUint32(r.producerWaiting, 1)
+			space = size - (tail - atomic.LoadUint64(r.head))
+			if space == 0 {
+				if err := c.waitForDoorbell(r.spaceReady); err != nil {
+					atomic.StoreUint32(r.producerWaiting, 0)
+					return sent, err
+				}
+			}
+			atomic.StoreUint32(r.producerWaiting, 0)
+			continue
+		}
+		n := len(p) - sent
+		if uint64(n) > space {
+			n = int(space)
+		}
+		pos := int(tail & (size - 1))
+		first := copy(r.data[pos:], p[sent:sent+n])
+		copy(r.data, p[sent+first:sent+n])
+		tail += uint64(n)
+		sent += n
+		atomic.StoreUint64(r.tail, tail)
+		if atomic.LoadUint32(r.consumerWaiting) != 0 {
+			ringDoorbell(r.dataReady)
+		}
+	}
+	return sent, nil
+}
+
+func (c *shmConn) Close() error {
+	c.closeOnce.Do(func() {
+		atomic.StoreInt32(&c.closed, 1)
+		c.con.Close()
+		// Wake up our own Read and Write, if they're sleeping. The eventfd counters stick, so this works even if they haven't gone to sleep yet.
+		ringDoorbell(c.rx.dataReady)
+		ringDoorbell(c.tx.spaceReady)
+		c.release()
+	})
+	return nil
+}
+
+func (c *shmConn) LocalAddr() net.Addr {
+	return c.con.LocalAddr()
+}
+
+func (c *shmConn) RemoteAddr() net.Addr {
+	return c.con.RemoteAddr()
+}
+
+// Deadlines are not supported on shared memory connections
+func (c *shmConn) SetDeadline(t time.Time) error {
+	return nil
+}
+
+func (c *shmConn) SetReadDeadline(t time.Time) error {
+	return nil
+}
+
+func (c *shmConn) SetWriteDeadline(t time.Time) error {
+	return nil
+}
@@ -0,0 +1,13 @@
+//go:build !linux
+// +build !linux
+
+package httpbridge
+
+import (
+	"errors"
+	"net"
+)
+
+func listenShm(path string, log *Logger) (net.Listener, error) {
+	return nil, errors.New("httpbridge shm backend network is only supported on Linux")
+}
@@ -44,7 +44,26 @@ Build {
 			},
 			Libs = {
 				{ "Ws2_32.lib"; Config = "win*" },
-				{ "stdc++"; Config = {"*-gcc-*", "*-clang-*"} },
+				{ "pthread", "stdc++"; Config = {"*-gcc-*", "*-clang-*"} },
+			},
+		}
+
+		-- The unit tests again, with the optional io_uring transport. Not built by default, because it needs linux/io_uring.h.
+		local unit_test_uring = Program {
+			Name = "unit-test-uring",
+			Sources = {
+				"cpp/unit-test.cpp",
+				"cpp/http-bridge.cpp",
+				"cpp/http-bridge.h",
+			},
+			Defines = {
+				{ "HTTPBRIDGE_IO_URING"; Config = "linux-*" },
+			},
+			Includes = {
+				"cpp/flatbuffers/include",
+			},
+			Libs = {
+				{ "pthread", "stdc++"; Config = {"*-gcc-*", "*-clang-*"} },
 			},
 		}
 
@@ -69,6 +88,26 @@ Build {
 			},
 		}
 
+		local benchmark = Program {
+			Name = "benchmark",
+			Sources = {
+				"cpp/benchmark.cpp",
+				"cpp/http-bridge.cpp",
+				"cpp/http-bridge.h",
+			},
+			Defines = {
+				-- The benchmark compares the optional io_uring transport against tcp
+				{ "HTTPBRIDGE_IO_URING"; Config = "linux-*" },
+			},
+			Includes = {
+				"cpp/flatbuffers/include",
+			},
+			Libs = {
+				{ "Ws2_32.lib"; Config = "win*" },
+				{ "pthread", "stdc++"; Config = {"*-gcc-*", "*-clang-*"} },
+			},
+		}
+
 		Default(example_backend)
 		Default(unit_test)
 		Default(server)